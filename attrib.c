@@ -189,10 +189,17 @@ int attr_allocate_clusters(struct ntfs_sb_info *sbi, struct runs_tree *run,
 	CLST flen, vcn0 = vcn, pre = pre_alloc ? *pre_alloc : 0;
 	struct wnd_bitmap *wnd = &sbi->used.bitmap;
 	size_t cnt = run->count;
+	struct ntfs_run ext0[8], *ext = ext0, *big = NULL;
+	size_t i, n, max_ext = ARRAY_SIZE(ext0);
 
 	for (;;) {
-		err = ntfs_look_for_free_space(sbi, lcn, len + pre, &lcn, &flen,
-					       opt);
+		/* Get as many fragments as possible with one lock of bitmap */
+		n = opt == ALLOCATE_MFT ? 1 : max_ext;
+		if (fr && n > fr - (run->count - cnt))
+			n = fr - (run->count - cnt);
+
+		err = ntfs_look_for_free_extents(sbi, lcn, len, pre, ext, &n,
+						 opt);
 
 		if (err == -ENOSPC && pre) {
 			pre = 0;
@@ -205,29 +212,44 @@ int attr_allocate_clusters(struct ntfs_sb_info *sbi, struct runs_tree *run,
 			goto out;
 
 		if (new_lcn && vcn == vcn0)
-			*new_lcn = lcn;
+			*new_lcn = ext[0].lcn;
 
-		/* Add new fragment into run storage */
-		if (!run_add_entry(run, vcn, lcn, flen, opt == ALLOCATE_MFT)) {
+		/* Add new fragments into run storage */
+		if (!run_add_entries(run, vcn, ext, n, opt == ALLOCATE_MFT)) {
 			down_write_nested(&wnd->rw_lock, BITMAP_MUTEX_CLUSTERS);
-			wnd_set_free(wnd, lcn, flen);
+			for (i = 0; i < n; i++)
+				wnd_set_free(wnd, ext[i].lcn, ext[i].len);
 			up_write(&wnd->rw_lock);
 			err = -ENOMEM;
 			goto out;
 		}
 
+		for (i = 0, flen = 0; i < n; i++)
+			flen += ext[i].len;
 		vcn += flen;
 
 		if (flen >= len || opt == ALLOCATE_MFT ||
 		    (fr && run->count - cnt >= fr)) {
 			*alen = vcn - vcn0;
+			ntfs_free(big);
 			return 0;
 		}
 
 		len -= flen;
+		lcn = ext[n - 1].lcn + ext[n - 1].len;
+
+		if (!big) {
+			/* Volume is fragmented. Use bigger batches */
+			big = ntfs_malloc(PAGE_SIZE);
+			if (big) {
+				ext = big;
+				max_ext = PAGE_SIZE / sizeof(struct ntfs_run);
+			}
+		}
 	}
 
 out:
+	ntfs_free(big);
 	/* undo */
 	run_deallocate_ex(sbi, run, vcn0, vcn - vcn0, NULL, false);
 	run_truncate(run, vcn0);
@@ -235,6 +257,46 @@ out:
 	return err;
 }
 
+/*
+ * attr_write_first_page
+ *
+ * helper for attr_make_nonresident
+ * copies resident data into page 0 and writes it to just allocated clusters
+ * with one block aligned bio. The page stays uptodate, so the next
+ * write_begin neither reads it back nor waits for writeback to map it
+ */
+static int attr_write_first_page(struct ntfs_inode *ni, struct runs_tree *run,
+				 const void *data, u32 rsize)
+{
+	int err;
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	struct page *page;
+	char *kaddr;
+
+	page = grab_cache_page(ni->vfs_inode.i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+
+	/* uptodate page may be newer than record, see NI_FLAG_PACK */
+	if (!PageUptodate(page)) {
+		kaddr = kmap_atomic(page);
+		memcpy(kaddr, data, rsize);
+		memset(kaddr + rsize, 0, PAGE_SIZE - rsize);
+		kunmap_atomic(kaddr);
+		flush_dcache_page(page);
+	}
+
+	err = ntfs_bio_pages(sbi, run, &page, 1, 0,
+			     ALIGN(rsize, sbi->sb->s_blocksize), REQ_OP_WRITE);
+	if (!err)
+		SetPageUptodate(page);
+
+	unlock_page(page);
+	put_page(page);
+
+	return err;
+}
+
 /*
  * if page is not NULL - it is already contains resident data
  * and locked (called from ni_write_frame)
@@ -300,22 +362,9 @@ int attr_make_nonresident(struct ntfs_inode *ni, struct ATTRIB *attr,
 			if (err)
 				goto out2;
 		} else if (!page) {
-			char *kaddr;
-
-			page = grab_cache_page(ni->vfs_inode.i_mapping, 0);
-			if (!page) {
-				err = -ENOMEM;
+			err = attr_write_first_page(ni, run, data, rsize);
+			if (err)
 				goto out2;
-			}
-			kaddr = kmap_atomic(page);
-			memcpy(kaddr, data, rsize);
-			memset(kaddr + rsize, 0, PAGE_SIZE - rsize);
-			kunmap_atomic(kaddr);
-			flush_dcache_page(page);
-			SetPageUptodate(page);
-			set_page_dirty(page);
-			unlock_page(page);
-			put_page(page);
 		}
 	}
 
@@ -340,7 +389,7 @@ int attr_make_nonresident(struct ntfs_inode *ni, struct ATTRIB *attr,
 	*ins_attr = attr;
 
 	if (is_data)
-		ni->ni_flags &= ~NI_FLAG_RESIDENT;
+		ni->ni_flags &= ~(NI_FLAG_RESIDENT | NI_FLAG_PACK);
 
 	/* Resident attribute becomes non resident */
 	return 0;
@@ -362,6 +411,38 @@ out:
 	return err;
 }
 
+/*
+ * attr_force_nonresident
+ *
+ * moves resident unnamed data stream out of mft record
+ */
+int attr_force_nonresident(struct ntfs_inode *ni)
+{
+	int err;
+	struct ATTRIB *attr;
+	struct ATTR_LIST_ENTRY *le = NULL;
+	struct mft_inode *mi;
+
+	ni_lock(ni);
+
+	attr = ni_find_attr(ni, NULL, &le, ATTR_DATA, NULL, 0, NULL, &mi);
+	if (!attr) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	down_write(&ni->file.run_lock);
+	err = attr_make_nonresident(ni, attr, le, mi,
+				    le32_to_cpu(attr->res.data_size),
+				    &ni->file.run, &attr, NULL);
+	up_write(&ni->file.run_lock);
+
+out:
+	ni_unlock(ni);
+
+	return err;
+}
+
 /*
  * attr_set_size_res
  *
@@ -641,7 +722,7 @@ pack_runs:
 			goto again;
 		}
 
-		if (!ni->attr_list.size) {
+		if (!ni->attr_list) {
 			err = ni_create_attr_list(ni);
 			if (err)
 				goto out;
@@ -820,13 +901,20 @@ out:
 	return err;
 }
 
-int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
-			CLST *len, bool *new)
+/*
+ * attr_data_get_block_locked
+ *
+ * allocates clusters for [vcn, vcn + clen) of the (possible named) sparse
+ * data stream if they are not allocated yet
+ * ni_lock and run_lock of 'run' should be held
+ */
+int attr_data_get_block_locked(struct ntfs_inode *ni, const __le16 *name,
+			       u8 name_len, struct runs_tree *run, CLST vcn,
+			       CLST clen, CLST *lcn, CLST *len, bool *new)
 {
 	int err = 0;
-	struct runs_tree *run = &ni->file.run;
-	struct ntfs_sb_info *sbi;
-	u8 cluster_bits;
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	u8 cluster_bits = sbi->cluster_bits;
 	struct ATTRIB *attr = NULL, *attr_b;
 	struct ATTR_LIST_ENTRY *le, *le_b;
 	struct mft_inode *mi, *mi_b;
@@ -838,29 +926,12 @@ int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
 	if (new)
 		*new = false;
 
-	down_read(&ni->file.run_lock);
-	ok = run_lookup_entry(run, vcn, lcn, len, NULL);
-	up_read(&ni->file.run_lock);
-
-	if (ok && (*lcn != SPARSE_LCN || !new)) {
-		/* normal way */
-		return 0;
-	}
-
 	if (!clen)
 		clen = 1;
 
-	if (ok && clen > *len)
-		clen = *len;
-
-	sbi = ni->mi.sbi;
-	cluster_bits = sbi->cluster_bits;
-
-	ni_lock(ni);
-	down_write(&ni->file.run_lock);
-
 	le_b = NULL;
-	attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, NULL, 0, NULL, &mi_b);
+	attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, name, name_len, NULL,
+			      &mi_b);
 	if (!attr_b) {
 		err = -ENOENT;
 		goto out;
@@ -892,8 +963,8 @@ int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
 	mi = mi_b;
 
 	if (le_b && (vcn < svcn || evcn1 <= vcn)) {
-		attr = ni_find_attr(ni, attr_b, &le, ATTR_DATA, NULL, 0, &vcn,
-				    &mi);
+		attr = ni_find_attr(ni, attr_b, &le, ATTR_DATA, name, name_len,
+				    &vcn, &mi);
 		if (!attr) {
 			err = -EINVAL;
 			goto out;
@@ -906,25 +977,22 @@ int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
 	if (err)
 		goto out;
 
-	if (!ok) {
-		ok = run_lookup_entry(run, vcn, lcn, len, NULL);
-		if (ok && (*lcn != SPARSE_LCN || !new)) {
-			/* normal way */
-			err = 0;
-			goto ok;
-		}
+	ok = run_lookup_entry(run, vcn, lcn, len, NULL);
+	if (ok && (*lcn != SPARSE_LCN || !new)) {
+		/* normal way */
+		err = 0;
+		goto ok;
+	}
 
-		if (!ok && !new) {
-			*len = 0;
-			err = 0;
-			goto ok;
-		}
+	if (!ok && !new) {
+		*len = 0;
+		err = 0;
+		goto ok;
+	}
 
-		if (ok && clen > *len) {
-			clen = *len;
-			to_alloc = (clen + clst_per_frame - 1) &
-				   ~(clst_per_frame - 1);
-		}
+	if (ok && clen > *len) {
+		clen = *len;
+		to_alloc = (clen + clst_per_frame - 1) & ~(clst_per_frame - 1);
 	}
 
 	if (!is_attr_ext(attr_b)) {
@@ -964,8 +1032,10 @@ repack:
 		goto out;
 
 	attr_b->nres.total_size = cpu_to_le64(total_size);
-	inode_set_bytes(&ni->vfs_inode, total_size);
-	ni->ni_flags |= NI_FLAG_UPDATE_PARENT;
+	if (!name_len) {
+		inode_set_bytes(&ni->vfs_inode, total_size);
+		ni->ni_flags |= NI_FLAG_UPDATE_PARENT;
+	}
 
 	mi_b->dirty = true;
 	mark_inode_dirty(&ni->vfs_inode);
@@ -979,14 +1049,14 @@ repack:
 			goto ok;
 		}
 		/* add new segment [next_svcn : evcn1 - next_svcn )*/
-		if (!ni->attr_list.size) {
+		if (!ni->attr_list) {
 			err = ni_create_attr_list(ni);
 			if (err)
 				goto out;
 			/* layout of records is changed */
 			le_b = NULL;
-			attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, NULL,
-					      0, NULL, &mi_b);
+			attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, name,
+					      name_len, NULL, &mi_b);
 			if (!attr_b) {
 				err = -ENOENT;
 				goto out;
@@ -1002,7 +1072,8 @@ repack:
 	svcn = evcn1;
 
 	/* Estimate next attribute */
-	attr = ni_find_attr(ni, attr, &le, ATTR_DATA, NULL, 0, &svcn, &mi);
+	attr = ni_find_attr(ni, attr, &le, ATTR_DATA, name, name_len, &svcn,
+			    &mi);
 
 	if (attr) {
 		CLST alloc = bytes_to_cluster(
@@ -1031,7 +1102,7 @@ repack:
 				goto out;
 			}
 
-			attr = mi_find_attr(mi, NULL, ATTR_DATA, NULL, 0,
+			attr = mi_find_attr(mi, NULL, ATTR_DATA, name, name_len,
 					    &le->id);
 			if (!attr) {
 				err = -EINVAL;
@@ -1055,14 +1126,14 @@ repack:
 			goto out;
 
 		le->vcn = cpu_to_le64(next_svcn);
-		ni->attr_list.dirty = true;
+		ni->attr_list->dirty = true;
 		mi->dirty = true;
 
 		next_svcn = le64_to_cpu(attr->nres.evcn) + 1;
 	}
 ins_ext:
 	if (evcn1 > next_svcn) {
-		err = ni_insert_nonresident(ni, ATTR_DATA, NULL, 0, run,
+		err = ni_insert_nonresident(ni, ATTR_DATA, name, name_len, run,
 					    next_svcn, evcn1 - next_svcn,
 					    attr_b->flags, &attr, &mi);
 		if (err)
@@ -1071,6 +1142,36 @@ ins_ext:
 ok:
 	run_truncate_around(run, vcn);
 out:
+	return err;
+}
+
+int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
+			CLST *len, bool *new)
+{
+	int err;
+	bool ok;
+
+	if (new)
+		*new = false;
+
+	down_read(&ni->file.run_lock);
+	ok = run_lookup_entry(&ni->file.run, vcn, lcn, len, NULL);
+	up_read(&ni->file.run_lock);
+
+	if (ok && (*lcn != SPARSE_LCN || !new)) {
+		/* normal way */
+		return 0;
+	}
+
+	if (ok && clen > *len)
+		clen = *len;
+
+	ni_lock(ni);
+	down_write(&ni->file.run_lock);
+
+	err = attr_data_get_block_locked(ni, NULL, 0, &ni->file.run, vcn, clen,
+					 lcn, len, new);
+
 	up_write(&ni->file.run_lock);
 	ni_unlock(ni);
 
@@ -1211,10 +1312,12 @@ int attr_load_runs_range(struct ntfs_inode *ni, enum ATTR_TYPE type,
  * attr_wof_frame_info
  *
  * read header of xpress/lzx file to get info about frame
+ * Runs of WofCompressedData are taken from ni->file.wof_run under run_lock:
+ * file may be decompressed (and runs freed) by other task
  */
 int attr_wof_frame_info(struct ntfs_inode *ni, struct ATTRIB *attr,
-			struct runs_tree *run, u64 frame, u64 frames,
-			u8 frame_bits, u32 *ondisk_size, u64 *vbo_data)
+			u64 frame, u64 frames, u8 frame_bits, u32 *ondisk_size,
+			u64 *vbo_data)
 {
 	struct ntfs_sb_info *sbi = ni->mi.sbi;
 	u64 vbo[2], off[2], wof_size;
@@ -1222,7 +1325,8 @@ int attr_wof_frame_info(struct ntfs_inode *ni, struct ATTRIB *attr,
 	u8 bytes_per_off;
 	char *addr;
 	struct page *page;
-	int i, err;
+	struct runs_tree *run;
+	int i, err = 0;
 	__le32 *off32;
 	__le64 *off64;
 
@@ -1266,6 +1370,13 @@ int attr_wof_frame_info(struct ntfs_inode *ni, struct ATTRIB *attr,
 
 	wof_size = le64_to_cpu(attr->nres.data_size);
 	down_write(&ni->file.run_lock);
+	run = ni->file.wof_run;
+	if (!run) {
+		/* file is decompressed */
+		err = -EINVAL;
+		goto out;
+	}
+
 	page = ni->file.offs_page;
 	if (!page) {
 		page = alloc_page(GFP_KERNEL);
@@ -1297,12 +1408,6 @@ int attr_wof_frame_info(struct ntfs_inode *ni, struct ATTRIB *attr,
 			u64 from = vbo[i] & ~(u64)(PAGE_SIZE - 1);
 			u64 to = min(from + PAGE_SIZE, wof_size);
 
-			err = attr_load_runs_range(ni, ATTR_DATA, WOF_NAME,
-						   ARRAY_SIZE(WOF_NAME), run,
-						   from, to);
-			if (err)
-				goto out1;
-
 			err = ntfs_bio_pages(sbi, run, &page, 1, from,
 					     to - from, REQ_OP_READ);
 			if (err) {
@@ -1580,7 +1685,7 @@ repack:
 			goto ok;
 		}
 		/* add new segment [next_svcn : evcn1 - next_svcn )*/
-		if (!ni->attr_list.size) {
+		if (!ni->attr_list) {
 			err = ni_create_attr_list(ni);
 			if (err)
 				goto out;
@@ -1656,7 +1761,7 @@ repack:
 			goto out;
 
 		le->vcn = cpu_to_le64(next_svcn);
-		ni->attr_list.dirty = true;
+		ni->attr_list->dirty = true;
 		mi->dirty = true;
 
 		next_svcn = le64_to_cpu(attr->nres.evcn) + 1;
@@ -1787,7 +1892,7 @@ int attr_collapse_range(struct ntfs_inode *ni, u64 vbo, u64 bytes)
 			attr->nres.evcn = cpu_to_le64(evcn1 - 1 - len);
 			if (le) {
 				le->vcn = attr->nres.svcn;
-				ni->attr_list.dirty = true;
+				ni->attr_list->dirty = true;
 			}
 			mi->dirty = true;
 		} else if (svcn < vcn || end < evcn1) {
@@ -1815,7 +1920,7 @@ int attr_collapse_range(struct ntfs_inode *ni, u64 vbo, u64 bytes)
 				attr->nres.svcn = cpu_to_le64(vcn);
 				if (le) {
 					le->vcn = attr->nres.svcn;
-					ni->attr_list.dirty = true;
+					ni->attr_list->dirty = true;
 				}
 			}
 
@@ -1940,8 +2045,14 @@ out:
 	return err;
 }
 
-/* not for normal files */
-int attr_punch_hole(struct ntfs_inode *ni, u64 vbo, u64 bytes)
+/*
+ * attr_punch_hole
+ *
+ * deallocates clusters of stream 'name' in range [vbo, vbo + bytes)
+ * not for normal files
+ */
+int attr_punch_hole(struct ntfs_inode *ni, const __le16 *name, u8 name_len,
+		    u64 vbo, u64 bytes)
 {
 	int err = 0;
 	struct runs_tree *run = &ni->file.run;
@@ -1956,12 +2067,13 @@ int attr_punch_hole(struct ntfs_inode *ni, u64 vbo, u64 bytes)
 		return 0;
 
 	le_b = NULL;
-	attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, NULL, 0, NULL, &mi_b);
+	attr_b = ni_find_attr(ni, NULL, &le_b, ATTR_DATA, name, name_len, NULL,
+			      &mi_b);
 	if (!attr_b)
 		return -ENOENT;
 
 	if (!attr_b->non_res) {
-		u32 data_size = le32_to_cpu(attr->res.data_size);
+		u32 data_size = le32_to_cpu(attr_b->res.data_size);
 		u32 from, to;
 
 		if (vbo > data_size)
@@ -2010,8 +2122,8 @@ int attr_punch_hole(struct ntfs_inode *ni, u64 vbo, u64 bytes)
 		goto out;
 	} else {
 		le = le_b;
-		attr = ni_find_attr(ni, attr_b, &le, ATTR_DATA, NULL, 0, &vcn,
-				    &mi);
+		attr = ni_find_attr(ni, attr_b, &le, ATTR_DATA, name, name_len,
+				    &vcn, &mi);
 		if (!attr) {
 			err = -EINVAL;
 			goto out;
@@ -18,20 +18,24 @@
 static inline bool al_is_valid_le(const struct ntfs_inode *ni,
 				  struct ATTR_LIST_ENTRY *le)
 {
-	if (!le || !ni->attr_list.le || !ni->attr_list.size)
+	if (!le || !ni->attr_list)
 		return false;
 
-	return PtrOffset(ni->attr_list.le, le) + le16_to_cpu(le->size) <=
-	       ni->attr_list.size;
+	return PtrOffset(ni->attr_list->le, le) + le16_to_cpu(le->size) <=
+	       ni->attr_list->size;
 }
 
 void al_destroy(struct ntfs_inode *ni)
 {
-	run_close(&ni->attr_list.run);
-	ntfs_free(ni->attr_list.le);
-	ni->attr_list.le = NULL;
-	ni->attr_list.size = 0;
-	ni->attr_list.dirty = false;
+	struct ntfs_attr_list *al = ni->attr_list;
+
+	if (!al)
+		return;
+
+	run_close(&al->run);
+	ntfs_free(al->le);
+	ntfs_free(al);
+	ni->attr_list = NULL;
 }
 
 /*
@@ -45,10 +49,17 @@ int ntfs_load_attr_list(struct ntfs_inode *ni, struct ATTRIB *attr)
 	int err;
 	size_t lsize;
 	void *le = NULL;
+	struct ntfs_attr_list *al;
 
-	if (ni->attr_list.size)
+	if (ni->attr_list)
 		return 0;
 
+	al = ntfs_zalloc(sizeof(struct ntfs_attr_list));
+	if (!al)
+		return -ENOMEM;
+
+	ni->attr_list = al;
+
 	if (!attr->non_res) {
 		lsize = le32_to_cpu(attr->res.data_size);
 		le = ntfs_malloc(al_aligned(lsize));
@@ -65,10 +76,8 @@ int ntfs_load_attr_list(struct ntfs_inode *ni, struct ATTRIB *attr)
 
 		lsize = le64_to_cpu(attr->nres.data_size);
 
-		run_init(&ni->attr_list.run);
-
-		err = run_unpack_ex(&ni->attr_list.run, ni->mi.sbi, ni->mi.rno,
-				    0, le64_to_cpu(attr->nres.evcn), 0,
+		err = run_unpack_ex(&al->run, ni->mi.sbi, ni->mi.rno, 0,
+				    le64_to_cpu(attr->nres.evcn), 0,
 				    Add2Ptr(attr, run_off),
 				    le32_to_cpu(attr->size) - run_off);
 		if (err < 0)
@@ -80,19 +89,19 @@ int ntfs_load_attr_list(struct ntfs_inode *ni, struct ATTRIB *attr)
 			goto out;
 		}
 
-		err = ntfs_read_run_nb(ni->mi.sbi, &ni->attr_list.run, 0, le,
-				       lsize, NULL);
+		err = ntfs_read_run_nb(ni->mi.sbi, &al->run, 0, le, lsize,
+				       NULL);
 		if (err)
 			goto out;
 	}
 
-	ni->attr_list.size = lsize;
-	ni->attr_list.le = le;
+	al->size = lsize;
+	al->le = le;
 
 	return 0;
 
 out:
-	ni->attr_list.le = le;
+	al->le = le;
 	al_destroy(ni);
 
 	return err;
@@ -110,8 +119,11 @@ struct ATTR_LIST_ENTRY *al_enumerate(struct ntfs_inode *ni,
 	size_t off;
 	u16 sz;
 
+	if (!ni->attr_list)
+		return NULL;
+
 	if (!le) {
-		le = ni->attr_list.le;
+		le = ni->attr_list->le;
 	} else {
 		sz = le16_to_cpu(le->size);
 		if (sz < sizeof(struct ATTR_LIST_ENTRY)) {
@@ -122,8 +134,8 @@ struct ATTR_LIST_ENTRY *al_enumerate(struct ntfs_inode *ni,
 	}
 
 	/* Check boundary */
-	off = PtrOffset(ni->attr_list.le, le);
-	if (off + sizeof(struct ATTR_LIST_ENTRY) > ni->attr_list.size) {
+	off = PtrOffset(ni->attr_list->le, le);
+	if (off + sizeof(struct ATTR_LIST_ENTRY) > ni->attr_list->size) {
 		// The regular end of list
 		return NULL;
 	}
@@ -132,7 +144,7 @@ struct ATTR_LIST_ENTRY *al_enumerate(struct ntfs_inode *ni,
 
 	/* Check 'le' for errors */
 	if (sz < sizeof(struct ATTR_LIST_ENTRY) ||
-	    off + sz > ni->attr_list.size ||
+	    off + sz > ni->attr_list->size ||
 	    sz < le->name_off + le->name_len * sizeof(short)) {
 		return NULL;
 	}
@@ -255,7 +267,8 @@ static struct ATTR_LIST_ENTRY *al_find_le_to_insert(struct ntfs_inode *ni,
 			return le;
 	}
 
-	return prev ? Add2Ptr(prev, le16_to_cpu(prev->size)) : ni->attr_list.le;
+	return prev ? Add2Ptr(prev, le16_to_cpu(prev->size)) :
+		      ni->attr_list->le;
 }
 
 /*
@@ -274,7 +287,7 @@ int al_add_le(struct ntfs_inode *ni, enum ATTR_TYPE type, const __le16 *name,
 	u16 sz;
 	size_t asize, new_asize;
 	u64 new_size;
-	typeof(ni->attr_list) *al = &ni->attr_list;
+	struct ntfs_attr_list *al = ni->attr_list;
 
 	/*
 	 * Compute the size of the new 'le'
@@ -343,7 +356,7 @@ bool al_remove_le(struct ntfs_inode *ni, struct ATTR_LIST_ENTRY *le)
 {
 	u16 size;
 	size_t off;
-	typeof(ni->attr_list) *al = &ni->attr_list;
+	struct ntfs_attr_list *al = ni->attr_list;
 
 	if (!al_is_valid_le(ni, le))
 		return false;
@@ -372,7 +385,7 @@ bool al_delete_le(struct ntfs_inode *ni, enum ATTR_TYPE type, CLST vcn,
 	u16 size;
 	struct ATTR_LIST_ENTRY *le;
 	size_t off;
-	typeof(ni->attr_list) *al = &ni->attr_list;
+	struct ntfs_attr_list *al = ni->attr_list;
 
 	/* Scan forward to the first 'le' that matches the input */
 	le = al_find_ex(ni, NULL, type, name, name_len, &vcn);
@@ -423,9 +436,9 @@ int al_update(struct ntfs_inode *ni)
 {
 	int err;
 	struct ATTRIB *attr;
-	typeof(ni->attr_list) *al = &ni->attr_list;
+	struct ntfs_attr_list *al = ni->attr_list;
 
-	if (!al->dirty || !al->size)
+	if (!al || !al->dirty)
 		return 0;
 
 	/*
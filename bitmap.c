@@ -23,6 +23,8 @@
  * Maximum number of extents in tree.
  */
 #define NTFS_MAX_WND_EXTENTS (32u * 1024u)
+/* Max extents checked by first fit allocation */
+#define WND_FIT_STEPS 64
 
 struct rb_node_key {
 	struct rb_node node;
@@ -972,6 +974,67 @@ out:
 	return ret;
 }
 
+/*
+ * wnd_fit_ext
+ *
+ * looks in trees for free extent of at least 'to_alloc' bits:
+ * BITMAP_FIND_FIRST_FIT - the first one after 'e' (extent at hint), wraps
+ * BITMAP_FIND_BEST_FIT - the smallest one
+ */
+static const struct e_node *wnd_fit_ext(struct wnd_bitmap *wnd,
+					const struct e_node *e,
+					size_t to_alloc, size_t flags)
+{
+	const struct rb_node *n, *start;
+	const struct e_node *k, *fit = NULL;
+	u32 steps = WND_FIT_STEPS;
+
+	if (flags & BITMAP_FIND_BEST_FIT) {
+		/* 'count' tree is sorted by descending length */
+		n = wnd->count_tree.rb_node;
+		while (n) {
+			k = rb_entry(n, struct e_node, count.node);
+			if (k->count.key >= to_alloc) {
+				fit = k;
+				n = n->rb_right;
+			} else {
+				n = n->rb_left;
+			}
+		}
+		return fit;
+	}
+
+	if (!(flags & BITMAP_FIND_FIRST_FIT))
+		return NULL;
+
+	/* Nothing fits if the biggest extent (first in 'count' tree) is less */
+	n = rb_first(&wnd->count_tree);
+	if (!n || rb_entry(n, struct e_node, count.node)->count.key < to_alloc)
+		return NULL;
+
+	/*
+	 * Extents after hint, then extents before it.
+	 * Don't walk the whole tree under bitmap lock: after WND_FIT_STEPS
+	 * extents caller takes the biggest one
+	 */
+	start = e ? rb_next(&e->start.node) : NULL;
+	for (n = start ? start : rb_first(&wnd->start_tree); n && steps;
+	     n = rb_next(n), steps--) {
+		k = rb_entry(n, struct e_node, start.node);
+		if (k->count.key >= to_alloc)
+			return k;
+	}
+
+	for (n = start ? rb_first(&wnd->start_tree) : NULL;
+	     n != start && steps; n = rb_next(n), steps--) {
+		k = rb_entry(n, struct e_node, start.node);
+		if (k->count.key >= to_alloc)
+			return k;
+	}
+
+	return NULL;
+}
+
 /*
  * wnd_find
  * - flags - BITMAP_FIND_XXX flags
@@ -1068,6 +1131,19 @@ size_t wnd_find(struct wnd_bitmap *wnd, size_t to_alloc, size_t hint,
 		}
 
 		if (!(flags & BITMAP_FIND_FULL)) {
+			/*
+			 * Extent selected by allocation policy gets the whole
+			 * request. Part of extent at hint is taken only if
+			 * policy finds nothing
+			 */
+			const struct e_node *fit =
+				wnd_fit_ext(wnd, e, to_alloc, flags);
+
+			if (fit) {
+				fnd = fit->start.key;
+				goto found;
+			}
+
 			if (len > to_alloc)
 				len = to_alloc;
 
@@ -1076,10 +1152,20 @@ size_t wnd_find(struct wnd_bitmap *wnd, size_t to_alloc, size_t hint,
 				to_alloc = len;
 				goto found;
 			}
+
+			goto allocate_biggest_only;
 		}
 	}
 
 allocate_biggest:
+	/* Try extent selected by allocation policy */
+	e = wnd_fit_ext(wnd, e, to_alloc, flags);
+	if (e) {
+		fnd = e->start.key;
+		goto found;
+	}
+
+allocate_biggest_only:
 	/* Allocate from biggest free extent */
 	e = rb_entry(rb_first(&wnd->count_tree), struct e_node, count.node);
 	if (e->count.key != wnd->extent_max)
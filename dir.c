@@ -11,6 +11,7 @@
 #include <linux/fs.h>
 #include <linux/nls.h>
 #include <linux/version.h>
+#include <asm/unaligned.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
 #include <linux/iversion.h>
@@ -20,6 +21,43 @@
 #include "ntfs.h"
 #include "ntfs_fs.h"
 
+/*
+ * ntfs_utf16_to_ascii
+ *
+ * copies leading ascii (non zero) chars of utf16 string
+ * Four chars are checked and narrowed at once
+ * returns the number of copied chars
+ */
+static int ntfs_utf16_to_ascii(const __le16 *ip, int len, u8 *op, int maxout)
+{
+	int i = 0;
+	int n = min(len, maxout);
+	u64 v;
+	u16 c;
+
+	for (; i + 4 <= n; i += 4) {
+		v = get_unaligned_le64(ip + i);
+		/* Stop on zero or non ascii char */
+		if ((v & 0xff80ff80ff80ff80ull) ||
+		    ((v - 0x0001000100010001ull) & ~v & 0x8000800080008000ull))
+			break;
+
+		op[i] = v;
+		op[i + 1] = v >> 16;
+		op[i + 2] = v >> 32;
+		op[i + 3] = v >> 48;
+	}
+
+	for (; i < n; i++) {
+		c = le16_to_cpu(ip[i]);
+		if (!c || c >= 0x80)
+			break;
+		op[i] = c;
+	}
+
+	return i;
+}
+
 /*
  * Convert little endian utf16 to nls string
  */
@@ -34,9 +72,14 @@ int ntfs_utf16_to_nls(struct ntfs_sb_info *sbi, const struct le_str *uni,
 	static_assert(sizeof(wchar_t) == sizeof(__le16));
 
 	if (!nls) {
-		/* utf16 -> utf8 */
-		ret = utf16s_to_utf8s((wchar_t *)uni->name, uni->len,
-				      UTF16_LITTLE_ENDIAN, buf, buf_len);
+		/* utf16 -> utf8. Most names are pure ascii */
+		ret = ntfs_utf16_to_ascii(uni->name, uni->len, buf, buf_len);
+		if (ret < uni->len && ret < buf_len) {
+			ret += utf16s_to_utf8s((wchar_t *)uni->name + ret,
+					       uni->len - ret,
+					       UTF16_LITTLE_ENDIAN, buf + ret,
+					       buf_len - ret);
+		}
 		buf[ret] = '\0';
 		return ret;
 	}
@@ -115,6 +158,37 @@ static inline void put_utf16(wchar_t *s, unsigned int c,
 	}
 }
 
+/*
+ * ntfs_ascii_to_utf16
+ *
+ * widens leading ascii (non zero) chars of utf8 string
+ * Eight chars are checked at once
+ * returns the number of converted chars
+ */
+static int ntfs_ascii_to_utf16(const u8 *s, int len, enum utf16_endian endian,
+			       wchar_t *op, int maxout)
+{
+	int i = 0, j;
+	int n = min(len, maxout);
+	u64 v;
+
+	for (; i + 8 <= n; i += 8) {
+		v = get_unaligned((const u64 *)(s + i));
+		/* Stop on zero or non ascii byte */
+		if ((((v - 0x0101010101010101ull) & ~v) | v) &
+		    0x8080808080808080ull)
+			break;
+
+		for (j = 0; j < 8; j++)
+			put_utf16(op + i + j, s[i + j], endian);
+	}
+
+	for (; i < n && s[i] && !(s[i] & 0x80); i++)
+		put_utf16(op + i, s[i], endian);
+
+	return i;
+}
+
 /*
  * modified version of 'utf8s_to_utf16s' allows to
  * detect -ENAMETOOLONG without writing out of expected maximum
@@ -126,7 +200,13 @@ static int _utf8s_to_utf16s(const u8 *s, int inlen, enum utf16_endian endian,
 	int size;
 	unicode_t u;
 
-	op = pwcs;
+	/* Fast path for ascii head of name. The rest goes char by char */
+	size = ntfs_ascii_to_utf16(s, inlen, endian, pwcs, maxout);
+	s += size;
+	inlen -= size;
+	maxout -= size;
+
+	op = pwcs + size;
 	while (inlen > 0 && *s) {
 		if (*s & 0x80) {
 			size = utf8_to_utf32(s, inlen, &u);
@@ -363,86 +443,45 @@ static int ntfs_read_hdr(struct ntfs_sb_info *sbi, struct ntfs_inode *ni,
 }
 
 /*
- * file_operations::iterate_shared
+ * ntfs_dir_scan
  *
- * Use non sorted enumeration.
- * We have an example of broken volume where sorted enumeration
- * counts each name twice
+ * enumerates entries of index root and index buffers from 'pos'
+ * helper function 'ntfs_readdir'
  */
-static int ntfs_readdir(struct file *file, struct dir_context *ctx)
+static int ntfs_dir_scan(struct ntfs_sb_info *sbi, struct ntfs_inode *ni,
+			 struct dir_context *ctx, u32 pos, loff_t i_size,
+			 loff_t eod, u8 *name)
 {
+	int err;
 	const struct INDEX_ROOT *root;
 	u64 vbo;
 	size_t bit;
-	loff_t eod;
-	int err = 0;
-	struct inode *dir = file_inode(file);
-	struct ntfs_inode *ni = ntfs_i(dir);
-	struct super_block *sb = dir->i_sb;
-	struct ntfs_sb_info *sbi = sb->s_fs_info;
-	loff_t i_size = i_size_read(dir);
-	u32 pos = ctx->pos;
-	u8 *name = NULL;
 	struct indx_node *node = NULL;
 	u8 index_bits = ni->dir.index_bits;
 
-	/* name is a buffer of PATH_MAX length */
-	static_assert(NTFS_NAME_LEN * 4 < PATH_MAX);
-
-	eod = i_size + sbi->record_size;
-
-	if (pos >= eod)
-		return 0;
-
-	if (!dir_emit_dots(file, ctx))
-		return 0;
-
-	/* allocate PATH_MAX bytes */
-	name = __getname();
-	if (!name)
-		return -ENOMEM;
-
-	if (!ni->mi_loaded && ni->attr_list.size) {
-		/*
-		 * directory inode is locked for read
-		 * load all subrecords to avoid 'write' access to 'ni' during
-		 * directory reading
-		 */
-		ni_lock(ni);
-		if (!ni->mi_loaded && ni->attr_list.size) {
-			err = ni_load_all_mi(ni);
-			if (!err)
-				ni->mi_loaded = true;
-		}
-		ni_unlock(ni);
-		if (err)
-			goto out;
-	}
-
 	root = indx_get_root(&ni->dir, ni, NULL, NULL);
-	if (!root) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (!root)
+		return -EINVAL;
 
 	if (pos >= sbi->record_size) {
 		bit = (pos - sbi->record_size) >> index_bits;
 	} else {
 		err = ntfs_read_hdr(sbi, ni, &root->ihdr, 0, pos, name, ctx);
 		if (err)
-			goto out;
+			return err;
 		bit = 0;
 	}
 
 	if (!i_size) {
 		ctx->pos = eod;
-		goto out;
+		return 0;
 	}
 
 	for (;;) {
 		vbo = (u64)bit << index_bits;
 		if (vbo >= i_size) {
 			ctx->pos = eod;
+			err = 0;
 			goto out;
 		}
 
@@ -457,13 +496,14 @@ static int ntfs_readdir(struct file *file, struct dir_context *ctx)
 
 		vbo = (u64)bit << index_bits;
 		if (vbo >= i_size) {
-			ntfs_inode_err(dir, "Looks like your dir is corrupt");
+			ntfs_inode_err(&ni->vfs_inode,
+				       "Looks like your dir is corrupt");
 			err = -EINVAL;
 			goto out;
 		}
 
-		err = indx_read(&ni->dir, ni, bit << ni->dir.idx2vbn_bits,
-				&node);
+		err = indx_read_shared(&ni->dir, ni,
+				       bit << ni->dir.idx2vbn_bits, &node);
 		if (err)
 			goto out;
 
@@ -476,9 +516,232 @@ static int ntfs_readdir(struct file *file, struct dir_context *ctx)
 	}
 
 out:
+	put_indx_node(node);
+	return err;
+}
+
+/* Names of directories with bigger index are not cached */
+#define NTFS_DIR_NAMES_MAX_INDEX (256u * 1024)
+
+static inline u32 ntfs_dir_name_size(u32 len)
+{
+	return ALIGN(offsetof(struct ntfs_dir_name, name) + len, 8);
+}
+
+struct ntfs_dir_names_ctx {
+	struct dir_context ctx;
+	struct dir_context *caller; // context of readdir
+	struct ntfs_dir_names *names; // table being built (if any)
+	u32 max_bytes;
+};
+
+/*
+ * ntfs_dir_names_add
+ *
+ * appends name to the table being built
+ * Table is dropped if it can't grow
+ */
+static void ntfs_dir_names_add(struct ntfs_dir_names_ctx *nc,
+			       const char *name, int len, loff_t pos, u64 ino,
+			       unsigned int type)
+{
+	struct ntfs_dir_names *names = nc->names;
+	struct ntfs_dir_name *dn;
+	u32 size = ntfs_dir_name_size(len);
+
+	if (names->bytes + size > names->allocated) {
+		u32 new_size = max(names->allocated * 2, names->bytes + size);
+
+		if (new_size > nc->max_bytes)
+			goto drop;
+
+		names = indx_alloc_names(new_size);
+		if (!names)
+			goto drop;
+
+		memcpy(names->data, nc->names->data, nc->names->bytes);
+		names->bytes = nc->names->bytes;
+		names->gen = nc->names->gen;
+		indx_put_names(nc->names);
+		nc->names = names;
+	}
+
+	dn = Add2Ptr(names->data, names->bytes);
+	dn->pos = pos;
+	dn->ino = ino;
+	dn->len = len;
+	dn->type = type;
+	memcpy(dn->name, name, len);
+	names->bytes += size;
+	return;
+
+drop:
+	indx_put_names(nc->names);
+	nc->names = NULL;
+}
+
+/*
+ * ntfs_dir_names_actor
+ *
+ * dir_context actor: passes name to readdir and appends it to the table
+ * Only emitted names are collected
+ */
+static int ntfs_dir_names_actor(struct dir_context *ctx, const char *name,
+				int len, loff_t pos, u64 ino, unsigned int type)
+{
+	struct ntfs_dir_names_ctx *nc =
+		container_of(ctx, struct ntfs_dir_names_ctx, ctx);
+
+	nc->caller->pos = pos;
+	if (!dir_emit(nc->caller, name, len, ino, type))
+		return -EINVAL;
+
+	if (nc->names)
+		ntfs_dir_names_add(nc, name, len, pos, ino, type);
+
+	return 0;
+}
+
+/*
+ * ntfs_dir_names_emit
+ *
+ * emits names from table starting from ctx->pos
+ */
+static void ntfs_dir_names_emit(const struct ntfs_dir_names *names,
+				struct dir_context *ctx, loff_t eod)
+{
+	const struct ntfs_dir_name *dn;
+	loff_t pos = ctx->pos;
+	u32 off;
+
+	for (off = 0; off < names->bytes; off += ntfs_dir_name_size(dn->len)) {
+		dn = Add2Ptr(names->data, off);
+
+		/* Skip already enumerated*/
+		if (dn->pos < pos)
+			continue;
+
+		ctx->pos = dn->pos;
+		if (!dir_emit(ctx, dn->name, dn->len, dn->ino, dn->type))
+			return;
+	}
+
+	ctx->pos = eod;
+}
+
+/*
+ * file_operations::iterate_shared
+ *
+ * Use non sorted enumeration.
+ * We have an example of broken volume where sorted enumeration
+ * counts each name twice
+ * Names converted while directory is listed from the start are collected
+ * into table (kept by the file between calls). When listing reaches the
+ * end, table is kept by directory: next listings take names from it
+ * until directory is changed
+ */
+static int ntfs_readdir(struct file *file, struct dir_context *ctx)
+{
+	loff_t eod;
+	int err = 0;
+	struct inode *dir = file_inode(file);
+	struct ntfs_inode *ni = ntfs_i(dir);
+	struct super_block *sb = dir->i_sb;
+	struct ntfs_sb_info *sbi = sb->s_fs_info;
+	loff_t i_size = i_size_read(dir);
+	u32 pos = ctx->pos;
+	u8 *name = NULL;
+	struct ntfs_dir_names *names;
+	struct ntfs_dir_names_ctx nc = {
+		.ctx.actor = ntfs_dir_names_actor,
+		.caller = ctx,
+	};
+	u32 gen;
+
+	/* name is a buffer of PATH_MAX length */
+	static_assert(NTFS_NAME_LEN * 4 < PATH_MAX);
+
+	eod = i_size + sbi->record_size;
+
+	if (pos >= eod)
+		return 0;
+
+	if (!dir_emit_dots(file, ctx))
+		return 0;
+
+	if (!ni->mi_loaded && ni->attr_list) {
+		/*
+		 * directory inode is locked for read
+		 * load all subrecords to avoid 'write' access to 'ni' during
+		 * directory reading
+		 */
+		ni_lock(ni);
+		if (!ni->mi_loaded && ni->attr_list) {
+			err = ni_load_all_mi(ni);
+			if (!err)
+				ni->mi_loaded = true;
+		}
+		ni_unlock(ni);
+		if (err)
+			return err;
+	}
+
+	/* Repeated listings of directory take converted names from table */
+	names = indx_get_names(&ni->dir, &gen);
+	if (names) {
+		ntfs_dir_names_emit(names, ctx, eod);
+		indx_put_names(names);
+		return 0;
+	}
+
+	/* Continue the table of this file only from where it stopped */
+	names = file->private_data;
+	file->private_data = NULL;
+	if (names && (names->gen != gen || names->end != ctx->pos)) {
+		indx_put_names(names);
+		names = NULL;
+	}
+
+	/* Start new table from the first entry (pos is 2 after dots) */
+	if (!names && ctx->pos == 2 && i_size <= NTFS_DIR_NAMES_MAX_INDEX) {
+		names = indx_alloc_names(min_t(loff_t, eod, PAGE_SIZE));
+		if (names)
+			names->gen = gen;
+	}
+
+	/* allocate PATH_MAX bytes */
+	name = __getname();
+	if (!name) {
+		indx_put_names(names);
+		return -ENOMEM;
+	}
+
+	if (names) {
+		/* Converted names may be longer than utf16 ones (e.g. CJK) */
+		nc.max_bytes = 2 * eod;
+		nc.names = names;
+		nc.ctx.pos = ctx->pos;
+		err = ntfs_dir_scan(sbi, ni, &nc.ctx, pos, i_size, eod, name);
+		ctx->pos = nc.ctx.pos;
+		names = nc.names;
+	} else {
+		err = ntfs_dir_scan(sbi, ni, ctx, pos, i_size, eod, name);
+	}
 
 	__putname(name);
-	put_indx_node(node);
+
+	if (names) {
+		if (err < 0) {
+			indx_put_names(names);
+		} else if (ctx->pos >= eod) {
+			/* All names are collected */
+			indx_set_names(&ni->dir, names, names->gen);
+			indx_put_names(names);
+		} else {
+			names->end = ctx->pos;
+			file->private_data = names;
+		}
+	}
 
 	if (err == -ENOENT) {
 		err = 0;
@@ -488,6 +751,15 @@ out:
 	return err;
 }
 
+/*
+ * file_operations::release
+ */
+static int ntfs_dir_release(struct inode *dir, struct file *file)
+{
+	indx_put_names(file->private_data);
+	return 0;
+}
+
 static int ntfs_dir_count(struct inode *dir, bool *is_empty, size_t *dirs,
 			  size_t *files)
 {
@@ -560,8 +832,8 @@ static int ntfs_dir_count(struct inode *dir, bool *is_empty, size_t *dirs,
 		if (vbo >= i_size)
 			goto out;
 
-		err = indx_read(&ni->dir, ni, bit << ni->dir.idx2vbn_bits,
-				&node);
+		err = indx_read_shared(&ni->dir, ni,
+				       bit << ni->dir.idx2vbn_bits, &node);
 		if (err)
 			goto out;
 
@@ -595,4 +867,9 @@ const struct file_operations ntfs_dir_operations = {
 	.iterate_shared = ntfs_readdir,
 	.fsync = generic_file_fsync,
 	.open = ntfs_file_open,
+	.release = ntfs_dir_release,
+	.unlocked_ioctl = ntfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = ntfs_compat_ioctl,
+#endif
 };
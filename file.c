@@ -10,6 +10,7 @@
 #include <linux/compat.h>
 #include <linux/falloc.h>
 #include <linux/fiemap.h>
+#include <linux/mount.h>
 #include <linux/msdos_fs.h> /* FAT_IOCTL_XXX */
 #include <linux/nls.h>
 #include <linux/uio.h>
@@ -47,7 +48,195 @@ static int ntfs_ioctl_fitrim(struct ntfs_sb_info *sbi, unsigned long arg)
 	return 0;
 }
 
-static long ntfs_ioctl(struct file *filp, u32 cmd, unsigned long arg)
+static int ntfs_ioctl_bulkstat(struct ntfs_sb_info *sbi, unsigned long arg)
+{
+	struct ntfs_bulkstat_req __user *user_req;
+	struct ntfs_bulkstat_req req;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	user_req = (struct ntfs_bulkstat_req __user *)arg;
+	if (copy_from_user(&req, user_req, sizeof(req)))
+		return -EFAULT;
+
+	err = ntfs_mft_bulkstat(sbi, &req);
+	if (err)
+		return err;
+
+	if (copy_to_user(user_req, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_read_usn(struct ntfs_sb_info *sbi, unsigned long arg)
+{
+	struct ntfs_read_usn_req __user *user_req;
+	struct ntfs_read_usn_req req;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	user_req = (struct ntfs_read_usn_req __user *)arg;
+	if (copy_from_user(&req, user_req, sizeof(req)))
+		return -EFAULT;
+
+	err = ntfs_usn_read(sbi, &req);
+	if (err)
+		return err;
+
+	if (copy_to_user(user_req, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_mft_stat(struct ntfs_sb_info *sbi, unsigned long arg)
+{
+	struct ntfs_mft_stat st;
+	int err;
+
+	err = ntfs_mft_stat(sbi, &st);
+	if (err)
+		return err;
+
+	if (copy_to_user((struct ntfs_mft_stat __user *)arg, &st, sizeof(st)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_index_stat(struct inode *inode, unsigned long arg)
+{
+	struct ntfs_inode *ni = ntfs_i(inode);
+	struct ntfs_index_stat st;
+	int err;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	ni_lock(ni);
+	err = indx_stat(&ni->dir, ni, &st);
+	ni_unlock(ni);
+	if (err)
+		return err;
+
+	if (copy_to_user((struct ntfs_index_stat __user *)arg, &st,
+			 sizeof(st)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_compact_index(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct ntfs_inode *ni = ntfs_i(inode);
+	struct ntfs_index_stat st;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	ni_lock_dir(ni);
+	err = indx_compact(&ni->dir, ni, ni->mi.sbi);
+	if (!err)
+		err = indx_stat(&ni->dir, ni, &st);
+	ni_unlock(ni);
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+
+	if (err)
+		return err;
+
+	if (copy_to_user((struct ntfs_index_stat __user *)arg, &st,
+			 sizeof(st)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_strip_names(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct ntfs_inode *ni = ntfs_i(inode);
+	struct ntfs_strip_names st;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	ni_lock_dir(ni);
+	err = ntfs_strip_dos_names(inode, filp->f_path.dentry, &st);
+	ni_unlock(ni);
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+
+	if (err)
+		return err;
+
+	if (copy_to_user((struct ntfs_strip_names __user *)arg, &st,
+			 sizeof(st)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ntfs_ioctl_bulk_create(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct ntfs_bulk_create_req __user *user_req;
+	struct ntfs_bulk_create_req req;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	user_req = (struct ntfs_bulk_create_req __user *)arg;
+	if (copy_from_user(&req, user_req, sizeof(req)))
+		return -EFAULT;
+
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	err = ntfs_bulk_create(inode, filp->f_path.dentry, &req);
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+
+	if (err)
+		return err;
+
+	if (copy_to_user(user_req, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+long ntfs_ioctl(struct file *filp, u32 cmd, unsigned long arg)
 {
 	struct inode *inode = file_inode(filp);
 	struct ntfs_sb_info *sbi = inode->i_sb->s_fs_info;
@@ -62,12 +251,33 @@ static long ntfs_ioctl(struct file *filp, u32 cmd, unsigned long arg)
 
 	case FITRIM:
 		return ntfs_ioctl_fitrim(sbi, arg);
+
+	case NTFS3_IOC_BULKSTAT:
+		return ntfs_ioctl_bulkstat(sbi, arg);
+
+	case NTFS3_IOC_READ_USN:
+		return ntfs_ioctl_read_usn(sbi, arg);
+
+	case NTFS3_IOC_MFT_STAT:
+		return ntfs_ioctl_mft_stat(sbi, arg);
+
+	case NTFS3_IOC_INDEX_STAT:
+		return ntfs_ioctl_index_stat(inode, arg);
+
+	case NTFS3_IOC_COMPACT_INDEX:
+		return ntfs_ioctl_compact_index(filp, arg);
+
+	case NTFS3_IOC_STRIP_SHORT_NAMES:
+		return ntfs_ioctl_strip_names(filp, arg);
+
+	case NTFS3_IOC_BULK_CREATE:
+		return ntfs_ioctl_bulk_create(filp, arg);
 	}
 	return -ENOTTY; /* Inappropriate ioctl for device */
 }
 
 #ifdef CONFIG_COMPAT
-static long ntfs_compat_ioctl(struct file *filp, u32 cmd, unsigned long arg)
+long ntfs_compat_ioctl(struct file *filp, u32 cmd, unsigned long arg)
 
 {
 	return ntfs_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
@@ -533,7 +743,7 @@ static long ntfs_fallocate(struct file *file, int mode, loff_t vbo, loff_t len)
 		truncate_pagecache(inode, vbo_down);
 
 		ni_lock(ni);
-		err = attr_punch_hole(ni, vbo, len);
+		err = attr_punch_hole(ni, NULL, 0, vbo, len);
 		ni_unlock(ni);
 	} else if (mode & FALLOC_FL_COLLAPSE_RANGE) {
 		if (mode & ~FALLOC_FL_COLLAPSE_RANGE) {
@@ -684,6 +894,11 @@ int ntfs3_setattr(struct dentry *dentry,
 		if (err)
 			goto out;
 
+		if (attr->ia_size != oldsize)
+			ntfs_usn_change(ni, attr->ia_size < oldsize
+						    ? USN_REASON_DATA_TRUNCATION
+						    : USN_REASON_DATA_EXTEND);
+
 		ni->ni_flags |= NI_FLAG_UPDATE_PARENT;
 	}
 
@@ -707,6 +922,8 @@ int ntfs3_setattr(struct dentry *dentry,
 			ni->std_fa &= ~FILE_ATTRIBUTE_READONLY;
 		else
 			ni->std_fa |= FILE_ATTRIBUTE_READONLY;
+
+		ntfs_usn_change(ni, USN_REASON_BASIC_INFO_CHANGE);
 	}
 
 	mark_inode_dirty(inode);
@@ -1017,6 +1234,7 @@ static ssize_t ntfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	struct inode *inode = mapping->host;
 	ssize_t ret;
 	struct ntfs_inode *ni = ntfs_i(inode);
+	loff_t i_size_before;
 
 	if (is_encrypted(ni)) {
 		ntfs_inode_warn(inode, "encrypted i/o not supported");
@@ -1051,6 +1269,7 @@ static ssize_t ntfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		goto out;
 	}
 
+	i_size_before = inode->i_size;
 	ret = ntfs_extend(inode, iocb->ki_pos, ret, file);
 	if (ret)
 		goto out;
@@ -1058,6 +1277,16 @@ static ssize_t ntfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	ret = is_compressed(ni) ? ntfs_compress_write(iocb, from)
 				: __generic_file_write_iter(iocb, from);
 
+	if (ret > 0) {
+		u32 reason = 0;
+
+		if (iocb->ki_pos - ret < i_size_before)
+			reason |= USN_REASON_DATA_OVERWRITE;
+		if (iocb->ki_pos > i_size_before)
+			reason |= USN_REASON_DATA_EXTEND;
+		ntfs_usn_change(ni, reason);
+	}
+
 out:
 	inode_unlock(inode);
 
@@ -1119,6 +1348,14 @@ static int ntfs_file_release(struct inode *inode, struct file *file)
 		up_write(&ni->file.run_lock);
 		ni_unlock(ni);
 	}
+
+	if ((file->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1) {
+		/* the first write session is over, see ntfs_resident_growing */
+		ni->ni_flags &= ~NI_FLAG_PACK;
+		ntfs_usn_close_file(ni);
+	}
+
 	return err;
 }
 
@@ -5,6 +5,7 @@
  *
  */
 
+#include <linux/backing-dev.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fiemap.h>
@@ -20,6 +21,19 @@
 #include "lib/lib.h"
 #endif
 
+/* Frame of volume with 4K clusters (lznt), the biggest one for Windows */
+#define NTFS_STD_FRAME (NTFS_LZNT_CLUSTERS * NTFS_LZNT_MAX_CLUSTER)
+/* Biggest frame: 16 clusters of 64K (lznt) */
+#define NTFS_MAX_FRAME (NTFS_LZNT_CLUSTERS * NTFS_LZNT_MAX_CLUSTER_EX)
+/* Max frames read by one ni_read_frames */
+#define NTFS_READ_FRAMES 8
+/* On-disk data of several frames read by ni_read_frames */
+#define NTFS_FRAME_DISK (4 * NTFS_STD_FRAME)
+/* Bigger frames (big clusters) use buffers of NTFS_MAX_FRAME */
+#define NTFS_KEEP_FRAME NTFS_STD_FRAME
+/* Max buffers for big frames */
+#define NTFS_BIG_FRAME_BUFS 2
+
 static struct mft_inode *ni_ins_mi(struct ntfs_inode *ni, struct rb_root *tree,
 				   CLST ino, struct rb_node *ins)
 {
@@ -115,8 +129,12 @@ void ni_clear(struct ntfs_inode *ni)
 {
 	struct rb_node *node;
 
-	if (!ni->vfs_inode.i_nlink && is_rec_inuse(ni->mi.mrec))
+	if (!ni->vfs_inode.i_nlink && is_rec_inuse(ni->mi.mrec)) {
+		/* Buffers of deleted directory are not written */
+		if (ni->ni_flags & NI_FLAG_DIR)
+			indx_drop(&ni->dir);
 		ni_delete_all(ni);
+	}
 
 	al_destroy(ni);
 
@@ -140,6 +158,8 @@ void ni_clear(struct ntfs_inode *ni)
 			put_page(ni->file.offs_page);
 			ni->file.offs_page = NULL;
 		}
+		run_free(ni->file.wof_run);
+		ni->file.wof_run = NULL;
 #endif
 	}
 
@@ -208,7 +228,7 @@ struct ATTRIB *ni_find_attr(struct ntfs_inode *ni, struct ATTRIB *attr,
 	struct ATTR_LIST_ENTRY *le;
 	struct mft_inode *m;
 
-	if (!ni->attr_list.size ||
+	if (!ni->attr_list ||
 	    (!name_len && (type == ATTR_LIST || type == ATTR_STD))) {
 		if (le_o)
 			*le_o = NULL;
@@ -270,7 +290,7 @@ struct ATTRIB *ni_enum_attr_ex(struct ntfs_inode *ni, struct ATTRIB *attr,
 	struct ATTR_LIST_ENTRY *le2;
 
 	/* Do we have an attribute list? */
-	if (!ni->attr_list.size) {
+	if (!ni->attr_list) {
 		*le = NULL;
 		if (mi)
 			*mi = &ni->mi;
@@ -308,7 +328,7 @@ struct ATTRIB *ni_load_attr(struct ntfs_inode *ni, enum ATTR_TYPE type,
 	struct mft_inode *mi;
 	struct ATTR_LIST_ENTRY *next;
 
-	if (!ni->attr_list.size) {
+	if (!ni->attr_list) {
 		if (pmi)
 			*pmi = &ni->mi;
 		return mi_find_attr(&ni->mi, NULL, type, name, name_len, NULL);
@@ -361,7 +381,7 @@ int ni_load_all_mi(struct ntfs_inode *ni)
 	int err;
 	struct ATTR_LIST_ENTRY *le;
 
-	if (!ni->attr_list.size)
+	if (!ni->attr_list)
 		return 0;
 
 	le = NULL;
@@ -421,7 +441,7 @@ int ni_remove_attr(struct ntfs_inode *ni, enum ATTR_TYPE type,
 	u32 type_in;
 	int diff;
 
-	if (base_only || type == ATTR_LIST || !ni->attr_list.size) {
+	if (base_only || type == ATTR_LIST || !ni->attr_list) {
 		attr = mi_find_attr(&ni->mi, NULL, type, name, name_len, id);
 		if (!attr)
 			return -ENOENT;
@@ -467,7 +487,7 @@ next_le2:
 
 		mi_remove_attr(mi, attr);
 
-		if (PtrOffset(ni->attr_list.le, le) >= ni->attr_list.size)
+		if (PtrOffset(ni->attr_list->le, le) >= ni->attr_list->size)
 			return 0;
 		goto next_le2;
 	}
@@ -493,7 +513,7 @@ static struct ATTRIB *ni_ins_new_attr(struct ntfs_inode *ni,
 
 	mi_get_ref(mi, &ref);
 
-	if (type != ATTR_LIST && !le && ni->attr_list.size) {
+	if (type != ATTR_LIST && !le && ni->attr_list) {
 		err = al_add_le(ni, type, name, name_len, svcn, cpu_to_le16(-1),
 				&ref, &le);
 		if (err) {
@@ -528,7 +548,7 @@ static struct ATTRIB *ni_ins_new_attr(struct ntfs_inode *ni,
 
 	/* Update ATTRIB Id and record reference */
 	le->id = attr->id;
-	ni->attr_list.dirty = true;
+	ni->attr_list->dirty = true;
 	le->ref = ref;
 
 out:
@@ -629,7 +649,7 @@ static int ni_repack(struct ntfs_inode *ni)
 
 		attr->nres.svcn = le->vcn = cpu_to_le64(next_svcn);
 		mi->dirty = true;
-		ni->attr_list.dirty = true;
+		ni->attr_list->dirty = true;
 
 		if (evcn + 1 == alloc) {
 			err = mi_pack_runs(mi, attr, &run,
@@ -677,7 +697,7 @@ static int ni_try_remove_attr_list(struct ntfs_inode *ni)
 	struct MFT_REF ref;
 	__le16 id;
 
-	if (!ni->attr_list.dirty)
+	if (!ni->attr_list->dirty)
 		return 0;
 
 	err = ni_repack(ni);
@@ -750,12 +770,8 @@ static int ni_try_remove_attr_list(struct ntfs_inode *ni)
 		mi_remove_attr(mi, attr);
 	}
 
-	run_deallocate(sbi, &ni->attr_list.run, true);
-	run_close(&ni->attr_list.run);
-	ni->attr_list.size = 0;
-	ntfs_free(ni->attr_list.le);
-	ni->attr_list.le = NULL;
-	ni->attr_list.dirty = false;
+	run_deallocate(sbi, &ni->attr_list->run, true);
+	al_destroy(ni);
 
 	return 0;
 }
@@ -773,6 +789,7 @@ int ni_create_attr_list(struct ntfs_inode *ni)
 	struct ATTRIB *attr;
 	struct ATTRIB *arr_move[7];
 	struct ATTR_LIST_ENTRY *le, *le_b[7];
+	struct ntfs_attr_list *al;
 	struct MFT_REC *rec;
 	bool is_mft;
 	CLST rno = 0;
@@ -788,14 +805,22 @@ int ni_create_attr_list(struct ntfs_inode *ni)
 	 * Skip estimating exact memory requirement
 	 * Looks like one record_size is always enough
 	 */
+	al = ntfs_zalloc(sizeof(struct ntfs_attr_list));
+	if (!al) {
+		err = -ENOMEM;
+		goto out;
+	}
+
 	le = ntfs_malloc(al_aligned(rs));
 	if (!le) {
+		ntfs_free(al);
 		err = -ENOMEM;
 		goto out;
 	}
 
 	mi_get_ref(&ni->mi, &le->ref);
-	ni->attr_list.le = le;
+	al->le = le;
+	ni->attr_list = al;
 
 	attr = NULL;
 	nb = 0;
@@ -809,8 +834,8 @@ int ni_create_attr_list(struct ntfs_inode *ni)
 		le->name_len = attr->name_len;
 		le->name_off = offsetof(struct ATTR_LIST_ENTRY, name);
 		le->vcn = 0;
-		if (le != ni->attr_list.le)
-			le->ref = ni->attr_list.le->ref;
+		if (le != al->le)
+			le->ref = al->le->ref;
 		le->id = attr->id;
 
 		if (attr->name_len)
@@ -830,8 +855,8 @@ int ni_create_attr_list(struct ntfs_inode *ni)
 		}
 	}
 
-	lsize = PtrOffset(ni->attr_list.le, le);
-	ni->attr_list.size = lsize;
+	lsize = PtrOffset(al->le, le);
+	al->size = lsize;
 
 	to_free = le32_to_cpu(rec->used) + lsize + SIZEOF_RESIDENT;
 	if (to_free <= rs) {
@@ -886,17 +911,15 @@ int ni_create_attr_list(struct ntfs_inode *ni)
 	attr->res.flags = 0;
 	attr->res.res = 0;
 
-	memcpy(resident_data_ex(attr, lsize), ni->attr_list.le, lsize);
+	memcpy(resident_data_ex(attr, lsize), al->le, lsize);
 
-	ni->attr_list.dirty = false;
+	al->dirty = false;
 
 	mark_inode_dirty(&ni->vfs_inode);
 	goto out;
 
 out1:
-	ntfs_free(ni->attr_list.le);
-	ni->attr_list.le = NULL;
-	ni->attr_list.size = 0;
+	al_destroy(ni);
 
 out:
 	return err;
@@ -940,7 +963,7 @@ static int ni_ins_attr_ext(struct ntfs_inode *ni, struct ATTR_LIST_ENTRY *le,
 	}
 
 	/* Create attribute list if it is not already existed */
-	if (!ni->attr_list.size) {
+	if (!ni->attr_list) {
 		err = ni_create_attr_list(ni);
 		if (err)
 			goto out;
@@ -1133,7 +1156,7 @@ static int ni_insert_attr(struct ntfs_inode *ni, enum ATTR_TYPE type,
 			continue;
 
 		le = NULL;
-		if (ni->attr_list.size) {
+		if (ni->attr_list) {
 			le = al_find_le(ni, NULL, attr);
 			if (!le) {
 				/* Really this is a serious bug */
@@ -1511,6 +1534,24 @@ int ni_remove_attr_le(struct ntfs_inode *ni, struct ATTRIB *attr,
 	return 0;
 }
 
+/*
+ * ni_reparse_tag
+ *
+ * returns tag of reparse point from attribute without reading it
+ * 0 if attribute is not resident (ntfs_remove_reparse searches index)
+ */
+static __le32 ni_reparse_tag(const struct ATTRIB *attr)
+{
+	const struct REPARSE_DATA_BUFFER *rp;
+
+	if (attr->non_res ||
+	    le32_to_cpu(attr->res.data_size) < sizeof(rp->ReparseTag))
+		return 0;
+
+	rp = resident_data(attr);
+	return rp->ReparseTag;
+}
+
 /*
  * ni_delete_all
  *
@@ -1535,7 +1576,7 @@ int ni_delete_all(struct ntfs_inode *ni)
 			;
 		} else if (attr->type == ATTR_REPARSE) {
 			mi_get_ref(&ni->mi, &ref);
-			ntfs_remove_reparse(sbi, 0, &ref);
+			ntfs_remove_reparse(sbi, ni_reparse_tag(attr), &ref);
 		} else if (attr->type == ATTR_ID && !attr->non_res &&
 			   le32_to_cpu(attr->res.data_size) >=
 				   sizeof(struct GUID)) {
@@ -1559,8 +1600,8 @@ int ni_delete_all(struct ntfs_inode *ni)
 			      Add2Ptr(attr, roff), asize - roff);
 	}
 
-	if (ni->attr_list.size) {
-		run_deallocate(ni->mi.sbi, &ni->attr_list.run, true);
+	if (ni->attr_list) {
+		run_deallocate(ni->mi.sbi, &ni->attr_list->run, true);
 		al_destroy(ni);
 	}
 
@@ -1664,11 +1705,13 @@ struct ATTR_FILE_NAME *ni_fname_type(struct ntfs_inode *ni, u8 name_type,
 int ni_new_attr_flags(struct ntfs_inode *ni, enum FILE_ATTRIBUTE new_fa)
 {
 	struct ATTRIB *attr;
+	struct ATTR_LIST_ENTRY *le = NULL;
 	struct mft_inode *mi;
 	__le16 new_aflags;
 	u32 new_asize;
+	int err;
 
-	attr = ni_find_attr(ni, NULL, NULL, ATTR_DATA, NULL, 0, NULL, &mi);
+	attr = ni_find_attr(ni, NULL, &le, ATTR_DATA, NULL, 0, NULL, &mi);
 	if (!attr)
 		return -EINVAL;
 
@@ -1694,8 +1737,32 @@ int ni_new_attr_flags(struct ntfs_inode *ni, enum FILE_ATTRIBUTE new_fa)
 		return -EOPNOTSUPP;
 	}
 
-	if (!attr->non_res)
-		goto out;
+	if ((new_aflags & ATTR_FLAG_COMPRESSED) &&
+	    ni->mi.sbi->cluster_size > ntfs_lznt_max_cluster(ni->mi.sbi)) {
+		ntfs_inode_warn(&ni->vfs_inode,
+				"cluster is too big to compress file");
+		return -EOPNOTSUPP;
+	}
+
+	if (!attr->non_res) {
+		if (attr->res.data_size ||
+		    !(new_aflags & (ATTR_FLAG_COMPRESSED | ATTR_FLAG_SPARSED)))
+			goto out;
+
+		/* new files are resident, see ntfs_create_inode */
+		down_write(&ni->file.run_lock);
+		err = attr_make_nonresident(ni, attr, le, mi, 0, &ni->file.run,
+					    &attr, NULL);
+		up_write(&ni->file.run_lock);
+		if (err)
+			return err;
+
+		le = NULL;
+		attr = ni_find_attr(ni, NULL, &le, ATTR_DATA, NULL, 0, NULL,
+				    &mi);
+		if (!attr)
+			return -EINVAL;
+	}
 
 	if (attr->nres.data_size) {
 		ntfs_inode_warn(
@@ -2014,9 +2081,50 @@ out:
 	return err;
 }
 
+/*
+ * ni_readahead_frames
+ *
+ * returns the number of frames to read starting from 'frame'
+ * Following frames are read only if access looks sequential
+ */
+static u32 ni_readahead_frames(struct ntfs_inode *ni, CLST frame,
+			       u8 frame_bits)
+{
+	struct inode *inode = &ni->vfs_inode;
+	struct address_space *mapping = inode->i_mapping;
+	u64 frame_vbo = (u64)frame << frame_bits;
+	u64 last = (i_size_read(inode) - 1) >> frame_bits;
+	u32 pages_per_frame, nframes;
+	struct page *pg;
+
+	if (frame_bits < PAGE_SHIFT)
+		return 1;
+
+	pages_per_frame = 1u << (frame_bits - PAGE_SHIFT);
+	nframes = inode_to_bdi(inode)->ra_pages / pages_per_frame;
+
+	if (nframes > NTFS_READ_FRAMES)
+		nframes = NTFS_READ_FRAMES;
+	if (nframes > last - frame + 1)
+		nframes = last - frame + 1;
+	if (nframes <= 1)
+		return 1;
+
+	if (frame) {
+		/* previous page should be in cache */
+		pg = find_get_page(mapping, (frame_vbo >> PAGE_SHIFT) - 1);
+		if (!pg)
+			return 1;
+		put_page(pg);
+	}
+
+	return nframes;
+}
+
 /*
  * When decompressing, we typically obtain more than one page per reference.
  * We inject the additional pages into the page cache.
+ * For sequential access the following frames are read in the same batch
  */
 int ni_readpage_cmpr(struct ntfs_inode *ni, struct page *page)
 {
@@ -2025,10 +2133,10 @@ int ni_readpage_cmpr(struct ntfs_inode *ni, struct page *page)
 	struct address_space *mapping = page->mapping;
 	pgoff_t index = page->index;
 	u64 frame_vbo, vbo = (u64)index << PAGE_SHIFT;
-	struct page **pages = NULL; /*array of at most 16 pages. stack?*/
+	struct page **pages = NULL; /*array of at most 8 frames*/
 	u8 frame_bits;
 	CLST frame;
-	u32 i, idx, frame_size, pages_per_frame;
+	u32 i, k, idx, frame_size, pages_per_frame, nframes;
 	gfp_t gfp_mask;
 	struct page *pg;
 
@@ -2051,7 +2159,8 @@ int ni_readpage_cmpr(struct ntfs_inode *ni, struct page *page)
 	idx = (vbo - frame_vbo) >> PAGE_SHIFT;
 
 	pages_per_frame = frame_size >> PAGE_SHIFT;
-	pages = ntfs_zalloc(pages_per_frame * sizeof(struct page *));
+	nframes = ni_readahead_frames(ni, frame, frame_bits);
+	pages = ntfs_zalloc(nframes * pages_per_frame * sizeof(struct page *));
 	if (!pages) {
 		err = -ENOMEM;
 		goto out;
@@ -2073,15 +2182,48 @@ int ni_readpage_cmpr(struct ntfs_inode *ni, struct page *page)
 		pages[i] = pg;
 	}
 
-	err = ni_read_frame(ni, frame_vbo, pages, pages_per_frame);
+	/*
+	 * Pages of the following frames are taken without waiting.
+	 * Stop at the first frame which is (partially) in cache
+	 */
+	for (k = 1; k < nframes; k++) {
+		for (i = 0; i < pages_per_frame; i++, index++) {
+			pg = pagecache_get_page(mapping, index,
+						FGP_LOCK | FGP_CREAT |
+							FGP_NOWAIT,
+						readahead_gfp_mask(mapping));
+			if (!pg)
+				break;
+
+			if (PageUptodate(pg)) {
+				unlock_page(pg);
+				put_page(pg);
+				break;
+			}
+			pages[k * pages_per_frame + i] = pg;
+		}
+
+		if (i < pages_per_frame) {
+			while (i--) {
+				pg = pages[k * pages_per_frame + i];
+				pages[k * pages_per_frame + i] = NULL;
+				unlock_page(pg);
+				put_page(pg);
+			}
+			break;
+		}
+	}
+	nframes = k;
+
+	err = ni_read_frames(ni, frame_vbo, pages, pages_per_frame, nframes);
 
 out1:
 	if (err)
 		SetPageError(page);
 
-	for (i = 0; i < pages_per_frame; i++) {
+	for (i = 0; i < nframes * pages_per_frame; i++) {
 		pg = pages[i];
-		if (i == idx)
+		if (i == idx || !pg)
 			continue;
 		unlock_page(pg);
 		put_page(pg);
@@ -2215,7 +2357,7 @@ remove_wof:
 			struct MFT_REF ref;
 
 			mi_get_ref(&ni->mi, &ref);
-			ntfs_remove_reparse(sbi, 0, &ref);
+			ntfs_remove_reparse(sbi, ni_reparse_tag(attr), &ref);
 		}
 
 		if (!attr->non_res)
@@ -2288,10 +2430,14 @@ remove_wof:
 
 	/* clear cached flag */
 	ni->ni_flags &= ~NI_FLAG_COMPRESSED_MASK;
+	down_write(&ni->file.run_lock);
 	if (ni->file.offs_page) {
 		put_page(ni->file.offs_page);
 		ni->file.offs_page = NULL;
 	}
+	run_free(ni->file.wof_run);
+	ni->file.wof_run = NULL;
+	up_write(&ni->file.run_lock);
 	mapping->a_ops = &ntfs_aops;
 
 out:
@@ -2364,41 +2510,411 @@ out2:
 	}
 	return err;
 }
+
+/*
+ * ni_load_wof_runs
+ *
+ * loads all runs of ATTR_DATA::WofCompressedData once
+ * and keeps them in ni->file.wof_run
+ */
+static int ni_load_wof_runs(struct ntfs_inode *ni, struct ATTRIB *attr)
+{
+	int err = 0;
+	struct runs_tree *run;
+	bool loaded;
+
+	down_read(&ni->file.run_lock);
+	loaded = !!ni->file.wof_run;
+	up_read(&ni->file.run_lock);
+	if (loaded)
+		return 0;
+
+	down_write(&ni->file.run_lock);
+	if (ni->file.wof_run)
+		goto out;
+
+	run = run_alloc();
+	if (!run) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = attr_load_runs_range(ni, ATTR_DATA, WOF_NAME,
+				   ARRAY_SIZE(WOF_NAME), run, 0,
+				   le64_to_cpu(attr->nres.data_size));
+	if (err) {
+		run_free(run);
+		goto out;
+	}
+
+	ni->file.wof_run = run;
+
+out:
+	up_write(&ni->file.run_lock);
+	return err;
+}
 #endif
 
+/* State of one frame in ni_read_frames */
+struct ntfs_frame_io {
+	struct bio *bio; // parent of all bios of frame
+	struct completion done;
+	u64 vbo_disk; // offset of on-disk data in stream
+	u32 ondisk_size; // 0 if frame is zero
+	u32 unc_size;
+	u32 page; // first page of frame in 'disk'
+	bool raw; // frame is not compressed and is read into page cache
+};
+
 /*
- * ni_read_frame
+ * Pool of contiguous buffers for compressed frames up to NTFS_KEEP_FRAME.
+ * Decompressors and compressor work with them instead of vmap-ed pages.
+ * Any task takes any free buffer, so task waiting for disk does not block
+ * other tasks on its cpu. Buffers are allocated on demand (not more than
+ * one per cpu) and are kept till module unload.
+ * Buffer is made of vmap-ed order-0 pages if there are no high order ones.
+ * Bigger frames (big clusters) use separate pool of NTFS_BIG_FRAME_BUFS
+ * buffers of NTFS_MAX_FRAME, so buffers for usual frames never grow
+ */
+struct ntfs_frame_buf {
+	struct list_head list; // in ntfs_frame_pool::free
+	struct ntfs_frame_pool *pool; // pool of buffer
+	char *unc; // uncompressed frame
+	char *disk; // frame(s) as it is on disk
+	u32 unc_order;
+	u32 disk_pages; // size of 'disk' in pages
+	u32 disk_order;
+	bool vmapped; // 'unc' and 'disk' are vmap-ed order-0 pages
+	struct page **unc_pages; // pages of 'unc' if vmapped
+	/* pages of 'disk': several small frames or one big frame */
+	struct page *pages[NTFS_MAX_FRAME >> PAGE_SHIFT];
+	struct ntfs_frame_io io[NTFS_READ_FRAMES];
+};
+
+struct ntfs_frame_pool {
+	spinlock_t lock;
+	struct list_head free; // buffers not in use
+	wait_queue_head_t wait; // tasks waiting for free buffer
+	u32 count; // allocated buffers
+	u32 max;
+};
+
+static struct ntfs_frame_pool ntfs_frame_pool;
+static struct ntfs_frame_pool ntfs_big_frame_pool;
+
+/*
+ * ntfs_free_frame_buf
+ */
+static void ntfs_free_frame_buf(struct ntfs_frame_buf *fb)
+{
+	u32 i;
+
+	if (!fb->vmapped) {
+		free_pages((unsigned long)fb->unc, fb->unc_order);
+		free_pages((unsigned long)fb->disk, fb->disk_order);
+		ntfs_free(fb);
+		return;
+	}
+
+	if (fb->unc)
+		vunmap(fb->unc);
+	if (fb->disk)
+		vunmap(fb->disk);
+
+	for (i = 0; i < fb->disk_pages; i++) {
+		if (fb->unc_pages[i])
+			__free_page(fb->unc_pages[i]);
+		if (fb->pages[i])
+			__free_page(fb->pages[i]);
+	}
+
+	ntfs_free(fb);
+}
+
+/*
+ * ntfs_alloc_frame_vmap
  *
- * pages - array of locked pages
+ * allocates buffers for one frame from order-0 pages
  */
-int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
-		  u32 pages_per_frame)
+static struct ntfs_frame_buf *ntfs_alloc_frame_vmap(u32 frame_size)
 {
-	int err;
+	struct ntfs_frame_buf *fb;
+	u32 i, npages = frame_size >> PAGE_SHIFT;
+
+	fb = ntfs_zalloc(sizeof(*fb) + npages * sizeof(struct page *));
+	if (!fb)
+		return NULL;
+
+	fb->vmapped = true;
+	fb->unc_pages = (struct page **)(fb + 1);
+	fb->disk_pages = npages;
+
+	for (i = 0; i < npages; i++) {
+		fb->unc_pages[i] = alloc_page(GFP_NOFS);
+		if (!fb->unc_pages[i])
+			goto out;
+
+		fb->pages[i] = alloc_page(GFP_NOFS);
+		if (!fb->pages[i])
+			goto out;
+	}
+
+	fb->unc = vmap(fb->unc_pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!fb->unc)
+		goto out;
+
+	fb->disk = vmap(fb->pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!fb->disk)
+		goto out;
+
+	return fb;
+
+out:
+	ntfs_free_frame_buf(fb);
+	return NULL;
+}
+
+/*
+ * ntfs_alloc_frame_buf
+ *
+ * allocates contiguous buffers for frames up to 'frame_size'
+ * Falls back to order-0 pages
+ */
+static struct ntfs_frame_buf *ntfs_alloc_frame_buf(u32 frame_size)
+{
+	struct ntfs_frame_buf *fb;
+	struct page *page;
+	u32 i, order;
+
+	fb = ntfs_zalloc(sizeof(*fb));
+	if (!fb)
+		return NULL;
+
+	order = get_order(frame_size);
+	page = alloc_pages(GFP_NOFS | __GFP_NOWARN, order);
+	if (!page)
+		goto out;
+	fb->unc = page_address(page);
+	fb->unc_order = order;
+
+	/* Try to get room for several frames. One is enough to work */
+	order = get_order(max_t(u32, NTFS_FRAME_DISK, frame_size));
+	page = alloc_pages(GFP_NOFS | __GFP_NOWARN, order);
+	if (!page) {
+		order = get_order(frame_size);
+		page = alloc_pages(GFP_NOFS | __GFP_NOWARN, order);
+		if (!page)
+			goto out1;
+	}
+	fb->disk = page_address(page);
+	fb->disk_order = order;
+	fb->disk_pages = 1u << order;
+	for (i = 0; i < fb->disk_pages; i++)
+		fb->pages[i] = page + i;
+
+	return fb;
+
+out1:
+	free_pages((unsigned long)fb->unc, fb->unc_order);
+out:
+	/* No high order pages. Use order-0 ones */
+	ntfs_free(fb);
+	return ntfs_alloc_frame_vmap(frame_size);
+}
+
+static void ntfs_frame_pool_init(struct ntfs_frame_pool *pool, u32 max)
+{
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	init_waitqueue_head(&pool->wait);
+	pool->count = 0;
+	pool->max = max;
+}
+
+static void ntfs_frame_pool_free(struct ntfs_frame_pool *pool)
+{
+	struct ntfs_frame_buf *fb, *tmp;
+
+	list_for_each_entry_safe(fb, tmp, &pool->free, list)
+		ntfs_free_frame_buf(fb);
+	INIT_LIST_HEAD(&pool->free);
+	pool->count = 0;
+}
+
+/*
+ * ntfs_frame_pool_get
+ *
+ * takes free buffer of pool. Allocates new one if all are in use
+ * and pool is not full, otherwise waits for buffer
+ */
+static struct ntfs_frame_buf *ntfs_frame_pool_get(struct ntfs_frame_pool *pool,
+						  u32 frame_size)
+{
+	struct ntfs_frame_buf *fb;
+	bool tried = false;
+
+	spin_lock(&pool->lock);
+	while (list_empty(&pool->free)) {
+		if (pool->count < pool->max && !tried) {
+			pool->count += 1;
+			spin_unlock(&pool->lock);
+
+			fb = ntfs_alloc_frame_buf(frame_size);
+			if (fb) {
+				fb->pool = pool;
+				return fb;
+			}
+
+			tried = true;
+			spin_lock(&pool->lock);
+			pool->count -= 1;
+			if (!pool->count) {
+				/* No buffer to wait for */
+				spin_unlock(&pool->lock);
+				return NULL;
+			}
+			continue;
+		}
+
+		spin_unlock(&pool->lock);
+		wait_event(pool->wait, !list_empty_careful(&pool->free));
+		spin_lock(&pool->lock);
+	}
+
+	fb = list_first_entry(&pool->free, struct ntfs_frame_buf, list);
+	list_del(&fb->list);
+	spin_unlock(&pool->lock);
+
+	return fb;
+}
+
+int __init ntfs3_init_frame_bufs(void)
+{
+	ntfs_frame_pool_init(&ntfs_frame_pool, num_possible_cpus());
+	ntfs_frame_pool_init(&ntfs_big_frame_pool, NTFS_BIG_FRAME_BUFS);
+	return 0;
+}
+
+void ntfs3_exit_frame_bufs(void)
+{
+	ntfs_frame_pool_free(&ntfs_frame_pool);
+	ntfs_frame_pool_free(&ntfs_big_frame_pool);
+}
+
+/*
+ * ntfs_get_frame_buf
+ *
+ * takes buffers for frame up to 'frame_size'
+ */
+static struct ntfs_frame_buf *ntfs_get_frame_buf(u32 frame_size)
+{
+	if (frame_size > NTFS_KEEP_FRAME)
+		return ntfs_frame_pool_get(&ntfs_big_frame_pool,
+					   NTFS_MAX_FRAME);
+
+	return ntfs_frame_pool_get(&ntfs_frame_pool, NTFS_KEEP_FRAME);
+}
+
+static inline void ntfs_put_frame_buf(struct ntfs_frame_buf *fb)
+{
+	struct ntfs_frame_pool *pool = fb->pool;
+
+	spin_lock(&pool->lock);
+	list_add(&fb->list, &pool->free);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+/*
+ * ntfs_frame_to_pages
+ *
+ * copies frame from buffer into page cache pages
+ */
+static void ntfs_frame_to_pages(struct page **pages, u32 npages,
+				const char *frame)
+{
+	u32 i;
+	char *kaddr;
+
+	for (i = 0; i < npages; i++, frame += PAGE_SIZE) {
+		kaddr = kmap_atomic(pages[i]);
+		memcpy(kaddr, frame, PAGE_SIZE);
+		kunmap_atomic(kaddr);
+	}
+}
+
+/*
+ * ntfs_pages_to_frame
+ *
+ * copies page cache pages into frame buffer
+ */
+static void ntfs_pages_to_frame(char *frame, struct page **pages, u32 npages)
+{
+	u32 i;
+	char *kaddr;
+
+	for (i = 0; i < npages; i++, frame += PAGE_SIZE) {
+		kaddr = kmap_atomic(pages[i]);
+		memcpy(frame, kaddr, PAGE_SIZE);
+		kunmap_atomic(kaddr);
+	}
+}
+
+static void ntfs_frame_end_io(struct bio *bio)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * ni_read_frames
+ *
+ * reads 'nframes' consecutive frames starting from 'frame_vbo'
+ * pages - array of locked pages, 'pages_per_frame' for each frame
+ * On-disk data of all frames is submitted as one plugged batch
+ * and each frame is decompressed as soon as its bios are completed.
+ * Pages of the first frame are always marked uptodate.
+ * Pages of other frames are marked uptodate only if they are read
+ */
+int ni_read_frames(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
+		   u32 pages_per_frame, u32 nframes)
+{
+	int err, err2;
 	struct ntfs_sb_info *sbi = ni->mi.sbi;
 	u8 cluster_bits = sbi->cluster_bits;
-	char *frame_ondisk = NULL;
-	char *frame_mem = NULL;
-	struct page **pages_disk = NULL;
+	struct ntfs_frame_buf *fb;
+	struct ntfs_frame_io *io;
 	struct ATTR_LIST_ENTRY *le = NULL;
 	struct runs_tree *run = &ni->file.run;
 	u64 valid_size = ni->i_valid;
-	u64 vbo_disk;
+	u64 vbo;
 	size_t unc_size;
-	u32 frame_size, i, npages_disk, ondisk_size;
+	u32 frame_size, i, k, npages, used;
+	u32 uptodate = 0; // bit per frame
 	struct page *pg;
+	struct page **fpages;
 	struct ATTRIB *attr;
+	struct blk_plug plug;
+	const char *src;
 	CLST frame, clst_data;
+	bool wof = false;
+#ifdef CONFIG_NTFS3_LZX_XPRESS
+	u8 frame_bits = 0;
+	u64 frame64, frames = 0, vbo_data;
+#endif
+
+	frame_size = pages_per_frame << PAGE_SHIFT;
+	if (frame_size > NTFS_MAX_FRAME || !nframes ||
+	    nframes > NTFS_READ_FRAMES) {
+		err = -EINVAL;
+		goto out;
+	}
 
 	/*
-	 * To simplify decompress algorithm do vmap for source and target pages
+	 * Frames are decompressed into pooled buffer
+	 * and then copied into pages
 	 */
-	for (i = 0; i < pages_per_frame; i++)
-		kmap(pages[i]);
-
-	frame_size = pages_per_frame << PAGE_SHIFT;
-	frame_mem = vmap(pages, pages_per_frame, VM_MAP, PAGE_KERNEL);
-	if (!frame_mem) {
+	fb = ntfs_get_frame_buf(frame_size);
+	if (!fb) {
 		err = -ENOMEM;
 		goto out;
 	}
@@ -2412,30 +2928,27 @@ int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
 	if (!attr->non_res) {
 		u32 data_size = le32_to_cpu(attr->res.data_size);
 
-		memset(frame_mem, 0, frame_size);
-		if (frame_vbo < data_size) {
-			ondisk_size = data_size - frame_vbo;
-			memcpy(frame_mem, resident_data(attr) + frame_vbo,
-			       min(ondisk_size, frame_size));
+		for (k = 0; k < nframes; k++) {
+			vbo = frame_vbo + (u64)k * frame_size;
+			memset(fb->unc, 0, frame_size);
+			if (vbo < data_size) {
+				memcpy(fb->unc, resident_data(attr) + vbo,
+				       min_t(u64, data_size - vbo, frame_size));
+			}
+			ntfs_frame_to_pages(pages + k * pages_per_frame,
+					    pages_per_frame, fb->unc);
+			uptodate |= 1u << k;
 		}
 		err = 0;
 		goto out1;
 	}
 
-	if (frame_vbo >= valid_size) {
-		memset(frame_mem, 0, frame_size);
-		err = 0;
-		goto out1;
-	}
-
 	if (ni->ni_flags & NI_FLAG_COMPRESSED_MASK) {
 #ifndef CONFIG_NTFS3_LZX_XPRESS
 		err = -EOPNOTSUPP;
 		goto out1;
 #else
-		u32 frame_bits = ni_ext_compress_bits(ni);
-		u64 frame64 = frame_vbo >> frame_bits;
-		u64 frames, vbo_data;
+		frame_bits = ni_ext_compress_bits(ni);
 
 		if (frame_size != (1u << frame_bits)) {
 			err = -EINVAL;
@@ -2463,62 +2976,23 @@ int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
 			goto out1;
 		}
 
-		if (!attr->non_res) {
-			run = NULL;
-		} else {
-			run = run_alloc();
-			if (!run) {
-				err = -ENOMEM;
+		/*
+		 * ni->file.wof_run is used only under run_lock:
+		 * ni_decompress_file frees it
+		 */
+		run = NULL;
+		if (attr->non_res) {
+			err = ni_load_wof_runs(ni, attr);
+			if (err)
 				goto out1;
-			}
 		}
 
 		frames = (ni->vfs_inode.i_size - 1) >> frame_bits;
-
-		err = attr_wof_frame_info(ni, attr, run, frame64, frames,
-					  frame_bits, &ondisk_size, &vbo_data);
-		if (err)
-			goto out2;
-
-		if (frame64 == frames) {
-			unc_size = 1 + ((ni->vfs_inode.i_size - 1) &
-					(frame_size - 1));
-			ondisk_size = attr_size(attr) - vbo_data;
-		} else {
-			unc_size = frame_size;
-		}
-
-		if (ondisk_size > frame_size) {
-			err = -EINVAL;
-			goto out2;
-		}
-
-		if (!attr->non_res) {
-			if (vbo_data + ondisk_size >
-			    le32_to_cpu(attr->res.data_size)) {
-				err = -EINVAL;
-				goto out1;
-			}
-
-			err = decompress_lzx_xpress(
-				sbi, Add2Ptr(resident_data(attr), vbo_data),
-				ondisk_size, frame_mem, unc_size, frame_size);
-			goto out1;
-		}
-		vbo_disk = vbo_data;
-		/* load all runs to read [vbo_disk-vbo_to) */
-		err = attr_load_runs_range(ni, ATTR_DATA, WOF_NAME,
-					   ARRAY_SIZE(WOF_NAME), run, vbo_disk,
-					   vbo_data + ondisk_size);
-		if (err)
-			goto out2;
-		npages_disk = (ondisk_size + (vbo_disk & (PAGE_SIZE - 1)) +
-			       PAGE_SIZE - 1) >>
-			      PAGE_SHIFT;
+		wof = true;
 #endif
 	} else if (is_attr_compressed(attr)) {
-		/* lznt compression*/
-		if (sbi->cluster_size > NTFS_LZNT_MAX_CLUSTER) {
+		/* lznt compression. Big clusters are read in any case */
+		if (sbi->cluster_size > NTFS_LZNT_MAX_CLUSTER_EX) {
 			err = -EOPNOTSUPP;
 			goto out1;
 		}
@@ -2528,128 +3002,268 @@ int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
 			goto out1;
 		}
 
-		down_write(&ni->file.run_lock);
-		run_truncate_around(run, le64_to_cpu(attr->nres.svcn));
-		frame = frame_vbo >> (cluster_bits + NTFS_LZNT_CUNIT);
-		err = attr_is_frame_compressed(ni, attr, frame, &clst_data);
-		up_write(&ni->file.run_lock);
-		if (err)
-			goto out1;
-
-		if (!clst_data) {
-			memset(frame_mem, 0, frame_size);
+		if (frame_size != sbi->cluster_size << NTFS_LZNT_CUNIT) {
+			err = -EINVAL;
 			goto out1;
 		}
 
-		frame_size = sbi->cluster_size << NTFS_LZNT_CUNIT;
-		ondisk_size = clst_data << cluster_bits;
-
-		if (clst_data >= NTFS_LZNT_CLUSTERS) {
-			/* frame is not compressed */
-			down_read(&ni->file.run_lock);
-			err = ntfs_bio_pages(sbi, run, pages, pages_per_frame,
-					     frame_vbo, ondisk_size,
-					     REQ_OP_READ);
-			up_read(&ni->file.run_lock);
-			goto out1;
-		}
-		vbo_disk = frame_vbo;
-		npages_disk = (ondisk_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		down_write(&ni->file.run_lock);
+		run_truncate_around(run, le64_to_cpu(attr->nres.svcn));
+		up_write(&ni->file.run_lock);
 	} else {
 		__builtin_unreachable();
 		err = -EINVAL;
 		goto out1;
 	}
 
-	pages_disk = ntfs_zalloc(npages_disk * sizeof(struct page *));
-	if (!pages_disk) {
-		err = -ENOMEM;
-		goto out2;
-	}
+	/* Step 1: get on-disk layout of frames */
+	for (k = 0, used = 0; k < nframes; k++) {
+		io = fb->io + k;
+		io->bio = NULL;
+		io->ondisk_size = 0;
+		io->unc_size = frame_size;
+		io->raw = false;
+		vbo = frame_vbo + (u64)k * frame_size;
 
-	for (i = 0; i < npages_disk; i++) {
-		pg = alloc_page(GFP_KERNEL);
-		if (!pg) {
-			err = -ENOMEM;
-			goto out3;
-		}
-		pages_disk[i] = pg;
-		lock_page(pg);
-		kmap(pg);
-	}
+		if (vbo >= valid_size)
+			continue;
 
-	/* read 'ondisk_size' bytes from disk */
-	down_read(&ni->file.run_lock);
-	err = ntfs_bio_pages(sbi, run, pages_disk, npages_disk, vbo_disk,
-			     ondisk_size, REQ_OP_READ);
-	up_read(&ni->file.run_lock);
-	if (err)
-		goto out3;
+		if (wof) {
+#ifdef CONFIG_NTFS3_LZX_XPRESS
+			frame64 = vbo >> frame_bits;
+			err = attr_wof_frame_info(ni, attr, frame64, frames,
+						  frame_bits, &io->ondisk_size,
+						  &vbo_data);
+			if (err)
+				break;
 
-	/*
-	 * To simplify decompress algorithm do vmap for source and target pages
-	 */
-	frame_ondisk = vmap(pages_disk, npages_disk, VM_MAP, PAGE_KERNEL_RO);
-	if (!frame_ondisk) {
-		err = -ENOMEM;
-		goto out3;
+			if (frame64 == frames) {
+				io->unc_size = 1 + ((ni->vfs_inode.i_size - 1) &
+						    (frame_size - 1));
+				io->ondisk_size = attr_size(attr) - vbo_data;
+			}
+
+			if (io->ondisk_size > frame_size) {
+				err = -EINVAL;
+				break;
+			}
+
+			if (!attr->non_res) {
+				if (vbo_data + io->ondisk_size >
+				    le32_to_cpu(attr->res.data_size)) {
+					err = -EINVAL;
+					break;
+				}
+
+				err = decompress_lzx_xpress(
+					sbi,
+					Add2Ptr(resident_data(attr), vbo_data),
+					io->ondisk_size, fb->unc, io->unc_size,
+					frame_size);
+				if (err)
+					break;
+
+				ntfs_frame_to_pages(pages + k * pages_per_frame,
+						    pages_per_frame, fb->unc);
+				uptodate |= 1u << k;
+				io->ondisk_size = 0;
+				continue;
+			}
+			io->vbo_disk = vbo_data;
+#endif
+		} else {
+			frame = vbo >> (cluster_bits + NTFS_LZNT_CUNIT);
+			down_write(&ni->file.run_lock);
+			err = attr_is_frame_compressed(ni, attr, frame,
+						       &clst_data);
+			up_write(&ni->file.run_lock);
+			if (err)
+				break;
+
+			if (!clst_data)
+				continue;
+
+			io->ondisk_size = clst_data << cluster_bits;
+			io->vbo_disk = vbo;
+
+			if (clst_data >= NTFS_LZNT_CLUSTERS) {
+				/* frame is not compressed */
+				io->raw = true;
+				continue;
+			}
+		}
+
+		npages = (io->ondisk_size + (io->vbo_disk & (PAGE_SIZE - 1)) +
+			  PAGE_SIZE - 1) >>
+			 PAGE_SHIFT;
+		if (used + npages > fb->disk_pages) {
+			/* No room. Rest of frames will be read later */
+			if (!k)
+				err = -EINVAL;
+			io->ondisk_size = 0;
+			break;
+		}
+		io->page = used;
+		used += npages;
 	}
 
-	/* decompress: frame_ondisk -> frame_mem */
+	/* Failed frame (but not the first one) will be read later */
+	if (k)
+		err = 0;
+	else if (err)
+		goto out1;
+	nframes = k;
+
+	/* Step 2: submit bios of all frames */
+	blk_start_plug(&plug);
+	down_read(&ni->file.run_lock);
 #ifdef CONFIG_NTFS3_LZX_XPRESS
-	if (run != &ni->file.run) {
-		/* LZX or XPRESS */
-		err = decompress_lzx_xpress(
-			sbi, frame_ondisk + (vbo_disk & (PAGE_SIZE - 1)),
-			ondisk_size, frame_mem, unc_size, frame_size);
-	} else
+	if (wof)
+		run = ni->file.wof_run;
 #endif
-	{
-		/* LZNT - native ntfs compression */
-		unc_size = decompress_lznt(frame_ondisk, ondisk_size, frame_mem,
-					   frame_size);
-		if ((ssize_t)unc_size < 0)
-			err = unc_size;
-		else if (!unc_size || unc_size > frame_size)
+	for (k = 0; k < nframes; k++) {
+		io = fb->io + k;
+		if (!io->ondisk_size)
+			continue;
+
+		if (!run) {
+			/* file is decompressed */
 			err = -EINVAL;
-	}
-	if (!err && valid_size < frame_vbo + frame_size) {
-		size_t ok = valid_size - frame_vbo;
+			break;
+		}
+
+		if (io->raw) {
+			fpages = pages + k * pages_per_frame;
+			npages = pages_per_frame;
+		} else {
+			fpages = fb->pages + io->page;
+			npages = fb->disk_pages - io->page;
+		}
+
+		err = ntfs_bio_pages_start(sbi, run, fpages, npages,
+					   io->vbo_disk, io->ondisk_size,
+					   REQ_OP_READ, &io->bio);
+		if (err) {
+			if (io->bio) {
+				bio_put(io->bio);
+				io->bio = NULL;
+			}
+			break;
+		}
 
-		memset(frame_mem + ok, 0, frame_size - ok);
+		init_completion(&io->done);
+		io->bio->bi_private = &io->done;
+		io->bio->bi_end_io = ntfs_frame_end_io;
+		submit_bio(io->bio);
 	}
+	up_read(&ni->file.run_lock);
+	blk_finish_plug(&plug);
 
-	vunmap(frame_ondisk);
+	if (k)
+		err = 0;
+	else if (err)
+		goto out1;
+	nframes = k;
+
+	/* Step 3: wait and decompress frames one by one */
+	for (k = 0; k < nframes; k++) {
+		io = fb->io + k;
+		vbo = frame_vbo + (u64)k * frame_size;
+
+		if (uptodate & (1u << k))
+			continue;
 
-out3:
-	for (i = 0; i < npages_disk; i++) {
-		pg = pages_disk[i];
-		if (pg) {
-			kunmap(pg);
-			unlock_page(pg);
-			put_page(pg);
+		err2 = 0;
+		if (io->bio) {
+			wait_for_completion_io(&io->done);
+			err2 = blk_status_to_errno(io->bio->bi_status);
+			bio_put(io->bio);
+			io->bio = NULL;
 		}
-	}
-	ntfs_free(pages_disk);
 
-out2:
+		if (err2 || io->raw)
+			goto next;
+
+		if (!io->ondisk_size) {
+			/* sparse frame or frame after valid size */
+			memset(fb->unc, 0, frame_size);
+			goto copy;
+		}
+
+		/* decompress: on-disk data -> fb->unc */
+		src = fb->disk + (io->page << PAGE_SHIFT) +
+		      (io->vbo_disk & (PAGE_SIZE - 1));
 #ifdef CONFIG_NTFS3_LZX_XPRESS
-	if (run != &ni->file.run)
-		run_free(run);
+		if (wof) {
+			/* LZX or XPRESS */
+			err2 = decompress_lzx_xpress(sbi, src, io->ondisk_size,
+						     fb->unc, io->unc_size,
+						     frame_size);
+			unc_size = io->unc_size;
+		} else
 #endif
+		{
+			/* LZNT - native ntfs compression */
+			unc_size = decompress_lznt(src, io->ondisk_size,
+						   fb->unc, frame_size);
+			if ((ssize_t)unc_size < 0)
+				err2 = unc_size;
+			else if (!unc_size || unc_size > frame_size)
+				err2 = -EINVAL;
+		}
+		if (err2)
+			goto next;
+
+		/* Don't expose stale data of buffer */
+		if (unc_size < frame_size)
+			memset(fb->unc + unc_size, 0, frame_size - unc_size);
+
+		if (valid_size < vbo + frame_size) {
+			size_t ok = valid_size - vbo;
+
+			memset(fb->unc + ok, 0, frame_size - ok);
+		}
+
+copy:
+		ntfs_frame_to_pages(pages + k * pages_per_frame,
+				    pages_per_frame, fb->unc);
+next:
+		if (!err2)
+			uptodate |= 1u << k;
+		else if (!k)
+			err = err2;
+	}
+
 out1:
-	vunmap(frame_mem);
+	ntfs_put_frame_buf(fb);
 out:
-	for (i = 0; i < pages_per_frame; i++) {
-		pg = pages[i];
-		kunmap(pg);
-		ClearPageError(pg);
-		SetPageUptodate(pg);
+	/* pages of the first frame are always uptodate */
+	uptodate |= 1;
+	for (k = 0; uptodate >> k; k++) {
+		if (!(uptodate & (1u << k)))
+			continue;
+
+		for (i = 0; i < pages_per_frame; i++) {
+			pg = pages[k * pages_per_frame + i];
+			ClearPageError(pg);
+			SetPageUptodate(pg);
+		}
 	}
 
 	return err;
 }
 
+/*
+ * ni_read_frame
+ *
+ * pages - array of locked pages
+ */
+int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
+		  u32 pages_per_frame)
+{
+	return ni_read_frames(ni, frame_vbo, pages, pages_per_frame, 1);
+}
+
 /*
  * ni_write_frame
  *
@@ -2664,16 +3278,14 @@ int ni_write_frame(struct ntfs_inode *ni, struct page **pages,
 	u32 frame_size = sbi->cluster_size << NTFS_LZNT_CUNIT;
 	u64 frame_vbo = (u64)pages[0]->index << PAGE_SHIFT;
 	CLST frame = frame_vbo >> frame_bits;
-	char *frame_ondisk = NULL;
-	struct page **pages_disk = NULL;
+	struct ntfs_frame_buf *fb;
+	char *frame_ondisk;
 	struct ATTR_LIST_ENTRY *le = NULL;
 	char *frame_mem;
 	struct ATTRIB *attr;
 	struct mft_inode *mi;
-	u32 i;
-	struct page *pg;
 	size_t compr_size, ondisk_size;
-	struct lznt *lznt;
+	u32 i;
 
 	attr = ni_find_attr(ni, NULL, &le, ATTR_DATA, NULL, 0, NULL, &mi);
 	if (!attr) {
@@ -2686,7 +3298,7 @@ int ni_write_frame(struct ntfs_inode *ni, struct page **pages,
 		goto out;
 	}
 
-	if (sbi->cluster_size > NTFS_LZNT_MAX_CLUSTER) {
+	if (sbi->cluster_size > ntfs_lznt_max_cluster(sbi)) {
 		err = -EOPNOTSUPP;
 		goto out;
 	}
@@ -2706,67 +3318,48 @@ int ni_write_frame(struct ntfs_inode *ni, struct page **pages,
 		goto out;
 	}
 
-	pages_disk = ntfs_zalloc(pages_per_frame * sizeof(struct page *));
-	if (!pages_disk) {
-		err = -ENOMEM;
+	if ((pages_per_frame << PAGE_SHIFT) > NTFS_MAX_FRAME) {
+		err = -EINVAL;
 		goto out;
 	}
 
-	for (i = 0; i < pages_per_frame; i++) {
-		pg = alloc_page(GFP_KERNEL);
-		if (!pg) {
-			err = -ENOMEM;
-			goto out1;
-		}
-		pages_disk[i] = pg;
-		lock_page(pg);
-		kmap(pg);
-	}
-
-	/*
-	 * To simplify compress algorithm do vmap for source and target pages
-	 */
-	frame_ondisk = vmap(pages_disk, pages_per_frame, VM_MAP, PAGE_KERNEL);
-	if (!frame_ondisk) {
+	/* Frame is copied into pooled buffer and compressed there */
+	fb = ntfs_get_frame_buf(frame_size);
+	if (!fb) {
 		err = -ENOMEM;
-		goto out1;
+		goto out;
 	}
+	frame_mem = fb->unc;
+	frame_ondisk = fb->disk;
 
-	for (i = 0; i < pages_per_frame; i++)
-		kmap(pages[i]);
-
-	/* map in-memory frame for read-only */
-	frame_mem = vmap(pages, pages_per_frame, VM_MAP, PAGE_KERNEL_RO);
-	if (!frame_mem) {
-		err = -ENOMEM;
-		goto out2;
-	}
+	ntfs_pages_to_frame(frame_mem, pages, pages_per_frame);
 
 	mutex_lock(&sbi->compress.mtx_lznt);
-	lznt = NULL;
-	if (!sbi->compress.lznt) {
+	for (i = 0; i < ARRAY_SIZE(sbi->compress.lznt); i++) {
+		if (sbi->compress.lznt[i])
+			continue;
 		/*
 		 * lznt implements two levels of compression:
 		 * 0 - standard compression
 		 * 1 - best compression, requires a lot of cpu
 		 * use mount option?
 		 */
-		lznt = get_lznt_ctx(0);
-		if (!lznt) {
-			mutex_unlock(&sbi->compress.mtx_lznt);
-			err = -ENOMEM;
-			goto out3;
-		}
+		sbi->compress.lznt[i] = get_lznt_ctx(0);
+		if (!sbi->compress.lznt[i])
+			break;
+	}
 
-		sbi->compress.lznt = lznt;
-		lznt = NULL;
+	if (!i) {
+		mutex_unlock(&sbi->compress.mtx_lznt);
+		err = -ENOMEM;
+		goto out1;
 	}
 
-	/* compress: frame_mem -> frame_ondisk */
-	compr_size = compress_lznt(frame_mem, frame_size, frame_ondisk,
-				   frame_size, sbi->compress.lznt);
+	/* compress: frame_mem -> frame_ondisk, 'i' threads at most */
+	compr_size = compress_lznt_mt(frame_mem, frame_size, frame_ondisk,
+				      fb->disk_pages << PAGE_SHIFT,
+				      sbi->compress.lznt, i);
 	mutex_unlock(&sbi->compress.mtx_lznt);
-	ntfs_free(lznt);
 
 	if (compr_size + sbi->cluster_size > frame_size) {
 		/* frame is not compressed */
@@ -2786,36 +3379,20 @@ int ni_write_frame(struct ntfs_inode *ni, struct page **pages,
 	err = attr_allocate_frame(ni, frame, compr_size, ni->i_valid);
 	up_write(&ni->file.run_lock);
 	if (err)
-		goto out2;
+		goto out1;
 
 	if (!ondisk_size)
-		goto out2;
+		goto out1;
 
 	down_read(&ni->file.run_lock);
 	err = ntfs_bio_pages(sbi, &ni->file.run,
-			     ondisk_size < frame_size ? pages_disk : pages,
+			     ondisk_size < frame_size ? fb->pages : pages,
 			     pages_per_frame, frame_vbo, ondisk_size,
 			     REQ_OP_WRITE);
 	up_read(&ni->file.run_lock);
 
-out3:
-	vunmap(frame_mem);
-
-out2:
-	for (i = 0; i < pages_per_frame; i++)
-		kunmap(pages[i]);
-
-	vunmap(frame_ondisk);
 out1:
-	for (i = 0; i < pages_per_frame; i++) {
-		pg = pages_disk[i];
-		if (pg) {
-			kunmap(pg);
-			unlock_page(pg);
-			put_page(pg);
-		}
-	}
-	ntfs_free(pages_disk);
+	ntfs_put_frame_buf(fb);
 out:
 	return err;
 }
@@ -3021,7 +3598,7 @@ int ni_write_inode(struct inode *inode, int sync, const char *hint)
 		}
 
 		/* update attribute list */
-		if (ni->attr_list.size && ni->attr_list.dirty) {
+		if (ni->attr_list && ni->attr_list->dirty) {
 			if (inode->i_ino != MFT_REC_MFT || sync) {
 				err = ni_try_remove_attr_list(ni);
 				if (err)
@@ -3034,6 +3611,13 @@ int ni_write_inode(struct inode *inode, int sync, const char *hint)
 		}
 	}
 
+	if (ni->ni_flags & NI_FLAG_DIR) {
+		/* Write index buffer kept by indx_put_dirty */
+		err2 = indx_flush(&ni->dir, sync);
+		if (!err && err2)
+			err = err2;
+	}
+
 	for (node = rb_first(&ni->mi_tree); node; node = next) {
 		struct mft_inode *mi = rb_entry(node, struct mft_inode, node);
 		bool is_empty;
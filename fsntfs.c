@@ -88,6 +88,12 @@ const __le16 SQ_NAME[2] = {
 const __le16 SR_NAME[2] = {
 	cpu_to_le16('$'), cpu_to_le16('R'),
 };
+const __le16 J_NAME[2] = {
+	cpu_to_le16('$'), cpu_to_le16('J'),
+};
+const __le16 MAX_NAME[4] = {
+	cpu_to_le16('$'), cpu_to_le16('M'), cpu_to_le16('a'), cpu_to_le16('x'),
+};
 
 #ifdef CONFIG_NTFS3_LZX_XPRESS
 const __le16 WOF_NAME[17] = {
@@ -245,7 +251,8 @@ int ntfs_extend_init(struct ntfs_sb_info *sbi)
 	inode2 = dir_search_u(inode, &NAME_USNJRNL, NULL);
 	if (inode2 && !IS_ERR(inode2)) {
 		sbi->usn_jrnl_no = inode2->i_ino;
-		iput(inode2);
+		if (is_bad_inode(inode2) || ntfs_usn_init(sbi, inode2))
+			iput(inode2);
 	}
 
 	err = 0;
@@ -361,20 +368,20 @@ const struct ATTR_DEF_ENTRY *ntfs_query_def(struct ntfs_sb_info *sbi,
 }
 
 /*
- * ntfs_look_for_free_space
+ * ntfs_find_free_space
  *
  * looks for a free space in bitmap
+ * sbi->used.bitmap is locked for write
  */
-int ntfs_look_for_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
-			     CLST *new_lcn, CLST *new_len,
-			     enum ALLOCATE_OPT opt)
+static int ntfs_find_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
+				CLST *new_lcn, CLST *new_len,
+				enum ALLOCATE_OPT opt)
 {
 	int err;
 	struct super_block *sb = sbi->sb;
 	size_t a_lcn, zlen, zeroes, zlcn, zlen2, ztrim, new_zlen;
 	struct wnd_bitmap *wnd = &sbi->used.bitmap;
 
-	down_write_nested(&wnd->rw_lock, BITMAP_MUTEX_CLUSTERS);
 	if (opt & ALLOCATE_MFT) {
 		CLST alen;
 
@@ -419,7 +426,9 @@ int ntfs_look_for_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
 	if (lcn >= wnd->nbits)
 		lcn = 0;
 
-	*new_len = wnd_find(wnd, len, lcn, BITMAP_FIND_MARK_AS_USED, &a_lcn);
+	*new_len = wnd_find(wnd, len, lcn,
+			    BITMAP_FIND_MARK_AS_USED | sbi->used.find_flags,
+			    &a_lcn);
 	if (*new_len) {
 		*new_lcn = a_lcn;
 		goto ok;
@@ -460,8 +469,6 @@ int ntfs_look_for_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
 	}
 
 no_space:
-	up_write(&wnd->rw_lock);
-
 	return -ENOSPC;
 
 ok:
@@ -476,10 +483,98 @@ ok:
 	sbi->used.next_free_lcn = *new_lcn + *new_len;
 
 out:
+	return err;
+}
+
+/*
+ * ntfs_look_for_free_space
+ *
+ * looks for a free space in bitmap
+ */
+int ntfs_look_for_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
+			     CLST *new_lcn, CLST *new_len,
+			     enum ALLOCATE_OPT opt)
+{
+	int err;
+	struct wnd_bitmap *wnd = &sbi->used.bitmap;
+
+	down_write_nested(&wnd->rw_lock, BITMAP_MUTEX_CLUSTERS);
+	err = ntfs_find_free_space(sbi, lcn, len, new_lcn, new_len, opt);
 	up_write(&wnd->rw_lock);
+
 	return err;
 }
 
+/*
+ * ntfs_look_for_free_extents
+ *
+ * looks for a free space in bitmap as up to '*count' extents
+ * Bitmap is locked once for all extents
+ * Each extent is requested as 'rest of len' + 'pre' clusters
+ * Stops when extents cover 'len' clusters. 'vcn' of extents is not set
+ * Returns error only if no extent is allocated, '*count' is updated
+ */
+int ntfs_look_for_free_extents(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
+			       CLST pre, struct ntfs_run *ext, size_t *count,
+			       enum ALLOCATE_OPT opt)
+{
+	int err = 0;
+	struct wnd_bitmap *wnd = &sbi->used.bitmap;
+	size_t i;
+
+	down_write_nested(&wnd->rw_lock, BITMAP_MUTEX_CLUSTERS);
+	for (i = 0; i < *count; i++) {
+		err = ntfs_find_free_space(sbi, lcn, len + pre, &ext[i].lcn,
+					   &ext[i].len, opt);
+		if (err)
+			break;
+
+		if (ext[i].len >= len) {
+			i += 1;
+			break;
+		}
+
+		len -= ext[i].len;
+		lcn = ext[i].lcn + ext[i].len;
+	}
+	up_write(&wnd->rw_lock);
+
+	if (!i)
+		return err;
+
+	*count = i;
+	return 0;
+}
+
+/*
+ * ntfs_refresh_mft_map
+ *
+ * rebuilds translation array of $MFT::DATA
+ * sbi->mft.ni->file.run_lock is locked for write (or volume is mounting)
+ */
+void ntfs_refresh_mft_map(struct ntfs_sb_info *sbi)
+{
+	struct ntfs_inode *ni = sbi->mft.ni;
+	u8 shift = PAGE_SHIFT > sbi->cluster_bits ?
+			   PAGE_SHIFT - sbi->cluster_bits :
+			   0;
+	size_t len = 0;
+	u32 *map;
+
+	if (!ni)
+		return;
+
+	/* On error keep the old one. It is validated on each lookup */
+	map = run_build_map(&ni->file.run, shift, &len);
+	if (!map)
+		return;
+
+	ntfs_vfree(sbi->mft.run_map);
+	sbi->mft.run_map = map;
+	sbi->mft.run_map_len = len;
+	sbi->mft.run_map_shift = shift;
+}
+
 /*
  * ntfs_extend_mft
  *
@@ -506,20 +601,45 @@ static int ntfs_extend_mft(struct ntfs_sb_info *sbi)
 	u64 new_mft_bytes, new_bitmap_bytes;
 	struct ATTRIB *attr;
 	struct wnd_bitmap *wnd = &sbi->mft.bitmap;
+	u32 chunk = sbi->mft.extend_chunk;
 
-	new_mft_total = (wnd->nbits + MFT_INCREASE_CHUNK + 127) & (CLST)~127;
-	new_mft_bytes = (u64)new_mft_total << sbi->record_bits;
+	/*
+	 * Extend MFT ahead of demand: records are consumed fast
+	 * (small files) - double the chunk, slow - halve it
+	 */
+	if (!chunk)
+		chunk = MFT_INCREASE_CHUNK;
+	else if (time_before(jiffies,
+			     sbi->mft.extend_time + NTFS_MFT_FAST_EXTEND))
+		chunk = min_t(u32, chunk << 1, NTFS_MFT_CHUNK_MAX);
+	else if (chunk > MFT_INCREASE_CHUNK)
+		chunk >>= 1;
 
 	/* Step 1: Resize $MFT::DATA */
 	down_write(&ni->file.run_lock);
-	err = attr_set_size(ni, ATTR_DATA, NULL, 0, &ni->file.run,
-			    new_mft_bytes, NULL, false, &attr);
+	for (;;) {
+		new_mft_total = (wnd->nbits + chunk + 127) & (CLST)~127;
+		new_mft_bytes = (u64)new_mft_total << sbi->record_bits;
+
+		err = attr_set_size(ni, ATTR_DATA, NULL, 0, &ni->file.run,
+				    new_mft_bytes, NULL, false, &attr);
+		if (err != -ENOSPC || chunk == MFT_INCREASE_CHUNK)
+			break;
+
+		/* Volume is almost full. Try the smallest chunk */
+		chunk = MFT_INCREASE_CHUNK;
+	}
 
 	if (err) {
 		up_write(&ni->file.run_lock);
 		goto out;
 	}
 
+	sbi->mft.extend_chunk = chunk;
+	sbi->mft.extend_time = jiffies;
+	sbi->mft.extends += 1;
+	ntfs_refresh_mft_map(sbi);
+
 	attr->nres.valid_size = attr->nres.data_size;
 	new_mft_total = le64_to_cpu(attr->nres.alloc_size) >> sbi->record_bits;
 	ni->mi.dirty = true;
@@ -820,6 +940,7 @@ int ntfs_refresh_zone(struct ntfs_sb_info *sbi)
 {
 	CLST zone_limit, zone_max, lcn, vcn, len;
 	size_t lcn_s, zlen;
+	u64 used_recs, used_clst, per_rec, need;
 	struct wnd_bitmap *wnd = &sbi->used.bitmap;
 	struct ntfs_inode *ni = sbi->mft.ni;
 
@@ -837,6 +958,24 @@ int ntfs_refresh_zone(struct ntfs_sb_info *sbi)
 	if (zone_max > zone_limit)
 		zone_max = zone_limit;
 
+	/*
+	 * Volumes with small files need more records per cluster:
+	 * reserve room for records of the files which would fill
+	 * the free space if they had the average size of existing ones
+	 */
+	used_recs = sbi->mft.bitmap.nbits - wnd_zeroes(&sbi->mft.bitmap);
+	used_clst = wnd->nbits - wnd_zeroes(wnd);
+	if (used_recs > MFT_REC_FREE) {
+		per_rec = max_t(u64, 1, div64_u64(used_clst, used_recs));
+		need = bytes_to_cluster(sbi,
+					div64_u64(wnd_zeroes(wnd), per_rec)
+						<< sbi->record_bits);
+		/* but not more than quarter of free space */
+		need = min_t(u64, need, wnd_zeroes(wnd) >> 2);
+		if (need > zone_max)
+			zone_max = need;
+	}
+
 	vcn = bytes_to_cluster(sbi,
 			       (u64)sbi->mft.bitmap.nbits << sbi->record_bits);
 
@@ -862,6 +1001,38 @@ int ntfs_refresh_zone(struct ntfs_sb_info *sbi)
 	return 0;
 }
 
+/*
+ * ntfs_mft_stat
+ *
+ * fills MFT usage and fragmentation counters (NTFS3_IOC_MFT_STAT)
+ */
+int ntfs_mft_stat(struct ntfs_sb_info *sbi, struct ntfs_mft_stat *st)
+{
+	struct ntfs_inode *ni = sbi->mft.ni;
+	struct wnd_bitmap *wnd = &sbi->mft.bitmap;
+	struct wnd_bitmap *used = &sbi->used.bitmap;
+
+	memset(st, 0, sizeof(*st));
+
+	down_read_nested(&wnd->rw_lock, BITMAP_MUTEX_MFT);
+	st->records = wnd->nbits;
+	st->used = wnd->nbits - wnd_zeroes(wnd);
+	st->extends = sbi->mft.extends;
+	st->extend_chunk = sbi->mft.extend_chunk;
+	up_read(&wnd->rw_lock);
+
+	down_read(&ni->file.run_lock);
+	st->runs = ni->file.run.count;
+	up_read(&ni->file.run_lock);
+
+	down_read_nested(&used->rw_lock, BITMAP_MUTEX_CLUSTERS);
+	st->zone_lcn = wnd_zone_bit(used);
+	st->zone_len = wnd_zone_len(used);
+	up_read(&used->rw_lock);
+
+	return 0;
+}
+
 /*
  * ntfs_update_mftmirr
  *
@@ -1117,6 +1288,24 @@ int ntfs_sb_write(struct super_block *sb, u64 lbo, size_t bytes,
 	return 0;
 }
 
+/*
+ * ntfs_run_lookup
+ *
+ * run_lookup_entry with O(1) translation of $MFT::DATA
+ */
+static inline bool ntfs_run_lookup(struct ntfs_sb_info *sbi,
+				   const struct runs_tree *run, CLST vcn,
+				   CLST *lcn, CLST *len, size_t *index)
+{
+	if (sbi->mft.ni && run == &sbi->mft.ni->file.run)
+		return run_lookup_map(run, sbi->mft.run_map,
+				      sbi->mft.run_map_len,
+				      sbi->mft.run_map_shift, vcn, lcn, len,
+				      index);
+
+	return run_lookup_entry(run, vcn, lcn, len, index);
+}
+
 int ntfs_sb_write_run(struct ntfs_sb_info *sbi, const struct runs_tree *run,
 		      u64 vbo, const void *buf, size_t bytes)
 {
@@ -1127,7 +1316,7 @@ int ntfs_sb_write_run(struct ntfs_sb_info *sbi, const struct runs_tree *run,
 	u64 lbo, len;
 	size_t idx;
 
-	if (!run_lookup_entry(run, vcn, &lcn, &clen, &idx))
+	if (!ntfs_run_lookup(sbi, run, vcn, &lcn, &clen, &idx))
 		return -ENOENT;
 
 	if (lcn == SPARSE_LCN)
@@ -1206,7 +1395,7 @@ int ntfs_read_run_nb(struct ntfs_sb_info *sbi, const struct runs_tree *run,
 		/* use absolute boot's 'MFTCluster' to read record */
 		lbo = vbo + sbi->mft.lbo;
 		len = sbi->record_size;
-	} else if (!run_lookup_entry(run, vcn, &lcn, &clen, &idx)) {
+	} else if (!ntfs_run_lookup(sbi, run, vcn, &lcn, &clen, &idx)) {
 		err = -ENOENT;
 		goto out;
 	} else {
@@ -1303,7 +1492,7 @@ int ntfs_read_bh(struct ntfs_sb_info *sbi, const struct runs_tree *run, u64 vbo,
 
 	if (err)
 		return err;
-	return ntfs_fix_post_read(rhdr, nb->bytes, true);
+	return ntfs_fix_post_read(rhdr, bytes, true);
 }
 
 int ntfs_get_bh(struct ntfs_sb_info *sbi, const struct runs_tree *run, u64 vbo,
@@ -1322,7 +1511,7 @@ int ntfs_get_bh(struct ntfs_sb_info *sbi, const struct runs_tree *run, u64 vbo,
 
 	nb->bytes = bytes;
 
-	if (!run_lookup_entry(run, vcn, &lcn, &clen, &idx)) {
+	if (!ntfs_run_lookup(sbi, run, vcn, &lcn, &clen, &idx)) {
 		err = -ENOENT;
 		goto out;
 	}
@@ -1491,10 +1680,16 @@ static inline struct bio *ntfs_alloc_bio(u32 nr_vecs)
 	return bio;
 }
 
-/* read/write pages from/to disk*/
-int ntfs_bio_pages(struct ntfs_sb_info *sbi, const struct runs_tree *run,
-		   struct page **pages, u32 nr_pages, u64 vbo, u32 bytes,
-		   u32 op)
+/*
+ * ntfs_bio_pages_start
+ *
+ * submits all bios to read/write pages from/to disk except the last one
+ * The last bio (parent of all chained bios) is returned in 'last'
+ * Caller should submit (or put on error) it
+ */
+int ntfs_bio_pages_start(struct ntfs_sb_info *sbi, const struct runs_tree *run,
+			 struct page **pages, u32 nr_pages, u64 vbo, u32 bytes,
+			 u32 op, struct bio **last)
 {
 	int err = 0;
 	struct bio *new, *bio = NULL;
@@ -1506,13 +1701,11 @@ int ntfs_bio_pages(struct ntfs_sb_info *sbi, const struct runs_tree *run,
 	u32 add, off, page_idx;
 	u64 lbo, len;
 	size_t run_idx;
-	struct blk_plug plug;
 
+	*last = NULL;
 	if (!bytes)
 		return 0;
 
-	blk_start_plug(&plug);
-
 	/* align vbo and bytes to be 512 bytes aligned */
 	lbo = (vbo + bytes + 511) & ~511ull;
 	vbo = vbo & ~511ull;
@@ -1585,11 +1778,29 @@ new_bio:
 		off = 0;
 	}
 out:
+	*last = bio;
+	return err;
+}
+
+/* read/write pages from/to disk*/
+int ntfs_bio_pages(struct ntfs_sb_info *sbi, const struct runs_tree *run,
+		   struct page **pages, u32 nr_pages, u64 vbo, u32 bytes,
+		   u32 op)
+{
+	int err;
+	struct bio *bio;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+
+	err = ntfs_bio_pages_start(sbi, run, pages, nr_pages, vbo, bytes, op,
+				   &bio);
 	if (bio) {
 		if (!err)
 			err = submit_bio_wait(bio);
 		bio_put(bio);
 	}
+
 	blk_finish_plug(&plug);
 
 	return err;
@@ -2453,7 +2664,10 @@ int ntfs_remove_reparse(struct ntfs_sb_info *sbi, __le32 rtag,
 
 	if (rtag) {
 		err = indx_delete_entry(indx, ni, &rkey, sizeof(rkey), NULL);
-		goto out1;
+		if (err != -ENOENT)
+			goto out1;
+		/* Tag of attribute differs from index (volume corrupt?) */
+		rkey.ReparseTag = 0;
 	}
 
 	fnd = fnd_get();
@@ -2498,6 +2712,264 @@ out1:
 	return err;
 }
 
+/* Bytes of $MFT to read ahead per step of ntfs_mft_bulkstat */
+#define NTFS_BULKSTAT_CHUNK	(256u * 1024)
+/* Kernel buffer to collect entries before copying to user */
+#define NTFS_BULKSTAT_BUF	(64u * 1024)
+
+/*
+ * ntfs_mft_readahead
+ *
+ * starts reading of range [vbo, vbo + bytes) of $MFT into buffer cache
+ * sbi->mft.ni->file.run_lock is locked for read
+ */
+static void ntfs_mft_readahead(struct ntfs_sb_info *sbi, u64 vbo, u64 bytes)
+{
+	struct super_block *sb = sbi->sb;
+	const struct runs_tree *run = &sbi->mft.ni->file.run;
+	u8 cluster_bits = sbi->cluster_bits;
+	u64 end = vbo + bytes;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	while (vbo < end) {
+		CLST lcn, clen;
+		u32 off = vbo & sbi->cluster_mask;
+		u64 lbo, len;
+		sector_t block, block_end;
+
+		if (!ntfs_run_lookup(sbi, run, vbo >> cluster_bits, &lcn,
+				     &clen, NULL) ||
+		    lcn == SPARSE_LCN)
+			break;
+
+		lbo = ((u64)lcn << cluster_bits) + off;
+		len = ((u64)clen << cluster_bits) - off;
+		if (len > end - vbo)
+			len = end - vbo;
+
+		block = lbo >> sb->s_blocksize_bits;
+		block_end = bytes_to_block(sb, lbo + len);
+		for (; block < block_end; block++)
+			sb_breadahead(sb, block);
+
+		vbo += len;
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * ntfs_bulkstat_rec
+ *
+ * helper function 'ntfs_mft_bulkstat'
+ * fills 'bs' from base record without loading inode
+ * returns the size of entry, 0 if record should be skipped
+ * or -EOVERFLOW if entry does not fit into 'bytes'
+ */
+static int ntfs_bulkstat_rec(struct ntfs_sb_info *sbi, struct mft_inode *mi,
+			     struct ntfs_bulkstat *bs, u32 bytes, u8 *name)
+{
+	struct MFT_REC *rec = mi->mrec;
+	struct ATTRIB *attr;
+	const struct ATTR_STD_INFO *std;
+	const struct ATTR_FILE_NAME *fn, *fname = NULL;
+	int name_len = 0;
+	u32 reclen;
+
+	if (rec->rhdr.sign != NTFS_FILE_SIGNATURE || !is_rec_inuse(rec) ||
+	    !is_rec_base(rec))
+		return 0;
+
+	attr = mi_find_attr(mi, NULL, ATTR_STD, NULL, 0, NULL);
+	if (!attr)
+		return 0;
+
+	std = resident_data_ex(attr, sizeof(struct ATTR_STD_INFO));
+	if (!std)
+		return 0;
+
+	/* Use short name only if there is no other name in base record */
+	attr = NULL;
+	while ((attr = mi_find_attr(mi, attr, ATTR_NAME, NULL, 0, NULL))) {
+		fn = resident_data_ex(attr, SIZEOF_ATTRIBUTE_FILENAME);
+		if (!fn ||
+		    le32_to_cpu(attr->res.data_size) < fname_full_size(fn))
+			continue;
+
+		fname = fn;
+		if (fn->type != FILE_NAME_DOS)
+			break;
+	}
+
+	if (fname) {
+		name_len = ntfs_utf16_to_nls(
+			sbi, (struct le_str *)&fname->name_len, name, PATH_MAX);
+		if (name_len < 0)
+			name_len = 0;
+	}
+
+	reclen = QuadAlign(offsetof(struct ntfs_bulkstat, name) + name_len + 1);
+	if (reclen > bytes)
+		return -EOVERFLOW;
+
+	memset(bs, 0, reclen);
+
+	bs->ino = mi->rno;
+	if (fname) {
+		bs->parent = le32_to_cpu(fname->home.low) |
+			     ((u64)le16_to_cpu(fname->home.high) << 32) |
+			     ((u64)le16_to_cpu(fname->home.seq) << 48);
+	}
+
+	attr = mi_find_attr(mi, NULL, ATTR_DATA, NULL, 0, NULL);
+	if (attr && !attr_svcn(attr)) {
+		bs->size = attr_size(attr);
+		bs->alloc_size = attr_ondisk_size(attr);
+	} else if (fname) {
+		/* $DATA is in subrecord. Use duplicated info from name */
+		bs->size = le64_to_cpu(fname->dup.data_size);
+		bs->alloc_size = le64_to_cpu(fname->dup.alloc_size);
+	}
+
+	bs->cr_time = le64_to_cpu(std->cr_time);
+	bs->m_time = le64_to_cpu(std->m_time);
+	bs->c_time = le64_to_cpu(std->c_time);
+	bs->a_time = le64_to_cpu(std->a_time);
+
+	bs->fa = le32_to_cpu(std->fa);
+	if (rec->flags & RECORD_FLAG_DIR)
+		bs->fa |= le32_to_cpu(FILE_ATTRIBUTE_DIRECTORY);
+
+	bs->seq = le16_to_cpu(rec->seq);
+	bs->links = le16_to_cpu(rec->hard_links);
+	bs->reclen = reclen;
+	bs->name_len = name_len;
+	memcpy(bs->name, name, name_len);
+
+	return reclen;
+}
+
+/*
+ * ntfs_mft_bulkstat
+ *
+ * enumerates base records of $MFT in rno order starting from req->start
+ * and copies 'struct ntfs_bulkstat' entries into user buffer
+ * $MFT is read sequentially with readahead and records are parsed in place
+ * without creating inodes
+ */
+int ntfs_mft_bulkstat(struct ntfs_sb_info *sbi, struct ntfs_bulkstat_req *req)
+{
+	int err = 0;
+	struct ntfs_inode *ni = sbi->mft.ni;
+	u8 __user *ubuf = u64_to_user_ptr(req->buf);
+	u32 ulen = req->buf_len;
+	u32 uoff = 0, count = 0;
+	u32 rs = sbi->record_size;
+	u8 record_bits = sbi->record_bits;
+	u64 rno = req->start;
+	u8 *kbuf, *name = NULL;
+	struct mft_inode *mi = NULL;
+	bool full = false;
+
+	kbuf = ntfs_malloc(NTFS_BULKSTAT_BUF);
+	if (!kbuf)
+		return -ENOMEM;
+
+	name = __getname();
+	if (!name) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	mi = ntfs_zalloc(sizeof(struct mft_inode));
+	if (!mi) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = mi_init(mi, sbi, 0);
+	if (err)
+		goto out;
+
+	while (!full && rno < sbi->mft.used) {
+		u64 end = rno + (NTFS_BULKSTAT_CHUNK >> record_bits);
+		u32 kcap = min_t(u32, NTFS_BULKSTAT_BUF, ulen - uoff);
+		u32 koff = 0;
+
+		if (end > sbi->mft.used)
+			end = sbi->mft.used;
+
+		down_read(&ni->file.run_lock);
+		ntfs_mft_readahead(sbi, rno << record_bits,
+				   (end - rno) << record_bits);
+
+		for (; rno < end; rno++) {
+			int ret;
+
+			err = ntfs_read_run_nb(sbi, &ni->file.run,
+					       rno << record_bits, mi->mrec, rs,
+					       NULL);
+			if (err)
+				break;
+
+			ret = ntfs_fix_post_read(&mi->mrec->rhdr, rs, true);
+			if (ret && ret != -E_NTFS_FIXUP)
+				continue;
+
+			if (!sbi->options.showmeta &&
+			    ntfs_is_meta_file(sbi, rno))
+				continue;
+
+			mi->rno = rno;
+			ret = ntfs_bulkstat_rec(sbi, mi, Add2Ptr(kbuf, koff),
+						kcap - koff, name);
+			if (ret < 0) {
+				/* Either user buffer or kbuf is full */
+				if (kcap < NTFS_BULKSTAT_BUF)
+					full = true;
+				break;
+			}
+
+			koff += ret;
+			if (ret)
+				count += 1;
+		}
+		up_read(&ni->file.run_lock);
+
+		if (err)
+			break;
+
+		if (koff && copy_to_user(ubuf + uoff, kbuf, koff)) {
+			err = -EFAULT;
+			break;
+		}
+		uoff += koff;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	if (!err && full && !count) {
+		/* user buffer is too small even for one entry */
+		err = -EOVERFLOW;
+	}
+
+	req->start = rno;
+	req->count = count;
+
+out:
+	if (mi)
+		mi_put(mi);
+	if (name)
+		__putname(name);
+	ntfs_free(kbuf);
+
+	return err;
+}
+
 static inline void ntfs_unmap_and_discard(struct ntfs_sb_info *sbi, CLST lcn,
 					  CLST len)
 {
@@ -2565,3 +3037,698 @@ int run_deallocate(struct ntfs_sb_info *sbi, struct runs_tree *run, bool trim)
 
 	return 0;
 }
+
+/* Size of one buffer (chunk) for USN records not written to $J yet */
+#define NTFS_USN_BUF		(64u * 1024)
+/*
+ * Max chunks in memory. Records are lost if writer can't keep up
+ * and then journal gets new id (see ntfs_usn_set_max)
+ */
+#define NTFS_USN_CHUNKS		16
+/* Buffered USN records are written to $J not later than this */
+#define NTFS_USN_FLUSH_DELAY	(5 * HZ)
+
+struct ntfs_usn_chunk {
+	struct list_head list;
+	u64 usn; // usn of the first record in 'data'
+	u32 used; // bytes used in 'data'
+	u32 reserved;
+	u8 data[];
+};
+
+#define NTFS_USN_CHUNK_DATA	(NTFS_USN_BUF - sizeof(struct ntfs_usn_chunk))
+
+/*
+ * ntfs_usn_write_chunk
+ *
+ * appends records of one chunk to $UsnJrnl:$J
+ */
+static int ntfs_usn_write_chunk(struct ntfs_sb_info *sbi,
+				struct ntfs_usn_chunk *c)
+{
+	int err;
+	struct ntfs_inode *ni = sbi->usn.ni;
+	struct runs_tree *run = &ni->file.run;
+	u8 cluster_bits = sbi->cluster_bits;
+	u64 vbo = c->usn;
+	u64 new_size = vbo + c->used;
+	u64 from, to;
+	CLST vcn, end, lcn, len;
+	bool new;
+
+	mutex_lock_nested(&ni->ni_lock, NTFS_INODE_MUTEX_USNJRNL);
+	down_write(&ni->file.run_lock);
+
+	/* Size of $J is already 'new_size' if previous try failed below */
+	err = attr_set_size(ni, ATTR_DATA, J_NAME, ARRAY_SIZE(J_NAME), run,
+			    new_size, &new_size, false, NULL);
+	if (err)
+		goto out;
+
+	/*
+	 * $J is sparse, so new tail is a hole.
+	 * Allocate clusters for it and write records piece by piece
+	 * 'cause attr_data_get_block_locked truncates runs before 'vcn'
+	 */
+	vcn = vbo >> cluster_bits;
+	end = bytes_to_cluster(sbi, new_size);
+
+	for (; vcn < end; vcn += len) {
+		err = attr_data_get_block_locked(ni, J_NAME, ARRAY_SIZE(J_NAME),
+						 run, vcn, end - vcn, &lcn, &len,
+						 &new);
+		if (err)
+			goto out;
+
+		if (!len || lcn == SPARSE_LCN) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		from = max_t(u64, vbo, (u64)vcn << cluster_bits);
+		to = min_t(u64, new_size, (u64)(vcn + len) << cluster_bits);
+
+		err = ntfs_sb_write_run(sbi, run, from,
+					Add2Ptr(c->data, from - vbo),
+					to - from);
+		if (err)
+			goto out;
+	}
+
+	sbi->usn.disk_usn = new_size;
+	mark_inode_dirty(&ni->vfs_inode);
+
+out:
+	up_write(&ni->file.run_lock);
+	mutex_unlock(&ni->ni_lock);
+
+	return err;
+}
+
+/*
+ * ntfs_usn_set_max
+ *
+ * updates UsnJournalID and LowestValidUsn in $UsnJrnl:$Max
+ */
+static int ntfs_usn_set_max(struct ntfs_sb_info *sbi, u64 id, u64 lowest)
+{
+	struct ntfs_inode *ni = sbi->usn.ni;
+	struct ATTRIB *attr;
+	struct mft_inode *mi;
+	struct USN_JOURNAL_DATA *max;
+	int err = 0;
+
+	mutex_lock_nested(&ni->ni_lock, NTFS_INODE_MUTEX_USNJRNL);
+
+	attr = ni_find_attr(ni, NULL, NULL, ATTR_DATA, MAX_NAME,
+			    ARRAY_SIZE(MAX_NAME), NULL, &mi);
+	max = attr ? resident_data_ex(attr, sizeof(struct USN_JOURNAL_DATA))
+		   : NULL;
+	if (!max) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	max->UsnJournalID = cpu_to_le64(id);
+	max->LowestValidUsn = cpu_to_le64(lowest);
+	mi->dirty = true;
+	mark_inode_dirty(&ni->vfs_inode);
+
+	sbi->usn.journal_id = id;
+	sbi->usn.lowest = lowest;
+
+out:
+	mutex_unlock(&ni->ni_lock);
+	return err;
+}
+
+/*
+ * ntfs_usn_reset
+ *
+ * records were lost: starts new instance of journal like Windows does
+ * Consumers see new UsnJournalID and know that they should rescan volume.
+ * Records before the loss don't belong to new instance
+ */
+static int ntfs_usn_reset(struct ntfs_sb_info *sbi)
+{
+	int err;
+	u64 id, lowest;
+	bool reset;
+	struct timespec64 ts;
+
+	mutex_lock(&sbi->usn.mtx);
+	reset = sbi->usn.reset;
+	lowest = sbi->usn.reset_usn;
+	sbi->usn.reset = false;
+	mutex_unlock(&sbi->usn.mtx);
+
+	if (!reset)
+		return 0;
+
+	/* Windows uses the time of creation as id */
+	ts = current_time(&sbi->usn.ni->vfs_inode);
+	id = le64_to_cpu(kernel2nt(&ts));
+	if (id <= sbi->usn.journal_id)
+		id = sbi->usn.journal_id + 1;
+
+	err = ntfs_usn_set_max(sbi, id, max(lowest, sbi->usn.lowest));
+	if (err) {
+		/* Try again next time */
+		mutex_lock(&sbi->usn.mtx);
+		if (!sbi->usn.reset) {
+			sbi->usn.reset = true;
+			sbi->usn.reset_usn = lowest;
+		}
+		mutex_unlock(&sbi->usn.mtx);
+		return err;
+	}
+
+	ntfs_err(sbi->sb, "$UsnJrnl: records were lost, new journal id %llx.",
+		 id);
+	return 0;
+}
+
+/*
+ * ntfs_usn_purge
+ *
+ * keeps allocated part of $J not bigger than MaximumSize + AllocationDelta
+ * Like Windows, deallocates head of $J by AllocationDelta steps
+ * and moves LowestValidUsn
+ */
+static int ntfs_usn_purge(struct ntfs_sb_info *sbi)
+{
+	int err;
+	struct ntfs_inode *ni = sbi->usn.ni;
+	u64 disk_usn = sbi->usn.disk_usn;
+	u64 lowest = sbi->usn.lowest;
+	u64 from, to;
+
+	if (!sbi->usn.max_size || lowest >= disk_usn ||
+	    disk_usn - lowest <= sbi->usn.max_size + sbi->usn.delta)
+		return 0;
+
+	/* 'delta' is aligned to cluster and to USN page */
+	to = disk_usn - sbi->usn.max_size;
+	to -= to % sbi->usn.delta;
+	from = lowest & ~(u64)sbi->cluster_mask;
+	if (to <= lowest)
+		return 0;
+
+	mutex_lock_nested(&ni->ni_lock, NTFS_INODE_MUTEX_USNJRNL);
+	err = attr_punch_hole(ni, J_NAME, ARRAY_SIZE(J_NAME), from, to - from);
+	mutex_unlock(&ni->ni_lock);
+	if (err)
+		return err;
+
+	return ntfs_usn_set_max(sbi, sbi->usn.journal_id, to);
+}
+
+/*
+ * ntfs_usn_write
+ *
+ * writes all buffered chunks to $J in order
+ * sbi->usn.wmtx should be held
+ * Chunks failed to write are kept and written first next time
+ */
+static int ntfs_usn_write(struct ntfs_sb_info *sbi)
+{
+	int err = 0;
+	struct ntfs_usn_chunk *c, *tmp;
+	struct list_head *pending = &sbi->usn.pending;
+
+	/* Take all records logged so far */
+	mutex_lock(&sbi->usn.mtx);
+	list_splice_tail_init(&sbi->usn.full, pending);
+	c = sbi->usn.cur;
+	if (c && c->used) {
+		list_add_tail(&c->list, pending);
+		sbi->usn.cur = NULL;
+	}
+	mutex_unlock(&sbi->usn.mtx);
+
+	/* New journal id is written before records after the loss */
+	err = ntfs_usn_reset(sbi);
+	if (err)
+		goto out;
+
+	list_for_each_entry_safe(c, tmp, pending, list) {
+		err = ntfs_usn_write_chunk(sbi, c);
+		if (err)
+			break;
+
+		list_del(&c->list);
+
+		/* Reuse written chunk as current one if there is no one */
+		mutex_lock(&sbi->usn.mtx);
+		if (!sbi->usn.cur) {
+			c->used = 0;
+			sbi->usn.cur = c;
+			c = NULL;
+		} else {
+			sbi->usn.chunks -= 1;
+		}
+		mutex_unlock(&sbi->usn.mtx);
+
+		ntfs_free(c);
+	}
+
+	if (!err)
+		err = ntfs_usn_purge(sbi);
+
+out:
+	if (err) {
+		ntfs_err(sbi->sb, "Failed to write $UsnJrnl (%d).", err);
+		/* Try again later */
+		schedule_delayed_work(&sbi->usn.work, NTFS_USN_FLUSH_DELAY);
+	}
+
+	return err;
+}
+
+static void ntfs_usn_work(struct work_struct *work)
+{
+	struct ntfs_sb_info *sbi =
+		container_of(to_delayed_work(work), struct ntfs_sb_info,
+			     usn.work);
+
+	mutex_lock(&sbi->usn.wmtx);
+	ntfs_usn_write(sbi);
+	mutex_unlock(&sbi->usn.wmtx);
+}
+
+/*
+ * ntfs_usn_init
+ *
+ * prepares $Extend\$UsnJrnl for appending records
+ * on success 'inode' is owned by sbi
+ */
+int ntfs_usn_init(struct ntfs_sb_info *sbi, struct inode *inode)
+{
+	struct ntfs_inode *ni = ntfs_i(inode);
+	struct ATTRIB *attr_j, *attr;
+	struct USN_JOURNAL_DATA *max;
+	struct ntfs_usn_chunk *c;
+
+	/* $J is always sparse and non resident */
+	attr_j = ni_find_attr(ni, NULL, NULL, ATTR_DATA, J_NAME,
+			      ARRAY_SIZE(J_NAME), NULL, NULL);
+	if (!attr_j || !attr_j->non_res || !is_attr_sparsed(attr_j) ||
+	    attr_j->nres.svcn)
+		return -EINVAL;
+
+	attr = ni_find_attr(ni, NULL, NULL, ATTR_DATA, MAX_NAME,
+			    ARRAY_SIZE(MAX_NAME), NULL, NULL);
+	max = attr ? resident_data_ex(attr, sizeof(struct USN_JOURNAL_DATA))
+		   : NULL;
+	if (!max)
+		return -EINVAL;
+
+	c = ntfs_malloc(NTFS_USN_BUF);
+	if (!c)
+		return -ENOMEM;
+
+	c->used = 0;
+
+	/* $UsnJrnl has no unnamed stream, so 'file.run' is free for $J */
+	init_rwsem(&ni->file.run_lock);
+	mutex_init(&sbi->usn.mtx);
+	mutex_init(&sbi->usn.wmtx);
+	INIT_DELAYED_WORK(&sbi->usn.work, ntfs_usn_work);
+	INIT_LIST_HEAD(&sbi->usn.full);
+	INIT_LIST_HEAD(&sbi->usn.pending);
+
+	sbi->usn.journal_id = le64_to_cpu(max->UsnJournalID);
+	sbi->usn.max_size = le64_to_cpu(max->MaximumSize);
+	sbi->usn.delta = ALIGN(le64_to_cpu(max->AllocationDelta),
+			       max_t(u32, sbi->cluster_size, USN_PAGE_SIZE));
+	if (!sbi->usn.delta)
+		sbi->usn.delta = max_t(u32, sbi->cluster_size, USN_PAGE_SIZE);
+	sbi->usn.lowest = le64_to_cpu(max->LowestValidUsn);
+	sbi->usn.next_usn = le64_to_cpu(attr_j->nres.data_size);
+	sbi->usn.disk_usn = sbi->usn.next_usn;
+	sbi->usn.cur = c;
+	sbi->usn.chunks = 1;
+	sbi->usn.lost = 0;
+	sbi->usn.reset = false;
+	sbi->usn.ni = ni;
+
+	return 0;
+}
+
+/*
+ * ntfs_usn_flush
+ *
+ * writes all buffered records to $J
+ */
+int ntfs_usn_flush(struct ntfs_sb_info *sbi)
+{
+	int err;
+
+	if (!sbi->usn.ni)
+		return 0;
+
+	mutex_lock(&sbi->usn.wmtx);
+	err = ntfs_usn_write(sbi);
+	mutex_unlock(&sbi->usn.wmtx);
+
+	return err;
+}
+
+/*
+ * ntfs_usn_close
+ *
+ * called at umount
+ */
+void ntfs_usn_close(struct ntfs_sb_info *sbi)
+{
+	struct ntfs_usn_chunk *c, *tmp;
+	u32 unwritten = 0;
+
+	if (!sbi->usn.ni)
+		return;
+
+	ntfs_usn_flush(sbi);
+	/* Failed flush schedules the work again. Cancel it too */
+	cancel_delayed_work_sync(&sbi->usn.work);
+
+	list_splice_tail_init(&sbi->usn.full, &sbi->usn.pending);
+	list_for_each_entry_safe(c, tmp, &sbi->usn.pending, list) {
+		unwritten += 1;
+		ntfs_free(c);
+	}
+	ntfs_free(sbi->usn.cur);
+	sbi->usn.cur = NULL;
+
+	if (sbi->usn.lost)
+		ntfs_err(sbi->sb, "$UsnJrnl: %llu records were not logged.",
+			 sbi->usn.lost);
+	if (unwritten)
+		ntfs_err(sbi->sb, "$UsnJrnl: %u buffers of records are lost.",
+			 unwritten);
+
+	iput(&sbi->usn.ni->vfs_inode);
+	sbi->usn.ni = NULL;
+}
+
+/*
+ * ntfs_usn_log
+ *
+ * buffers one USN_RECORD_V2 for 'ni' named 'fname'
+ * Never writes $J itself: callers hold ni_lock of files and directories
+ */
+void ntfs_usn_log(struct ntfs_inode *ni, const struct ATTR_FILE_NAME *fname,
+		  u32 reason)
+{
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	struct ntfs_usn_chunk *c;
+	struct USN_RECORD_V2 *r;
+	struct timespec64 ts;
+	u32 name_bytes = fname->name_len * sizeof(short);
+	u32 size = QuadAlign(offsetof(struct USN_RECORD_V2, FileName) +
+			     name_bytes);
+	u32 off, tail;
+
+	if (!sbi->usn.ni || ntfs_is_meta_file(sbi, ni->mi.rno))
+		return;
+
+	mutex_lock(&sbi->usn.mtx);
+
+	/* The biggest record with padding always fits into one page */
+	c = sbi->usn.cur;
+	if (c && c->used + USN_PAGE_SIZE > NTFS_USN_CHUNK_DATA) {
+		/* Chunk is full. Hand it over to writer right now */
+		list_add_tail(&c->list, &sbi->usn.full);
+		sbi->usn.cur = c = NULL;
+		mod_delayed_work(system_wq, &sbi->usn.work, 0);
+	}
+
+	if (!c) {
+		c = sbi->usn.chunks < NTFS_USN_CHUNKS ? ntfs_malloc(NTFS_USN_BUF)
+						      : NULL;
+		if (!c) {
+			/*
+			 * usn is not consumed, so there is no gap in $J
+			 * but consumers must know about the loss:
+			 * writer starts new instance of journal
+			 */
+			sbi->usn.lost += 1;
+			sbi->usn.reset = true;
+			sbi->usn.reset_usn = sbi->usn.next_usn;
+			goto out;
+		}
+
+		c->used = 0;
+		sbi->usn.cur = c;
+		sbi->usn.chunks += 1;
+	}
+
+	if (!c->used)
+		c->usn = sbi->usn.next_usn;
+
+	off = c->used;
+
+	/* Records never cross page boundary. Pad the rest of page by zeros */
+	tail = USN_PAGE_SIZE - ((c->usn + off) & (USN_PAGE_SIZE - 1));
+	if (tail < size) {
+		memset(Add2Ptr(c->data, off), 0, tail);
+		off += tail;
+	}
+
+	r = Add2Ptr(c->data, off);
+	memset(r, 0, size);
+
+	ts = current_time(&ni->vfs_inode);
+
+	r->RecordLength = cpu_to_le32(size);
+	r->MajorVersion = cpu_to_le16(2);
+	mi_get_ref(&ni->mi, &r->FileReferenceNumber);
+	r->ParentFileReferenceNumber = fname->home;
+	r->Usn = cpu_to_le64(c->usn + off);
+	r->TimeStamp = kernel2nt(&ts);
+	r->Reason = cpu_to_le32(reason);
+	r->SecurityId = ni->std_security_id;
+	r->FileAttributes = ni->std_fa;
+	r->FileNameLength = cpu_to_le16(name_bytes);
+	r->FileNameOffset =
+		cpu_to_le16(offsetof(struct USN_RECORD_V2, FileName));
+	memcpy(r->FileName, fname->name, name_bytes);
+
+	c->used = off + size;
+	sbi->usn.next_usn = c->usn + c->used;
+
+	/* Does nothing if the work is already pending */
+	schedule_delayed_work(&sbi->usn.work, NTFS_USN_FLUSH_DELAY);
+
+out:
+	mutex_unlock(&sbi->usn.mtx);
+}
+
+/*
+ * ntfs_usn_fname
+ *
+ * returns the name to report in USN record (long name if possible)
+ */
+static struct ATTR_FILE_NAME *ntfs_usn_fname(struct ntfs_inode *ni)
+{
+	struct ATTRIB *attr = NULL;
+	struct ATTR_LIST_ENTRY *le = NULL;
+	struct ATTR_FILE_NAME *fname, *dos = NULL;
+
+	while ((attr = ni_find_attr(ni, attr, &le, ATTR_NAME, NULL, 0, NULL,
+				    NULL))) {
+		fname = resident_data_ex(attr, SIZEOF_ATTRIBUTE_FILENAME);
+		if (!fname)
+			continue;
+
+		if (fname->type != FILE_NAME_DOS)
+			return fname;
+
+		dos = fname;
+	}
+
+	return dos;
+}
+
+/*
+ * ntfs_usn_change
+ *
+ * logs data/attributes change of 'ni'
+ * Like Windows does, each reason is logged once until the file is closed
+ * ni_lock should not be held
+ */
+void ntfs_usn_change(struct ntfs_inode *ni, u32 reason)
+{
+	struct ATTR_FILE_NAME *fname;
+
+	if (!ni->mi.sbi->usn.ni || (ni->usn_reasons & reason) == reason)
+		return;
+
+	ni_lock(ni);
+	ni->usn_reasons |= reason;
+	fname = ntfs_usn_fname(ni);
+	if (fname)
+		ntfs_usn_log(ni, fname, ni->usn_reasons);
+	ni_unlock(ni);
+}
+
+/*
+ * ntfs_usn_close_file
+ *
+ * logs USN_REASON_CLOSE with all reasons accumulated by ntfs_usn_change
+ * ni_lock should not be held
+ */
+void ntfs_usn_close_file(struct ntfs_inode *ni)
+{
+	struct ATTR_FILE_NAME *fname;
+
+	if (!ni->usn_reasons)
+		return;
+
+	ni_lock(ni);
+	fname = ntfs_usn_fname(ni);
+	if (fname)
+		ntfs_usn_log(ni, fname, ni->usn_reasons | USN_REASON_CLOSE);
+	ni->usn_reasons = 0;
+	ni_unlock(ni);
+}
+
+/*
+ * ntfs_usn_read
+ *
+ * copies whole records from $J starting at req->start_usn into user buffer
+ */
+int ntfs_usn_read(struct ntfs_sb_info *sbi, struct ntfs_read_usn_req *req)
+{
+	int err;
+	struct ntfs_inode *ni = sbi->usn.ni;
+	struct runs_tree *run;
+	u8 __user *ubuf = u64_to_user_ptr(req->buf);
+	u32 ulen = min_t(u32, req->buf_len, NTFS_USN_BUF);
+	u8 cluster_bits = sbi->cluster_bits;
+	u64 usn = req->start_usn, end, pos, rest, id;
+	u32 got = 0, off = 0, bytes = 0, op, rlen;
+	CLST vcn, lcn, clen;
+	struct USN_RECORD_V2 *r;
+	void *kbuf;
+
+	if (!ni)
+		return -EOPNOTSUPP;
+
+	if (usn & 7)
+		return -EINVAL;
+
+	run = &ni->file.run;
+
+	kbuf = ntfs_malloc(NTFS_USN_BUF);
+	if (!kbuf)
+		return -ENOMEM;
+
+	mutex_lock(&sbi->usn.wmtx);
+
+	/* Make buffered records visible */
+	err = ntfs_usn_write(sbi);
+	if (err)
+		goto out;
+
+	end = sbi->usn.disk_usn;
+	id = sbi->usn.journal_id;
+
+	/* Records before LowestValidUsn are purged or of old instance */
+	if (usn < sbi->usn.lowest)
+		usn = sbi->usn.lowest;
+
+	mutex_lock_nested(&ni->ni_lock, NTFS_INODE_MUTEX_USNJRNL);
+	down_write(&ni->file.run_lock);
+
+	while (got < ulen && usn + got < end) {
+		pos = usn + got;
+		vcn = pos >> cluster_bits;
+
+		err = attr_load_runs_range(ni, ATTR_DATA, J_NAME,
+					   ARRAY_SIZE(J_NAME), run, pos,
+					   pos + 1);
+		if (err)
+			break;
+
+		if (!run_lookup_entry(run, vcn, &lcn, &clen, NULL)) {
+			err = -EINVAL;
+			break;
+		}
+
+		rest = ((u64)(vcn + clen) << cluster_bits) - pos;
+
+		if (lcn == SPARSE_LCN) {
+			/* Skip purged head of $J */
+			if (got)
+				break;
+			usn += rest;
+			continue;
+		}
+
+		op = min_t(u64, min_t(u64, rest, end - pos), ulen - got);
+		err = ntfs_read_run_nb(sbi, run, pos, Add2Ptr(kbuf, got), op,
+				       NULL);
+		if (err)
+			break;
+
+		got += op;
+	}
+
+	up_write(&ni->file.run_lock);
+	mutex_unlock(&ni->ni_lock);
+
+	if (usn > end)
+		usn = end;
+
+out:
+	mutex_unlock(&sbi->usn.wmtx);
+
+	if (err)
+		goto out1;
+
+	/* Pack whole records, skip padding at the end of pages */
+	while (off + sizeof(__le32) <= got) {
+		r = Add2Ptr(kbuf, off);
+		rlen = le32_to_cpu(r->RecordLength);
+
+		if (!rlen) {
+			off = min_t(u64, got,
+				    ((usn + off) | (USN_PAGE_SIZE - 1)) + 1 -
+					    usn);
+			continue;
+		}
+
+		if (rlen < offsetof(struct USN_RECORD_V2, FileName) ||
+		    (rlen & 7) || rlen > USN_PAGE_SIZE) {
+			err = -EINVAL;
+			goto out1;
+		}
+
+		if (rlen > got - off)
+			break;
+
+		memmove(Add2Ptr(kbuf, bytes), r, rlen);
+		bytes += rlen;
+		off += rlen;
+	}
+
+	if (!bytes && off < got && got == ulen) {
+		/* user buffer is too small even for one record */
+		err = -EOVERFLOW;
+		goto out1;
+	}
+
+	if (bytes && copy_to_user(ubuf, kbuf, bytes)) {
+		err = -EFAULT;
+		goto out1;
+	}
+
+	req->start_usn = usn + off;
+	req->journal_id = id;
+	req->bytes = bytes;
+
+out1:
+	ntfs_free(kbuf);
+
+	return err;
+}
@@ -23,6 +23,93 @@ static const struct INDEX_NAMES {
 	{ SQ_NAME, ARRAY_SIZE(SQ_NAME) },   { SR_NAME, ARRAY_SIZE(SR_NAME) },
 };
 
+/* Size of index buffers in practically all volumes */
+#define NTFS_INDX_BUF_SIZE 0x1000
+
+static struct kmem_cache *ntfs_fnd_cachep;
+static struct kmem_cache *ntfs_indx_node_cachep;
+static struct kmem_cache *ntfs_indx_buf_cachep;
+
+int __init ntfs3_init_index(void)
+{
+	ntfs_fnd_cachep = kmem_cache_create("ntfs3_fnd_cache",
+					    sizeof(struct ntfs_fnd), 0, 0,
+					    NULL);
+	if (!ntfs_fnd_cachep)
+		goto out;
+
+	ntfs_indx_node_cachep =
+		kmem_cache_create("ntfs3_indx_node_cache",
+				  sizeof(struct indx_node), 0, 0, NULL);
+	if (!ntfs_indx_node_cachep)
+		goto out;
+
+	ntfs_indx_buf_cachep =
+		kmem_cache_create("ntfs3_indx_buf_cache", NTFS_INDX_BUF_SIZE,
+				  0, 0, NULL);
+	if (!ntfs_indx_buf_cachep)
+		goto out;
+
+	return 0;
+
+out:
+	ntfs3_exit_index();
+	return -ENOMEM;
+}
+
+void ntfs3_exit_index(void)
+{
+	kmem_cache_destroy(ntfs_indx_buf_cachep);
+	kmem_cache_destroy(ntfs_indx_node_cachep);
+	kmem_cache_destroy(ntfs_fnd_cachep);
+}
+
+struct ntfs_fnd *fnd_get(void)
+{
+	return kmem_cache_zalloc(ntfs_fnd_cachep, GFP_NOFS);
+}
+
+void fnd_put(struct ntfs_fnd *fnd)
+{
+	if (fnd) {
+		fnd_clear(fnd);
+		kmem_cache_free(ntfs_fnd_cachep, fnd);
+	}
+}
+
+static inline void *indx_buf_alloc(u32 bytes)
+{
+	if (bytes == NTFS_INDX_BUF_SIZE)
+		return kmem_cache_alloc(ntfs_indx_buf_cachep, GFP_NOFS);
+	return ntfs_malloc(bytes);
+}
+
+static inline void indx_buf_free(void *ib, u32 bytes)
+{
+	if (!ib)
+		return;
+	if (bytes == NTFS_INDX_BUF_SIZE)
+		kmem_cache_free(ntfs_indx_buf_cachep, ib);
+	else
+		ntfs_free(ib);
+}
+
+void put_indx_node(struct indx_node *in)
+{
+	if (!in)
+		return;
+
+	if (in->dirty) {
+		/* Keep changes until writeback */
+		indx_put_dirty(in);
+		return;
+	}
+
+	indx_buf_free(in->index, 1u << in->indx->index_bits);
+	nb_put(&in->nb);
+	kmem_cache_free(ntfs_indx_node_cachep, in);
+}
+
 /*
  * compare two names in index
  * if l1 != 0
@@ -301,6 +388,204 @@ out:
 	put_bh(bh);
 }
 
+/*
+ * indx_take_wb
+ *
+ * removes the kept buffer from index if it has the same 'vbn'
+ * (NULL - any buffer)
+ */
+static struct indx_node *indx_take_wb(struct ntfs_index *indx,
+				      const CLST *vbn)
+{
+	struct indx_node *in;
+
+	spin_lock(&indx->wb_lock);
+	in = indx->wb;
+	if (in && (!vbn || in->vbn == *vbn))
+		indx->wb = NULL;
+	else
+		in = NULL;
+	spin_unlock(&indx->wb_lock);
+
+	return in;
+}
+
+/*
+ * indx_drop_wb
+ *
+ * forgets the kept buffer without writing
+ */
+static void indx_drop_wb(struct ntfs_index *indx, const CLST *vbn)
+{
+	struct indx_node *in = indx_take_wb(indx, vbn);
+
+	if (in) {
+		in->dirty = false;
+		put_indx_node(in);
+	}
+}
+
+/*
+ * indx_write_wb
+ *
+ * writes the buffer into its buffer_heads and releases it
+ */
+static int indx_write_wb(struct ntfs_index *indx, struct indx_node *in,
+			 int sync)
+{
+	int err = ntfs_write_bh(indx->sbi, &in->index->rhdr, &in->nb, sync);
+
+	in->dirty = false;
+	put_indx_node(in);
+	return err;
+}
+
+/*
+ * indx_put_dirty
+ *
+ * keeps modified buffer in memory. Subsequent modifications of the
+ * same buffer (e.g. a burst of creates in one directory) do not touch
+ * buffer_heads until the directory is written or other buffer is kept
+ */
+void indx_put_dirty(struct indx_node *in)
+{
+	struct ntfs_index *indx = in->indx;
+	struct indx_node *old;
+
+	spin_lock(&indx->wb_lock);
+	old = indx->wb;
+	indx->wb = in;
+	spin_unlock(&indx->wb_lock);
+
+	if (old && old != in)
+		indx_write_wb(indx, old, 0);
+}
+
+/*
+ * indx_flush
+ *
+ * writes the kept buffer
+ */
+int indx_flush(struct ntfs_index *indx, int sync)
+{
+	struct indx_node *in = indx_take_wb(indx, NULL);
+
+	return in ? indx_write_wb(indx, in, sync) : 0;
+}
+
+/*
+ * indx_drop
+ *
+ * forgets the kept buffer of deleted index
+ */
+void indx_drop(struct ntfs_index *indx)
+{
+	indx_drop_wb(indx, NULL);
+}
+
+/* Tables of converted names of all directories take not more than this */
+#define NTFS_DIR_NAMES_MAX_TOTAL (16u * 1024 * 1024)
+
+static atomic_long_t ntfs_dir_names_total = ATOMIC_LONG_INIT(0);
+
+/*
+ * indx_alloc_names
+ *
+ * allocates referenced table of names with room for 'bytes'
+ * Fails if all tables take too much memory
+ */
+struct ntfs_dir_names *indx_alloc_names(u32 bytes)
+{
+	struct ntfs_dir_names *names;
+
+	if (atomic_long_add_return(bytes, &ntfs_dir_names_total) >
+	    NTFS_DIR_NAMES_MAX_TOTAL)
+		goto out;
+
+	names = ntfs_vmalloc(sizeof(*names) + bytes);
+	if (!names)
+		goto out;
+
+	atomic_set(&names->refs, 1);
+	names->bytes = 0;
+	names->allocated = bytes;
+	names->gen = 0;
+	names->end = 0;
+
+	return names;
+
+out:
+	atomic_long_sub(bytes, &ntfs_dir_names_total);
+	return NULL;
+}
+
+/*
+ * indx_get_names
+ *
+ * returns referenced table of names (if any) and current generation
+ */
+struct ntfs_dir_names *indx_get_names(struct ntfs_index *indx, u32 *gen)
+{
+	struct ntfs_dir_names *names;
+
+	spin_lock(&indx->wb_lock);
+	names = indx->names;
+	if (names)
+		atomic_inc(&names->refs);
+	*gen = indx->names_gen;
+	spin_unlock(&indx->wb_lock);
+
+	return names;
+}
+
+void indx_put_names(struct ntfs_dir_names *names)
+{
+	if (names && atomic_dec_and_test(&names->refs)) {
+		atomic_long_sub(names->allocated, &ntfs_dir_names_total);
+		ntfs_vfree(names);
+	}
+}
+
+/*
+ * indx_set_names
+ *
+ * keeps table of names built at generation 'gen'
+ * Fails if index was changed since
+ */
+bool indx_set_names(struct ntfs_index *indx, struct ntfs_dir_names *names,
+		    u32 gen)
+{
+	bool ok;
+
+	spin_lock(&indx->wb_lock);
+	ok = gen == indx->names_gen && !indx->names;
+	if (ok) {
+		atomic_inc(&names->refs);
+		indx->names = names;
+	}
+	spin_unlock(&indx->wb_lock);
+
+	return ok;
+}
+
+/*
+ * indx_drop_names
+ *
+ * forgets table of names. Called on each change of index
+ */
+void indx_drop_names(struct ntfs_index *indx)
+{
+	struct ntfs_dir_names *names;
+
+	spin_lock(&indx->wb_lock);
+	names = indx->names;
+	indx->names = NULL;
+	indx->names_gen += 1;
+	spin_unlock(&indx->wb_lock);
+
+	indx_put_names(names);
+}
+
 /*
  * indx_mark_used
  *
@@ -311,6 +596,10 @@ static int indx_mark_used(struct ntfs_index *indx, struct ntfs_inode *ni,
 {
 	int err;
 	struct bmp_buf bbuf;
+	CLST vbn = bit << indx->idx2vbn_bits;
+
+	/* Old content of reused buffer must not be written */
+	indx_drop_wb(indx, &vbn);
 
 	err = bmp_buf_get(indx, ni, bit, &bbuf);
 	if (err)
@@ -333,6 +622,9 @@ static int indx_mark_free(struct ntfs_index *indx, struct ntfs_inode *ni,
 {
 	int err;
 	struct bmp_buf bbuf;
+	CLST vbn = bit << indx->idx2vbn_bits;
+
+	indx_drop_wb(indx, &vbn);
 
 	err = bmp_buf_get(indx, ni, bit, &bbuf);
 	if (err)
@@ -548,32 +840,49 @@ int indx_used_bit(struct ntfs_index *indx, struct ntfs_inode *ni, size_t *bit)
  * hdr_find_split
  *
  * finds a point at which the index allocation buffer would like to
- * be split.
+ * be split: the middle. The last entry is returned via 'last' (if not NULL)
  * NOTE: This function should never return 'END' entry NULL returns on error
  */
-static const struct NTFS_DE *hdr_find_split(const struct INDEX_HDR *hdr)
+static const struct NTFS_DE *hdr_find_split(const struct INDEX_HDR *hdr,
+					    const struct NTFS_DE **last)
 {
 	size_t o;
 	const struct NTFS_DE *e = hdr_first_de(hdr);
-	u32 used_2 = le32_to_cpu(hdr->used) >> 1;
-	u16 esize = le16_to_cpu(e->size);
+	const struct NTFS_DE *sp = NULL, *p;
+	u32 used = le32_to_cpu(hdr->used);
+	u32 used_2 = used >> 1;
+	u16 esize;
+
+	if (last)
+		*last = NULL;
 
 	if (!e || de_is_last(e))
 		return NULL;
 
-	for (o = le32_to_cpu(hdr->de_off) + esize; o < used_2; o += esize) {
-		const struct NTFS_DE *p = e;
+	esize = le16_to_cpu(e->size);
+
+	for (o = le32_to_cpu(hdr->de_off) + esize; o < used; o += esize) {
+		/* 'e' is the last entry before offset 'o' */
+		if (!sp && o >= used_2) {
+			sp = e;
+			if (!last)
+				return sp;
+		}
 
-		e = Add2Ptr(hdr, o);
+		p = Add2Ptr(hdr, o);
 
 		/* We must not return END entry */
-		if (de_is_last(e))
-			return p;
+		if (de_is_last(p))
+			break;
 
+		e = p;
 		esize = le16_to_cpu(e->size);
 	}
 
-	return e;
+	if (last)
+		*last = e;
+
+	return sp ? sp : e;
 }
 
 /*
@@ -872,6 +1181,8 @@ static inline struct NTFS_DE *hdr_delete_de(struct INDEX_HDR *hdr,
 
 void indx_clear(struct ntfs_index *indx)
 {
+	indx_drop_names(indx);
+	indx_flush(indx, 0);
 	run_close(&indx->alloc_run);
 	run_close(&indx->bitmap_run);
 }
@@ -914,6 +1225,10 @@ int indx_init(struct ntfs_index *indx, struct ntfs_sb_info *sbi,
 	}
 
 	init_rwsem(&indx->run_lock);
+	spin_lock_init(&indx->wb_lock);
+	indx->wb = NULL;
+	indx->sbi = sbi;
+	indx->names = NULL;
 
 	indx->cmp = get_cmp_func(root);
 	return indx->cmp ? 0 : -EINVAL;
@@ -933,21 +1248,22 @@ static struct indx_node *indx_new(struct ntfs_index *indx,
 	u16 fn;
 	u32 eo;
 
-	r = ntfs_zalloc(sizeof(struct indx_node));
+	r = kmem_cache_zalloc(ntfs_indx_node_cachep, GFP_NOFS);
 	if (!r)
 		return ERR_PTR(-ENOMEM);
 
-	index = ntfs_zalloc(bytes);
+	index = indx_buf_alloc(bytes);
 	if (!index) {
-		ntfs_free(r);
+		kmem_cache_free(ntfs_indx_node_cachep, r);
 		return ERR_PTR(-ENOMEM);
 	}
+	memset(index, 0, bytes);
 
 	err = ntfs_get_bh(ni->mi.sbi, &indx->alloc_run, vbo, bytes, &r->nb);
 
 	if (err) {
-		ntfs_free(index);
-		ntfs_free(r);
+		indx_buf_free(index, bytes);
+		kmem_cache_free(ntfs_indx_node_cachep, r);
 		return ERR_PTR(err);
 	}
 
@@ -979,6 +1295,8 @@ static struct indx_node *indx_new(struct ntfs_index *indx,
 	hdr->total = cpu_to_le32(bytes - offsetof(struct INDEX_BUFFER, ihdr));
 
 	r->index = index;
+	r->indx = indx;
+	r->vbn = vbn;
 	return r;
 }
 
@@ -1005,6 +1323,13 @@ static int indx_write(struct ntfs_index *indx, struct ntfs_inode *ni,
 {
 	struct INDEX_BUFFER *ib = node->index;
 
+	if (!sync && indx->type == INDEX_MUTEX_I30) {
+		/* Directory buffers are written with directory (indx_flush) */
+		node->dirty = true;
+		return 0;
+	}
+
+	node->dirty = false;
 	return ntfs_write_bh(ni->mi.sbi, &ib->rhdr, &node->nb, sync);
 }
 
@@ -1012,9 +1337,10 @@ static int indx_write(struct ntfs_index *indx, struct ntfs_inode *ni,
  * if ntfs_readdir calls this function
  * inode is shared locked and no ni_lock
  * use rw_semaphore for read/write access to alloc_run
+ * 'shared' readers copy the kept buffer, others take it
  */
-int indx_read(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
-	      struct indx_node **node)
+static int indx_read_ex(struct ntfs_index *indx, struct ntfs_inode *ni,
+			CLST vbn, struct indx_node **node, bool shared)
 {
 	int err;
 	struct INDEX_BUFFER *ib;
@@ -1025,8 +1351,24 @@ int indx_read(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
 	struct indx_node *in = *node;
 	const struct INDEX_NAMES *name;
 
+	if (in && in->dirty) {
+		/* Keep changes of the previous buffer */
+		put_indx_node(in);
+		*node = in = NULL;
+	}
+
+	if (!shared) {
+		struct indx_node *wb = indx_take_wb(indx, &vbn);
+
+		if (wb) {
+			put_indx_node(in);
+			*node = wb;
+			return 0;
+		}
+	}
+
 	if (!in) {
-		in = ntfs_zalloc(sizeof(struct indx_node));
+		in = kmem_cache_zalloc(ntfs_indx_node_cachep, GFP_NOFS);
 		if (!in)
 			return -ENOMEM;
 	} else {
@@ -1035,13 +1377,29 @@ int indx_read(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
 
 	ib = in->index;
 	if (!ib) {
-		ib = ntfs_malloc(bytes);
+		ib = indx_buf_alloc(bytes);
 		if (!ib) {
 			err = -ENOMEM;
 			goto out;
 		}
 	}
 
+	if (shared) {
+		bool found = false;
+
+		spin_lock(&indx->wb_lock);
+		if (indx->wb && indx->wb->vbn == vbn) {
+			memcpy(ib, indx->wb->index, bytes);
+			found = true;
+		}
+		spin_unlock(&indx->wb_lock);
+
+		if (found) {
+			err = 0;
+			goto ok;
+		}
+	}
+
 	down_read(lock);
 	err = ntfs_read_bh(ni->mi.sbi, run, vbo, &ib->rhdr, bytes, &in->nb);
 	up_read(lock);
@@ -1078,20 +1436,39 @@ ok:
 	}
 
 	in->index = ib;
+	in->indx = indx;
+	in->vbn = vbn;
 	*node = in;
 
 out:
 	if (ib != in->index)
-		ntfs_free(ib);
+		indx_buf_free(ib, bytes);
 
 	if (*node != in) {
 		nb_put(&in->nb);
-		ntfs_free(in);
+		kmem_cache_free(ntfs_indx_node_cachep, in);
 	}
 
 	return err;
 }
 
+int indx_read(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
+	      struct indx_node **node)
+{
+	return indx_read_ex(indx, ni, vbn, node, false);
+}
+
+/*
+ * indx_read_shared
+ *
+ * reads index buffer without ni_lock (see ntfs_readdir)
+ */
+int indx_read_shared(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
+		     struct indx_node **node)
+{
+	return indx_read_ex(indx, ni, vbn, node, true);
+}
+
 /*
  * indx_find
  *
@@ -1218,7 +1595,7 @@ next_iter:
 		    sizeof(struct NTFS_DE) + sizeof(u64)) {
 			if (n) {
 				fnd_pop(fnd);
-				ntfs_free(n);
+				put_indx_node(n);
 			}
 			return -EINVAL;
 		}
@@ -1231,7 +1608,7 @@ next_iter:
 		/* Try next level */
 		e = hdr_first_de(&n->index->ihdr);
 		if (!e) {
-			ntfs_free(n);
+			put_indx_node(n);
 			return -EINVAL;
 		}
 
@@ -1251,7 +1628,7 @@ pop_level:
 		/* Pop one level */
 		if (n) {
 			fnd_pop(fnd);
-			ntfs_free(n);
+			put_indx_node(n);
 		}
 
 		level = fnd->level;
@@ -1754,7 +2131,7 @@ indx_insert_into_buffer(struct ntfs_index *indx, struct ntfs_inode *ni,
 			const void *ctx, int level, struct ntfs_fnd *fnd)
 {
 	int err;
-	const struct NTFS_DE *sp;
+	const struct NTFS_DE *sp, *last;
 	struct NTFS_DE *e, *de_t, *up_e = NULL;
 	struct indx_node *n2 = NULL;
 	struct indx_node *n1 = fnd->nodes[level];
@@ -1786,10 +2163,23 @@ indx_insert_into_buffer(struct ntfs_index *indx, struct ntfs_inode *ni,
 	 * - Insert sp into parent buffer (or root)
 	 * - Make sp a parent for new buffer
 	 */
-	sp = hdr_find_split(hdr1);
+	/*
+	 * Sequential inserts (new entry is bigger than all entries in
+	 * buffer) split at the last entry: left buffer stays full and
+	 * the next entries go into the right one
+	 * Buffer with the only entry is split in the middle: split at the
+	 * last entry would leave left buffer empty
+	 */
+	sp = hdr_find_split(hdr1, &last);
 	if (!sp)
 		return -EINVAL;
 
+	if (last != hdr_first_de(hdr1) &&
+	    (*indx->cmp)(new_de + 1, le16_to_cpu(new_de->key_size), last + 1,
+			 le16_to_cpu(last->key_size), ctx) > 0) {
+		sp = last;
+	}
+
 	sp_size = le16_to_cpu(sp->size);
 	up_e = ntfs_malloc(sp_size + sizeof(u64));
 	if (!up_e)
@@ -1889,6 +2279,8 @@ int indx_insert_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
 	struct ntfs_fnd *fnd_a = NULL;
 	struct INDEX_ROOT *root;
 
+	indx_drop_names(indx);
+
 	if (!fnd) {
 		fnd_a = fnd_get();
 		if (!fnd_a) {
@@ -2192,70 +2584,272 @@ out:
 }
 
 /*
- * indx_delete_entry
+ * indx_free_alloc
  *
- * deletes an entry from the index.
+ * frees all buffers of index: removes "Allocation + Bitmap" attributes
  */
-int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
-		      const void *key, u32 key_len, const void *ctx)
+static int indx_free_alloc(struct ntfs_index *indx, struct ntfs_inode *ni)
 {
-	int err, diff;
+	int err;
+	const struct INDEX_NAMES *in = &s_index_names[indx->type];
+
+	indx_drop(indx);
+	indx_drop_names(indx);
+
+	err = attr_set_size(ni, ATTR_ALLOC, in->name, in->name_len,
+			    &indx->alloc_run, 0, NULL, false, NULL);
+	err = ni_remove_attr(ni, ATTR_ALLOC, in->name, in->name_len, false,
+			     NULL);
+	run_close(&indx->alloc_run);
+
+	err = attr_set_size(ni, ATTR_BITMAP, in->name, in->name_len,
+			    &indx->bitmap_run, 0, NULL, false, NULL);
+	err = ni_remove_attr(ni, ATTR_BITMAP, in->name, in->name_len, false,
+			     NULL);
+	run_close(&indx->bitmap_run);
+
+	return err;
+}
+
+/*
+ * indx_make_empty
+ *
+ * removes index allocation and bitmap and recreates empty index root
+ */
+static int indx_make_empty(struct ntfs_index *indx, struct ntfs_inode *ni)
+{
+	int err;
 	struct INDEX_ROOT *root;
 	struct INDEX_HDR *hdr;
-	struct ntfs_fnd *fnd, *fnd2;
-	struct INDEX_BUFFER *ib;
-	struct NTFS_DE *e, *re, *next, *prev, *me;
-	struct indx_node *n, *n2d = NULL;
-	__le64 sub_vbn;
-	int level, level2;
+	struct NTFS_DE *e;
 	struct ATTRIB *attr;
 	struct mft_inode *mi;
-	u32 e_size, root_size, new_root_size;
-	size_t trim_bit;
-	const struct INDEX_NAMES *in;
-
-	fnd = fnd_get();
-	if (!fnd) {
-		err = -ENOMEM;
-		goto out2;
-	}
+	u32 root_size, new_root_size;
 
-	fnd2 = fnd_get();
-	if (!fnd2) {
-		err = -ENOMEM;
-		goto out1;
-	}
+	err = indx_free_alloc(indx, ni);
 
 	root = indx_get_root(indx, ni, &attr, &mi);
-	if (!root) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (!root)
+		return -EINVAL;
 
-	/* Locate the entry to remove. */
-	err = indx_find(indx, ni, root, key, key_len, ctx, &diff, &e, fnd);
-	if (err)
-		goto out;
+	root_size = le32_to_cpu(attr->res.data_size);
+	new_root_size = sizeof(struct INDEX_ROOT) + sizeof(struct NTFS_DE);
 
-	if (!e || diff) {
-		err = -ENOENT;
-		goto out;
+	if (new_root_size != root_size &&
+	    !mi_resize_attr(mi, attr, new_root_size - root_size)) {
+		return -EINVAL;
 	}
 
-	level = fnd->level;
+	/* Fill first entry */
+	e = (struct NTFS_DE *)(root + 1);
+	e->ref.low = 0;
+	e->ref.high = 0;
+	e->ref.seq = 0;
+	e->size = cpu_to_le16(sizeof(struct NTFS_DE));
+	e->flags = NTFS_IE_LAST; // 0x02
+	e->key_size = 0;
+	e->res = 0;
 
-	if (level) {
-		n = fnd->nodes[level - 1];
-		e = fnd->de[level - 1];
-		ib = n->index;
-		hdr = &ib->ihdr;
-	} else {
-		hdr = &root->ihdr;
-		e = fnd->root_de;
-		n = NULL;
-	}
+	hdr = &root->ihdr;
+	hdr->flags = 0;
+	hdr->used = hdr->total =
+		cpu_to_le32(new_root_size - offsetof(struct INDEX_ROOT, ihdr));
+	mi->dirty = true;
 
-	e_size = le16_to_cpu(e->size);
+	return err;
+}
+
+/*
+ * indx_merge_leaf
+ *
+ * merges underfilled leaf fnd->nodes[fnd->level - 1] with its sibling
+ * The left buffer, the parent entry between them and the right buffer
+ * are joined into the right buffer, the left one is freed
+ */
+static int indx_merge_leaf(struct ntfs_index *indx, struct ntfs_inode *ni,
+			   struct INDEX_ROOT *root, struct ATTRIB *attr,
+			   struct mft_inode *mi, struct ntfs_fnd *fnd)
+{
+	int err;
+	int level = fnd->level;
+	struct indx_node *n = fnd->nodes[level - 1];
+	struct indx_node *pn = level > 1 ? fnd->nodes[level - 2] : NULL;
+	struct INDEX_HDR *ph = pn ? &pn->index->ihdr : &root->ihdr;
+	struct NTFS_DE *pe = pn ? fnd->de[level - 2] : fnd->root_de;
+	struct indx_node *sib = NULL, *x, *y;
+	struct NTFS_DE *a, *b, *xe, *xl, *ye;
+	struct INDEX_HDR *xh, *yh;
+	u32 total = le32_to_cpu(n->index->ihdr.total);
+	u32 x_bytes, a_bytes, a_size, y_used;
+	CLST vbn;
+	size_t bit;
+
+	/* Merge only if leaf is filled less than quarter */
+	if (le32_to_cpu(n->index->ihdr.used) > (total >> 2))
+		return 0;
+
+	if (!pe || !de_has_vcn_ex(pe) || de_get_vbn(pe) != n->vbn)
+		return 0;
+
+	/* 'a' points to left buffer, the next entry 'b' - to right one */
+	if (!de_is_last(pe)) {
+		a = pe;
+		b = hdr_next_de(ph, pe);
+	} else {
+		struct NTFS_DE *next;
+
+		b = pe;
+		for (a = hdr_first_de(ph); a && !de_is_last(a); a = next) {
+			next = hdr_next_de(ph, a);
+			if (next == b)
+				break;
+		}
+		if (!a || de_is_last(a))
+			return 0;
+	}
+
+	if (!b || !de_has_vcn_ex(a) || !de_has_vcn_ex(b))
+		return 0;
+
+	/* Do not leave index buffer with the only 'END' entry */
+	if (pn && hdr_first_de(ph) == a && de_is_last(b))
+		return 0;
+
+	vbn = de_get_vbn(a == pe ? b : a);
+	err = indx_read(indx, ni, vbn, &sib);
+	if (err)
+		return err;
+
+	if (a == pe) {
+		x = n;
+		y = sib;
+	} else {
+		x = sib;
+		y = n;
+	}
+
+	xh = &x->index->ihdr;
+	yh = &y->index->ihdr;
+	if (!ib_is_leaf(sib->index))
+		goto out;
+
+	xe = hdr_first_de(xh);
+	ye = hdr_first_de(yh);
+	if (!xe || !ye)
+		goto out;
+
+	/* Bytes of entries in left buffer without 'END' */
+	for (xl = xe; xl && !de_is_last(xl); xl = hdr_next_de(xh, xl))
+		;
+	if (!xl)
+		goto out;
+	x_bytes = PtrOffset(xe, xl);
+	a_size = le16_to_cpu(a->size);
+	a_bytes = a_size - sizeof(u64);
+	y_used = le32_to_cpu(yh->used);
+
+	/* Keep a quarter of buffer free for next inserts */
+	if (y_used + x_bytes + a_bytes > total - (total >> 2))
+		goto out;
+
+	memmove(Add2Ptr(ye, x_bytes + a_bytes), ye,
+		y_used - le32_to_cpu(yh->de_off));
+	memcpy(ye, xe, x_bytes);
+
+	/* Parent entry without down-pointer */
+	xe = Add2Ptr(ye, x_bytes);
+	memcpy(xe, a, a_bytes);
+	xe->flags &= ~NTFS_IE_HAS_SUBNODES;
+	xe->size = cpu_to_le16(a_bytes);
+
+	yh->used = cpu_to_le32(y_used + x_bytes + a_bytes);
+	indx_write(indx, ni, y, 0);
+
+	/* 'b' takes place of 'a' and still points to right buffer */
+	hdr_delete_de(ph, a);
+	if (pn) {
+		indx_write(indx, ni, pn, 0);
+	} else {
+		ph->total = ph->used;
+		mi_resize_attr(mi, attr, 0 - a_size);
+	}
+
+	bit = x->vbn >> indx->idx2vbn_bits;
+	indx_mark_free(indx, ni, bit);
+	x->dirty = false;
+	indx_shrink(indx, ni, bit + 1);
+
+out:
+	put_indx_node(sib);
+	return 0;
+}
+
+/*
+ * indx_delete_entry
+ *
+ * deletes an entry from the index.
+ */
+int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
+		      const void *key, u32 key_len, const void *ctx)
+{
+	int err, diff;
+	struct INDEX_ROOT *root;
+	struct INDEX_HDR *hdr;
+	struct ntfs_fnd *fnd, *fnd2;
+	struct INDEX_BUFFER *ib;
+	struct NTFS_DE *e, *re, *next, *prev, *me;
+	struct indx_node *n, *n2d = NULL;
+	__le64 sub_vbn;
+	int level, level2;
+	struct ATTRIB *attr;
+	struct mft_inode *mi;
+	u32 e_size;
+	size_t trim_bit;
+
+	indx_drop_names(indx);
+
+	fnd = fnd_get();
+	if (!fnd) {
+		err = -ENOMEM;
+		goto out2;
+	}
+
+	fnd2 = fnd_get();
+	if (!fnd2) {
+		err = -ENOMEM;
+		goto out1;
+	}
+
+	root = indx_get_root(indx, ni, &attr, &mi);
+	if (!root) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* Locate the entry to remove. */
+	err = indx_find(indx, ni, root, key, key_len, ctx, &diff, &e, fnd);
+	if (err)
+		goto out;
+
+	if (!e || diff) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	level = fnd->level;
+
+	if (level) {
+		n = fnd->nodes[level - 1];
+		e = fnd->de[level - 1];
+		ib = n->index;
+		hdr = &ib->ihdr;
+	} else {
+		hdr = &root->ihdr;
+		e = fnd->root_de;
+		n = NULL;
+	}
+
+	e_size = le16_to_cpu(e->size);
 
 	if (!de_has_vcn_ex(e)) {
 		/* The entry to delete is a leaf, so we can just rip it out */
@@ -2278,6 +2872,9 @@ int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
 		if (ib_is_leaf(ib) && ib_is_empty(ib)) {
 			fnd_pop(fnd);
 			fnd_push(fnd2, n, e);
+		} else if (ib_is_leaf(ib)) {
+			/* Not critical if merge fails */
+			indx_merge_leaf(indx, ni, root, attr, mi, fnd);
 		}
 	} else {
 		/*
@@ -2491,6 +3088,8 @@ int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
 					   indx->idx2vbn_bits;
 
 				indx_mark_free(indx, ni, k);
+				/* Nothing to write back for free buffer */
+				fnd->nodes[level]->dirty = false;
 				if (k < trim_bit)
 					trim_bit = k;
 			}
@@ -2519,51 +3118,7 @@ int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
 		fnd_clear(fnd);
 		fnd_clear(fnd2);
 
-		in = &s_index_names[indx->type];
-
-		err = attr_set_size(ni, ATTR_ALLOC, in->name, in->name_len,
-				    &indx->alloc_run, 0, NULL, false, NULL);
-		err = ni_remove_attr(ni, ATTR_ALLOC, in->name, in->name_len,
-				     false, NULL);
-		run_close(&indx->alloc_run);
-
-		err = attr_set_size(ni, ATTR_BITMAP, in->name, in->name_len,
-				    &indx->bitmap_run, 0, NULL, false, NULL);
-		err = ni_remove_attr(ni, ATTR_BITMAP, in->name, in->name_len,
-				     false, NULL);
-		run_close(&indx->bitmap_run);
-
-		root = indx_get_root(indx, ni, &attr, &mi);
-		if (!root) {
-			err = -EINVAL;
-			goto out;
-		}
-
-		root_size = le32_to_cpu(attr->res.data_size);
-		new_root_size =
-			sizeof(struct INDEX_ROOT) + sizeof(struct NTFS_DE);
-
-		if (new_root_size != root_size &&
-		    !mi_resize_attr(mi, attr, new_root_size - root_size)) {
-			err = -EINVAL;
-			goto out;
-		}
-
-		/* Fill first entry */
-		e = (struct NTFS_DE *)(root + 1);
-		e->ref.low = 0;
-		e->ref.high = 0;
-		e->ref.seq = 0;
-		e->size = cpu_to_le16(sizeof(struct NTFS_DE));
-		e->flags = NTFS_IE_LAST; // 0x02
-		e->key_size = 0;
-		e->res = 0;
-
-		hdr = &root->ihdr;
-		hdr->flags = 0;
-		hdr->used = hdr->total = cpu_to_le32(
-			new_root_size - offsetof(struct INDEX_ROOT, ihdr));
-		mi->dirty = true;
+		err = indx_make_empty(indx, ni);
 	}
 
 out:
@@ -2592,6 +3147,18 @@ int indx_update_dup(struct ntfs_inode *ni, struct ntfs_sb_info *sbi,
 		goto out1;
 	}
 
+	/*
+	 * Called without directory i_rwsem. Write the kept buffer to
+	 * let ntfs_readdir see it while this function modifies its copy
+	 */
+	err = indx_flush(indx, 0);
+	if (err)
+		goto out;
+
+	/* Hidden names are not listed with 'nohidden' */
+	if (sbi->options.nohidden)
+		indx_drop_names(indx);
+
 	root = indx_get_root(indx, ni, NULL, &mi);
 	if (!root) {
 		err = -EINVAL;
@@ -2625,6 +3192,8 @@ int indx_update_dup(struct ntfs_inode *ni, struct ntfs_sb_info *sbi,
 
 	if (fnd->level) {
 		err = indx_write(indx, ni, fnd->nodes[fnd->level - 1], sync);
+		if (!sync)
+			mark_inode_dirty(&ni->vfs_inode);
 	} else if (sync) {
 		mi->dirty = true;
 		err = mi_write(mi, 1);
@@ -2639,3 +3208,718 @@ out:
 out1:
 	return err;
 }
+
+/*
+ * indx_stat
+ *
+ * counts index buffers and their fill (see NTFS3_IOC_INDEX_STAT)
+ * ni_lock is locked
+ */
+int indx_stat(struct ntfs_index *indx, struct ntfs_inode *ni,
+	      struct ntfs_index_stat *st)
+{
+	int err;
+	size_t bit = 0;
+	struct indx_node *node = NULL;
+	const struct INDEX_ROOT *root;
+	const struct INDEX_HDR *hdr;
+	const struct NTFS_DE *e;
+
+	memset(st, 0, sizeof(*st));
+
+	root = indx_get_root(indx, ni, NULL, NULL);
+	if (!root)
+		return -EINVAL;
+
+	st->buffer_size = 1u << indx->index_bits;
+	hdr = &root->ihdr;
+
+	for (;;) {
+		for (e = hdr_first_de(hdr); e && !de_is_last(e);
+		     e = hdr_next_de(hdr, e)) {
+			st->entries += 1;
+		}
+
+		err = indx_used_bit(indx, ni, &bit);
+		if (err == -ENOENT) {
+			/* Small index: root only */
+			err = 0;
+			break;
+		}
+
+		if (err || bit == MINUS_ONE_T)
+			break;
+
+		err = indx_read(indx, ni, bit << indx->idx2vbn_bits, &node);
+		if (err)
+			break;
+
+		hdr = &node->index->ihdr;
+		st->buffers += 1;
+		st->bytes_used += le32_to_cpu(hdr->used);
+		st->bytes_total += le32_to_cpu(hdr->total);
+		bit += 1;
+	}
+
+	put_indx_node(node);
+	return err;
+}
+
+/*
+ * indx_bulk_cmp
+ *
+ * compares two entries of bulk array by collation of index
+ */
+static inline int indx_bulk_cmp(const struct ntfs_index *indx, const u8 *de,
+				u32 off1, u32 off2, const void *ctx)
+{
+	const struct NTFS_DE *e1 = Add2Ptr(de, off1);
+	const struct NTFS_DE *e2 = Add2Ptr(de, off2);
+
+	return (*indx->cmp)(e1 + 1, le16_to_cpu(e1->key_size), e2 + 1,
+			    le16_to_cpu(e2->key_size), ctx);
+}
+
+/*
+ * indx_bulk_sort
+ *
+ * sorts packed array of 'n' entries by collation of index
+ * (bottom-up merge sort of entry offsets)
+ */
+static int indx_bulk_sort(struct ntfs_index *indx, u8 *de, size_t bytes,
+			  size_t n, const void *ctx)
+{
+	int err = -ENOMEM;
+	u32 *off, *tmp, *t;
+	u8 *sorted = NULL;
+	size_t i, j, k, l, m, r, w, pos;
+	const struct NTFS_DE *e;
+
+	off = ntfs_vmalloc(n * 2 * sizeof(u32));
+	if (!off)
+		return -ENOMEM;
+	tmp = off + n;
+
+	for (i = 0, pos = 0; i < n; i++) {
+		off[i] = pos;
+		e = Add2Ptr(de, pos);
+		pos += le16_to_cpu(e->size);
+	}
+
+	for (w = 1; w < n; w <<= 1) {
+		for (l = 0; l < n; l += 2 * w) {
+			m = min(l + w, n);
+			r = min(l + 2 * w, n);
+			for (i = l, j = m, k = l; k < r; k++) {
+				if (j >= r ||
+				    (i < m &&
+				     indx_bulk_cmp(indx, de, off[i], off[j],
+						   ctx) <= 0)) {
+					tmp[k] = off[i++];
+				} else {
+					tmp[k] = off[j++];
+				}
+			}
+		}
+		t = off;
+		off = tmp;
+		tmp = t;
+	}
+
+	sorted = ntfs_vmalloc(bytes);
+	if (!sorted)
+		goto out;
+
+	for (i = 0, pos = 0; i < n; i++) {
+		e = Add2Ptr(de, off[i]);
+		memcpy(sorted + pos, e, le16_to_cpu(e->size));
+		pos += le16_to_cpu(e->size);
+	}
+
+	memcpy(de, sorted, bytes);
+	err = 0;
+
+out:
+	ntfs_vfree(sorted);
+	ntfs_vfree(min(off, tmp));
+	return err;
+}
+
+struct indx_bulk_lvl {
+	u8 *de; /* packed entries of the level */
+	size_t bytes;
+	size_t nbufs; /* buffers the level is packed into */
+	CLST tail; /* buffer of the level below for the END entry */
+	bool leaf;
+};
+
+/*
+ * indx_bulk_emit
+ *
+ * formats index buffer 'vbn' with given entries and writes it
+ * Does nothing if 'ib' is NULL (layout pass)
+ */
+static int indx_bulk_emit(struct ntfs_index *indx, struct ntfs_inode *ni,
+			  struct INDEX_BUFFER *ib, CLST vbn, const u8 *de,
+			  size_t bytes, bool leaf, __le64 end_vbn)
+{
+	int err;
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	struct ntfs_buffers nb;
+	struct INDEX_HDR *hdr;
+	struct NTFS_DE *e;
+	u32 bsize = 1u << indx->index_bits;
+	u16 fn = (bsize >> SECTOR_SHIFT) + 1;
+	u32 eo = QuadAlign(sizeof(struct INDEX_BUFFER) + fn * sizeof(short));
+
+	if (!ib)
+		return 0;
+
+	memset(ib, 0, bsize);
+	ib->rhdr.sign = NTFS_INDX_SIGNATURE;
+	ib->rhdr.fix_off = cpu_to_le16(sizeof(struct INDEX_BUFFER));
+	ib->rhdr.fix_num = cpu_to_le16(fn);
+	ib->vbn = cpu_to_le64(vbn);
+
+	hdr = &ib->ihdr;
+	hdr->de_off = cpu_to_le32(eo);
+	memcpy(Add2Ptr(hdr, eo), de, bytes);
+
+	e = Add2Ptr(hdr, eo + bytes);
+	if (leaf) {
+		e->size = cpu_to_le16(sizeof(struct NTFS_DE));
+		e->flags = NTFS_IE_LAST;
+	} else {
+		e->size = cpu_to_le16(sizeof(struct NTFS_DE) + sizeof(u64));
+		e->flags = NTFS_IE_LAST | NTFS_IE_HAS_SUBNODES;
+		de_set_vbn_le(e, end_vbn);
+		hdr->flags = 1;
+	}
+
+	hdr->used = cpu_to_le32(eo + bytes + le16_to_cpu(e->size));
+	hdr->total = cpu_to_le32(bsize - offsetof(struct INDEX_BUFFER, ihdr));
+
+	memset(&nb, 0, sizeof(nb));
+	err = ntfs_get_bh(sbi, &indx->alloc_run, (u64)vbn << indx->vbn2vbo_bits,
+			  bsize, &nb);
+	if (err)
+		return err;
+
+	err = ntfs_write_bh(sbi, &ib->rhdr, &nb, 0);
+	nb_put(&nb);
+
+	return err;
+}
+
+/*
+ * indx_bulk_level
+ *
+ * packs entries of level 'lv' into index buffers starting from '*vbn'
+ * Each entry that does not fit goes to the level 'up' as separator
+ * pointing to the buffer just filled
+ */
+static int indx_bulk_level(struct ntfs_index *indx, struct ntfs_inode *ni,
+			   struct indx_bulk_lvl *lv, struct indx_bulk_lvl *up,
+			   CLST *vbn, struct INDEX_BUFFER *ib)
+{
+	int err;
+	u32 bsize = 1u << indx->index_bits;
+	u16 fn = (bsize >> SECTOR_SHIFT) + 1;
+	u32 eo = QuadAlign(sizeof(struct INDEX_BUFFER) + fn * sizeof(short));
+	u32 cap = bsize - offsetof(struct INDEX_BUFFER, ihdr) - eo;
+	u32 end_size = sizeof(struct NTFS_DE) + (lv->leaf ? 0 : sizeof(u64));
+	size_t start = 0, prev = 0, off = 0, sep;
+	u32 used = 0;
+	u16 esize;
+	struct NTFS_DE *e, *se;
+	__le64 end_vbn = 0;
+
+	lv->nbufs = 0;
+	up->bytes = 0;
+	up->leaf = false;
+
+	while (off < lv->bytes) {
+		e = Add2Ptr(lv->de, off);
+		esize = le16_to_cpu(e->size);
+
+		if (!used || used + esize + end_size <= cap) {
+			used += esize;
+			prev = off;
+			off += esize;
+			continue;
+		}
+
+		/* Buffer is full. Do not leave the last buffer empty */
+		sep = off;
+		if (off + esize == lv->bytes && prev != start)
+			sep = prev;
+
+		e = Add2Ptr(lv->de, sep);
+		esize = le16_to_cpu(e->size);
+
+		if (!lv->leaf)
+			end_vbn = de_get_vbn_le(e);
+
+		err = indx_bulk_emit(indx, ni, ib, *vbn, lv->de + start,
+				     sep - start, lv->leaf, end_vbn);
+		if (err)
+			return err;
+
+		/* Separator goes up and points to the buffer just filled */
+		se = Add2Ptr(up->de, up->bytes);
+		memcpy(se, e, esize);
+		if (lv->leaf) {
+			se->size = cpu_to_le16(esize + sizeof(u64));
+			se->flags |= NTFS_IE_HAS_SUBNODES;
+		}
+		de_set_vbn(se, *vbn);
+		up->bytes += le16_to_cpu(se->size);
+
+		lv->nbufs += 1;
+		*vbn += 1u << indx->idx2vbn_bits;
+
+		start = off = sep + esize;
+		used = 0;
+	}
+
+	err = indx_bulk_emit(indx, ni, ib, *vbn, lv->de + start,
+			     lv->bytes - start, lv->leaf,
+			     cpu_to_le64(lv->tail));
+	if (err)
+		return err;
+
+	lv->nbufs += 1;
+	up->tail = *vbn;
+	*vbn += 1u << indx->idx2vbn_bits;
+
+	return 0;
+}
+
+#define INDX_BULK_LEVELS 16
+
+/*
+ * indx_bulk_resize
+ *
+ * sets size of allocation to 'nbufs' buffers and size of bitmap to match
+ */
+static int indx_bulk_resize(struct ntfs_index *indx, struct ntfs_inode *ni,
+			    size_t nbufs, bool grow)
+{
+	int err;
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	const struct INDEX_NAMES *in = &s_index_names[indx->type];
+	u64 data_size = (u64)nbufs << indx->index_bits;
+
+	err = attr_set_size(ni, ATTR_BITMAP, in->name, in->name_len,
+			    &indx->bitmap_run, bitmap_size(nbufs), NULL, grow,
+			    NULL);
+	if (err)
+		return err;
+
+	err = attr_set_size(ni, ATTR_ALLOC, in->name, in->name_len,
+			    &indx->alloc_run, data_size, &data_size, grow, NULL);
+	if (err)
+		return err;
+
+	if (in->name == I30_NAME) {
+		ni->vfs_inode.i_size = data_size;
+		inode_set_bytes(&ni->vfs_inode, ntfs_up_cluster(sbi, data_size));
+	}
+
+	return 0;
+}
+
+/*
+ * indx_bulk_free
+ *
+ * marks buffers [first, first + nbufs) as free
+ */
+static int indx_bulk_free(struct ntfs_index *indx, struct ntfs_inode *ni,
+			  size_t first, size_t nbufs)
+{
+	int err;
+	size_t bit;
+
+	for (bit = first; bit < first + nbufs; bit++) {
+		err = indx_mark_free(indx, ni, bit);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * indx_bulk_write
+ *
+ * writes the tree laid out in 'lvl' into free buffers starting from 'first'
+ * Buffers are marked as used. They are free again on error
+ */
+static int indx_bulk_write(struct ntfs_index *indx, struct ntfs_inode *ni,
+			   struct indx_bulk_lvl *lvl, int depth, size_t first,
+			   size_t nbufs, struct INDEX_BUFFER *ib)
+{
+	int err, i;
+	size_t bit;
+	CLST vbn = (CLST)first << indx->idx2vbn_bits;
+
+	for (bit = first; bit < first + nbufs; bit++) {
+		err = indx_mark_used(indx, ni, bit);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i <= depth; i++) {
+		err = indx_bulk_level(indx, ni, &lvl[i], &lvl[i + 1], &vbn, ib);
+		if (err)
+			goto out;
+	}
+
+	return 0;
+
+out:
+	while (bit-- > first)
+		indx_mark_free(indx, ni, bit);
+	return err;
+}
+
+/*
+ * indx_bulk_root
+ *
+ * replaces all entries of root by END entry pointing to buffer 'vbn'
+ */
+static int indx_bulk_root(struct ntfs_index *indx, struct ntfs_inode *ni,
+			  CLST vbn)
+{
+	struct INDEX_ROOT *root;
+	struct INDEX_HDR *hdr;
+	struct NTFS_DE *e;
+	struct ATTRIB *attr;
+	struct mft_inode *mi;
+	u32 root_size, new_root_size;
+
+	root = indx_get_root(indx, ni, &attr, &mi);
+	if (!root)
+		return -EINVAL;
+
+	root_size = le32_to_cpu(attr->res.data_size);
+	new_root_size = sizeof(struct INDEX_ROOT) + sizeof(struct NTFS_DE) +
+			sizeof(u64);
+
+	if (new_root_size != root_size &&
+	    !mi_resize_attr(mi, attr, new_root_size - root_size)) {
+		return -ENOSPC;
+	}
+
+	e = (struct NTFS_DE *)(root + 1);
+	memset(e, 0, sizeof(struct NTFS_DE));
+	e->size = cpu_to_le16(sizeof(struct NTFS_DE) + sizeof(u64));
+	e->flags = NTFS_IE_HAS_SUBNODES | NTFS_IE_LAST;
+	de_set_vbn(e, vbn);
+
+	hdr = &root->ihdr;
+	hdr->flags = 1;
+	hdr->used = hdr->total =
+		cpu_to_le32(new_root_size - offsetof(struct INDEX_ROOT, ihdr));
+	mi->dirty = true;
+
+	return 0;
+}
+
+/*
+ * indx_bulk_build
+ *
+ * replaces all entries of index by packed array of leaf entries (without
+ * down-pointers). The tree is built bottom-up: entries are sorted, leaf
+ * buffers are filled completely, the separators between them form the
+ * next level and so on up to the single top buffer referenced by root.
+ * New buffers are allocated after the buffers of the current index and
+ * root is switched to them only when all of them are written, so the
+ * current index stays untouched on error. Then the old buffers are freed
+ * and the tree is written once more at the start of allocation if it
+ * fits there, and allocation is truncated
+ * ni_lock is locked
+ */
+int indx_bulk_build(struct ntfs_index *indx, struct ntfs_inode *ni, u8 *de,
+		    size_t bytes, const void *ctx)
+{
+	int err, err2, i, depth;
+	struct ntfs_sb_info *sbi = ni->mi.sbi;
+	const struct INDEX_NAMES *in = &s_index_names[indx->type];
+	struct indx_bulk_lvl lvl[INDX_BULK_LEVELS + 1];
+	struct INDEX_BUFFER *ib = NULL;
+	struct INDEX_ROOT *root;
+	struct INDEX_HDR *hdr;
+	struct NTFS_DE *e;
+	struct ATTRIB *attr;
+	struct mft_inode *mi;
+	size_t n = 0, nbufs, pos, prev = 0, first;
+	CLST vbn;
+	u32 root_size, new_root_size;
+	u16 esize;
+	bool sorted = true, had_alloc;
+
+	/* Check entries and their order */
+	for (pos = 0; pos < bytes; pos += esize) {
+		if (pos + sizeof(struct NTFS_DE) > bytes)
+			return -EINVAL;
+
+		e = Add2Ptr(de, pos);
+		esize = le16_to_cpu(e->size);
+		if (esize < sizeof(struct NTFS_DE) || (esize & 7) ||
+		    pos + esize > bytes ||
+		    sizeof(struct NTFS_DE) + le16_to_cpu(e->key_size) > esize ||
+		    (e->flags & (NTFS_IE_HAS_SUBNODES | NTFS_IE_LAST))) {
+			return -EINVAL;
+		}
+
+		if (n && sorted && indx_bulk_cmp(indx, de, prev, pos, ctx) > 0)
+			sorted = false;
+
+		prev = pos;
+		n += 1;
+	}
+
+	if (!sorted) {
+		err = indx_bulk_sort(indx, de, bytes, n, ctx);
+		if (err)
+			return err;
+	}
+
+	/* Index can't hold two equal keys */
+	for (pos = 0; pos < bytes; prev = pos, pos += esize) {
+		e = Add2Ptr(de, pos);
+		esize = le16_to_cpu(e->size);
+		if (pos && !indx_bulk_cmp(indx, de, prev, pos, ctx))
+			return -EEXIST;
+	}
+
+	/* All buffers of the current index are below 'first' */
+	attr = ni_find_attr(ni, NULL, NULL, ATTR_ALLOC, in->name, in->name_len,
+			    NULL, NULL);
+	had_alloc = attr;
+	first = attr ? le64_to_cpu(attr->nres.data_size) >> indx->index_bits
+		     : 0;
+
+	root = indx_get_root(indx, ni, &attr, &mi);
+	if (!root)
+		return -EINVAL;
+
+	/* Try easy case: all entries fit in root */
+	root_size = le32_to_cpu(attr->res.data_size);
+	new_root_size = sizeof(struct INDEX_ROOT) + bytes +
+			sizeof(struct NTFS_DE);
+	if (le32_to_cpu(mi->mrec->used) + new_root_size <
+		    sbi->max_bytes_per_attr + root_size &&
+	    mi_resize_attr(mi, attr, new_root_size - root_size)) {
+		e = (struct NTFS_DE *)(root + 1);
+		memcpy(e, de, bytes);
+		e = Add2Ptr(e, bytes);
+		memset(e, 0, sizeof(struct NTFS_DE));
+		e->size = cpu_to_le16(sizeof(struct NTFS_DE));
+		e->flags = NTFS_IE_LAST;
+
+		hdr = &root->ihdr;
+		hdr->flags = 0;
+		hdr->used = hdr->total = cpu_to_le32(
+			new_root_size - offsetof(struct INDEX_ROOT, ihdr));
+		mi->dirty = true;
+
+		/* Old buffers are not referenced any more */
+		return had_alloc ? indx_free_alloc(indx, ni) : 0;
+	}
+
+	/* Layout pass: collect separators of each level and count buffers */
+	memset(lvl, 0, sizeof(lvl));
+	lvl[0].de = de;
+	lvl[0].bytes = bytes;
+	lvl[0].leaf = true;
+
+	vbn = 0;
+	nbufs = 0;
+	for (depth = 0;; depth++) {
+		if (depth >= INDX_BULK_LEVELS) {
+			err = -EOPNOTSUPP;
+			goto out;
+		}
+
+		lvl[depth + 1].de = ntfs_vmalloc(lvl[depth].bytes +
+						 lvl[depth].bytes / 2 +
+						 sizeof(u64));
+		if (!lvl[depth + 1].de) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = indx_bulk_level(indx, ni, &lvl[depth], &lvl[depth + 1],
+				      &vbn, NULL);
+		if (err)
+			goto out;
+
+		nbufs += lvl[depth].nbufs;
+		if (lvl[depth].nbufs == 1)
+			break;
+	}
+
+	ib = indx_buf_alloc(1u << indx->index_bits);
+	if (!ib) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* Allocate all new buffers in one step after the current ones */
+	if (!had_alloc) {
+		err = indx_create_allocate(indx, ni, &vbn);
+		if (err)
+			goto out;
+	}
+
+	err = indx_bulk_resize(indx, ni, first + nbufs, true);
+	if (err)
+		goto out1;
+
+	/* Write pass: the same layout, now with buffers */
+	err = indx_bulk_write(indx, ni, lvl, depth, first, nbufs, ib);
+	if (err)
+		goto out1;
+
+	err = indx_bulk_root(indx, ni, lvl[depth + 1].tail);
+	if (err) {
+		indx_bulk_free(indx, ni, first, nbufs);
+		goto out1;
+	}
+
+	/* New index is in use. Release buffers of the old one */
+	indx_drop_names(indx);
+
+	err = indx_bulk_free(indx, ni, 0, first);
+	if (err || nbufs > first)
+		goto out2;
+
+	/*
+	 * Move the tree to the start of allocation.
+	 * Nothing is lost on error: the tree after 'first' is in use
+	 */
+	err = indx_bulk_write(indx, ni, lvl, depth, 0, nbufs, ib);
+	if (err)
+		goto out;
+
+	err = indx_bulk_root(indx, ni, lvl[depth + 1].tail);
+	if (err) {
+		indx_bulk_free(indx, ni, 0, nbufs);
+		goto out;
+	}
+
+	err = indx_bulk_free(indx, ni, first, nbufs);
+	if (err)
+		goto out2;
+
+	err = indx_bulk_resize(indx, ni, nbufs, false);
+	goto out;
+
+out1:
+	/* Old index is in use. Forget the new buffers */
+	if (had_alloc)
+		err2 = indx_bulk_resize(indx, ni, first, false);
+	else
+		err2 = indx_free_alloc(indx, ni);
+	if (err2)
+		ntfs_set_state(sbi, NTFS_DIRTY_ERROR);
+	goto out;
+
+out2:
+	/* Index is fine but some unused buffers are still marked as used */
+	if (err)
+		ntfs_set_state(sbi, NTFS_DIRTY_ERROR);
+
+out:
+	indx_buf_free(ib, 1u << indx->index_bits);
+	for (i = 1; i <= INDX_BULK_LEVELS; i++)
+		ntfs_vfree(lvl[i].de);
+	return err;
+}
+
+/*
+ * indx_compact
+ *
+ * rebuilds index densely: all entries are collected in sorted order
+ * and the index is built again bottom-up (see indx_bulk_build),
+ * unused clusters of allocation are freed.
+ * Index stays as it was if new one can't be built
+ * ni_lock is locked
+ */
+int indx_compact(struct ntfs_index *indx, struct ntfs_inode *ni,
+		 const void *ctx)
+{
+	int err;
+	const struct INDEX_NAMES *in = &s_index_names[indx->type];
+	struct ntfs_fnd *fnd;
+	struct INDEX_ROOT *root;
+	struct NTFS_DE *e = NULL, *ne;
+	u8 *buf = NULL;
+	size_t bytes = 0, allocated = 0;
+	u16 esize;
+
+	/* Index without allocation is already compact */
+	if (!ni_find_attr(ni, NULL, NULL, ATTR_ALLOC, in->name, in->name_len,
+			  NULL, NULL))
+		return 0;
+
+	fnd = fnd_get();
+	if (!fnd)
+		return -ENOMEM;
+
+	root = indx_get_root(indx, ni, NULL, NULL);
+	if (!root) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* Collect all entries without down-pointers */
+	for (;;) {
+		err = indx_find_sort(indx, ni, root, &e, fnd);
+		if (err)
+			goto out;
+
+		if (!e)
+			break;
+
+		esize = le16_to_cpu(e->size);
+		if (de_has_vcn(e))
+			esize -= sizeof(u64);
+
+		if (bytes + esize > allocated) {
+			size_t new_size = max_t(size_t, allocated * 2, 0x10000);
+			u8 *p = ntfs_vmalloc(new_size);
+
+			if (!p) {
+				err = -ENOMEM;
+				goto out;
+			}
+
+			if (buf) {
+				memcpy(p, buf, bytes);
+				ntfs_vfree(buf);
+			}
+			buf = p;
+			allocated = new_size;
+		}
+
+		ne = Add2Ptr(buf, bytes);
+		memcpy(ne, e, esize);
+		ne->flags &= ~NTFS_IE_HAS_SUBNODES;
+		ne->size = cpu_to_le16(esize);
+		bytes += esize;
+	}
+
+	fnd_clear(fnd);
+
+	err = indx_bulk_build(indx, ni, buf, bytes, ctx);
+
+	mark_inode_dirty(&ni->vfs_inode);
+
+out:
+	ntfs_vfree(buf);
+	fnd_put(fnd);
+	return err;
+}
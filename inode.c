@@ -876,6 +876,9 @@ static int ntfs_writepage(struct page *page, struct writeback_control *wbc)
 		err = attr_data_write_resident(ni, page);
 		ni_unlock(ni);
 		if (err != E_NTFS_NONRESIDENT) {
+			/* record is written by write_inode */
+			if (!err)
+				mark_inode_dirty(inode);
 			unlock_page(page);
 			return err;
 		}
@@ -902,6 +905,27 @@ static int ntfs_get_block_write_begin(struct inode *inode, sector_t vbn,
 				  bh_result, create, GET_BLOCK_WRITE_BEGIN);
 }
 
+/*
+ * ntfs_resident_growing
+ *
+ * appending to resident file which is already bigger than attr_size_tr
+ * Such a file (log, mail, ...) usually keeps growing. It is cheaper to move
+ * it out of mft record now than to resize resident data by every append
+ * until it overflows the record
+ */
+static inline bool ntfs_resident_growing(struct inode *inode, loff_t pos,
+					 u32 len)
+{
+	struct ntfs_sb_info *sbi = inode->i_sb->s_fs_info;
+
+	/* new files are written once in most cases. Keep them resident */
+	if (ntfs_i(inode)->ni_flags & NI_FLAG_PACK)
+		return false;
+
+	return pos && pos + len >= inode->i_size &&
+	       inode->i_size > sbi->attr_size_tr;
+}
+
 static int ntfs_write_begin(struct file *file, struct address_space *mapping,
 			    loff_t pos, u32 len, u32 flags, struct page **pagep,
 			    void **fsdata)
@@ -911,6 +935,11 @@ static int ntfs_write_begin(struct file *file, struct address_space *mapping,
 	struct ntfs_inode *ni = ntfs_i(inode);
 
 	*pagep = NULL;
+	if (is_resident(ni) && ntfs_resident_growing(inode, pos, len)) {
+		/* on failure just continue with resident data */
+		attr_force_nonresident(ni);
+	}
+
 	if (is_resident(ni)) {
 		struct page *page = grab_cache_page_write_begin(
 			mapping, pos >> PAGE_SHIFT, flags);
@@ -955,9 +984,17 @@ static int ntfs_write_end(struct file *file, struct address_space *mapping,
 	int err;
 
 	if (is_resident(ni)) {
-		ni_lock(ni);
-		err = attr_data_write_resident(ni, page);
-		ni_unlock(ni);
+		bool pack = ni->ni_flags & NI_FLAG_PACK;
+
+		if (pack) {
+			/* data is copied into record once by ntfs_writepage */
+			ni->i_valid = inode->i_size;
+			err = 0;
+		} else {
+			ni_lock(ni);
+			err = attr_data_write_resident(ni, page);
+			ni_unlock(ni);
+		}
 		if (!err) {
 			dirty = true;
 			/* clear any buffers in page*/
@@ -972,6 +1009,8 @@ static int ntfs_write_end(struct file *file, struct address_space *mapping,
 				} while (head != (bh = bh->b_this_page));
 			}
 			SetPageUptodate(page);
+			if (pack)
+				set_page_dirty(page);
 			err = copied;
 		}
 		unlock_page(page);
@@ -1204,7 +1243,8 @@ struct inode *ntfs_create_inode(
 				struct inode *dir, struct dentry *dentry,
 				const struct cpu_str *uni, umode_t mode,
 				dev_t dev, const char *symname, u32 size,
-				int excl, struct ntfs_fnd *fnd)
+				int excl, struct ntfs_fnd *fnd,
+				struct NTFS_DE *bulk_de)
 {
 	int err;
 	struct super_block *sb = dir->i_sb;
@@ -1282,8 +1322,12 @@ struct inode *ntfs_create_inode(
 	} else if (sbi->options.sparse) {
 		/* sparsed regular file, cause option 'sparse' */
 		fa = FILE_ATTRIBUTE_SPARSE_FILE | FILE_ATTRIBUTE_ARCHIVE;
-	} else if (dir_ni->std_fa & FILE_ATTRIBUTE_COMPRESSED) {
-		/* compressed regular file, if parent is compressed */
+	} else if ((dir_ni->std_fa & FILE_ATTRIBUTE_COMPRESSED) &&
+		   sbi->cluster_size <= ntfs_lznt_max_cluster(sbi)) {
+		/*
+		 * compressed regular file, if parent is compressed
+		 * Files on volumes with too big clusters are not compressed
+		 */
 		fa = FILE_ATTRIBUTE_COMPRESSED | FILE_ATTRIBUTE_ARCHIVE;
 	} else {
 		/* regular file, default attributes */
@@ -1457,6 +1501,21 @@ struct inode *ntfs_create_inode(
 		 */
 		attr->type = ATTR_DATA;
 		attr->id = cpu_to_le16(aid++);
+		if (!(fa & (FILE_ATTRIBUTE_SPARSE_FILE |
+			    FILE_ATTRIBUTE_COMPRESSED))) {
+			/*
+			 * Create empty resident data attribute
+			 * Small files never leave mft record, big files are
+			 * moved out of it by the first write for free
+			 */
+			asize = SIZEOF_RESIDENT;
+			attr->size = cpu_to_le32(SIZEOF_RESIDENT);
+			attr->name_off = SIZEOF_RESIDENT_LE;
+			attr->res.data_off = SIZEOF_RESIDENT_LE;
+			ni->ni_flags |= NI_FLAG_RESIDENT | NI_FLAG_PACK;
+			goto data_created;
+		}
+
 		/* Create empty non resident data attribute */
 		attr->non_res = 1;
 		attr->nres.evcn = cpu_to_le64(-1ll);
@@ -1471,13 +1530,10 @@ struct inode *ntfs_create_inode(
 			attr->flags = ATTR_FLAG_COMPRESSED;
 			attr->nres.c_unit = COMPRESSION_UNIT;
 			asize = SIZEOF_NONRESIDENT_EX + 8;
-		} else {
-			attr->size = cpu_to_le32(SIZEOF_NONRESIDENT + 8);
-			attr->name_off = SIZEOF_NONRESIDENT_LE;
-			asize = SIZEOF_NONRESIDENT + 8;
 		}
 		attr->nres.run_off = attr->name_off;
 	}
+data_created:
 
 	if (is_dir) {
 		ni->ni_flags |= NI_FLAG_DIR;
@@ -1563,10 +1619,18 @@ struct inode *ntfs_create_inode(
 	rec->used = cpu_to_le32(PtrOffset(rec, attr) + 8);
 	rec->next_attr_id = cpu_to_le16(aid);
 
-	/* Step 2: Add new name in index */
-	err = indx_insert_entry(&dir_ni->dir, dir_ni, new_de, sbi, fnd);
-	if (err)
-		goto out6;
+	/*
+	 * Step 2: Add new name in index
+	 * Bulk create inserts all names at once, see ntfs_bulk_create
+	 */
+	if (bulk_de) {
+		memcpy(bulk_de, new_de, le16_to_cpu(new_de->size));
+	} else {
+		err = indx_insert_entry(&dir_ni->dir, dir_ni, new_de, sbi,
+					fnd);
+		if (err)
+			goto out6;
+	}
 
 	/* Update current directory record */
 	mark_inode_dirty(dir);
@@ -1625,6 +1689,8 @@ struct inode *ntfs_create_inode(
 			goto out7;
 	}
 
+	ntfs_usn_log(ni, fname, USN_REASON_FILE_CREATE | USN_REASON_CLOSE);
+
 	/* call 'd_instantiate' after inode->i_op is set but before finish_open */
 	d_instantiate(dentry, inode);
 
@@ -1637,8 +1703,9 @@ struct inode *ntfs_create_inode(
 out7:
 
 	/* undo 'indx_insert_entry' */
-	indx_delete_entry(&dir_ni->dir, dir_ni, new_de + 1,
-			  le16_to_cpu(new_de->key_size), sbi);
+	if (!bulk_de)
+		indx_delete_entry(&dir_ni->dir, dir_ni, new_de + 1,
+				  le16_to_cpu(new_de->key_size), sbi);
 out6:
 	if (rp_inserted)
 		ntfs_remove_reparse(sbi, IO_REPARSE_TAG_SYMLINK, &new_de->ref);
@@ -1731,6 +1798,9 @@ int ntfs_link_inode(struct inode *inode, struct dentry *dentry)
 	le16_add_cpu(&ni->mi.mrec->hard_links, 1);
 	ni->mi.dirty = true;
 
+	ntfs_usn_log(ni, fname,
+		     USN_REASON_HARD_LINK_CHANGE | USN_REASON_CLOSE);
+
 out:
 	__putname(new_de);
 	return err;
@@ -1809,6 +1879,11 @@ int ntfs_unlink_inode(struct inode *dir, const struct dentry *dentry)
 	if (err)
 		goto out3;
 
+	ntfs_usn_log(ni, fname,
+		     (inode->i_nlink > 1 ? USN_REASON_HARD_LINK_CHANGE
+					 : USN_REASON_FILE_DELETE) |
+			     USN_REASON_CLOSE);
+
 	/* Then remove name from mft */
 	ni_remove_attr_le(ni, attr_from_name(fname), le);
 
@@ -1854,12 +1929,371 @@ out1:
 	return err;
 }
 
+/*
+ * ntfs_strip_dos_name
+ *
+ * removes short (8.3) name of 'inode' in directory 'dir'
+ * Long name stays as is (FILE_NAME_UNICODE)
+ */
+static int ntfs_strip_dos_name(struct inode *dir, struct dentry *parent,
+			       struct inode *inode, char *name)
+{
+	int err;
+	struct ntfs_sb_info *sbi = dir->i_sb->s_fs_info;
+	struct ntfs_inode *dir_ni = ntfs_i(dir);
+	struct ntfs_inode *ni = ntfs_i(inode);
+	struct ATTRIB *attr = NULL;
+	struct ATTR_LIST_ENTRY *le = NULL;
+	struct ATTR_FILE_NAME *fname;
+	struct MFT_REF ref;
+	struct dentry *dentry;
+	struct qstr qstr;
+	int name_len = 0;
+
+	mi_get_ref(&dir_ni->mi, &ref);
+
+	ni_lock(ni);
+
+	/* Find short name in directory 'dir' */
+	while ((attr = ni_find_attr(ni, attr, &le, ATTR_NAME, NULL, 0, NULL,
+				    NULL))) {
+		fname = resident_data_ex(attr, SIZEOF_ATTRIBUTE_FILENAME);
+		if (fname && fname->type == FILE_NAME_DOS &&
+		    !memcmp(&fname->home, &ref, sizeof(ref)))
+			break;
+	}
+
+	if (!attr) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	name_len = ntfs_utf16_to_nls(sbi, (struct le_str *)&fname->name_len,
+				     name, PATH_MAX);
+
+	err = indx_delete_entry(&dir_ni->dir, dir_ni, fname,
+				fname_full_size(fname), sbi);
+	if (err)
+		goto out;
+
+	ntfs_usn_log(ni, fname, USN_REASON_HARD_LINK_CHANGE | USN_REASON_CLOSE);
+
+	ni_remove_attr_le(ni, attr, le);
+
+	/* Short name is counted in hard_links but not in i_nlink */
+	le16_add_cpu(&ni->mi.mrec->hard_links, -1);
+	ni->mi.dirty = true;
+	mark_inode_dirty(inode);
+
+out:
+	ni_unlock(ni);
+
+	if (err || name_len <= 0)
+		return err;
+
+	/* Forget dentry cached by lookup of short name */
+	qstr.name = name;
+	qstr.len = name_len;
+	dentry = d_hash_and_lookup(parent, &qstr);
+	if (!IS_ERR_OR_NULL(dentry)) {
+		d_invalidate(dentry);
+		dput(dentry);
+	}
+
+	return 0;
+}
+
+/*
+ * ntfs_strip_dos_names
+ *
+ * removes all short (8.3) names from directory 'dir' and repacks its index
+ * Error of repacking is returned as is: index stays as it was then
+ * inode_lock and ni_lock_dir of 'dir' should be held
+ */
+int ntfs_strip_dos_names(struct inode *dir, struct dentry *parent,
+			 struct ntfs_strip_names *st)
+{
+	int err, err2;
+	struct super_block *sb = dir->i_sb;
+	struct ntfs_sb_info *sbi = sb->s_fs_info;
+	struct ntfs_inode *dir_ni = ntfs_i(dir);
+	struct ntfs_index *indx = &dir_ni->dir;
+	struct ntfs_fnd *fnd;
+	struct INDEX_ROOT *root;
+	struct NTFS_DE *e = NULL;
+	struct ATTR_FILE_NAME *fname;
+	struct MFT_REF *refs = NULL;
+	struct inode *inode;
+	size_t i, count = 0, allocated = 0;
+	char *name = NULL;
+
+	memset(st, 0, sizeof(*st));
+
+	fnd = fnd_get();
+	if (!fnd)
+		return -ENOMEM;
+
+	root = indx_get_root(indx, dir_ni, NULL, NULL);
+	if (!root) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* Collect references of files with short names */
+	for (;;) {
+		err = indx_find_sort(indx, dir_ni, root, &e, fnd);
+		if (err)
+			goto out;
+
+		if (!e)
+			break;
+
+		fname = de_get_fname(e);
+		if (fname->type != FILE_NAME_DOS ||
+		    ntfs_is_meta_file(sbi, ino_get(&e->ref)))
+			continue;
+
+		if (count >= allocated) {
+			size_t new_count = max_t(size_t, allocated * 2, 0x400);
+			struct MFT_REF *p =
+				ntfs_vmalloc(new_count * sizeof(*refs));
+
+			if (!p) {
+				err = -ENOMEM;
+				goto out;
+			}
+
+			if (refs) {
+				memcpy(p, refs, count * sizeof(*refs));
+				ntfs_vfree(refs);
+			}
+			refs = p;
+			allocated = new_count;
+		}
+
+		refs[count++] = e->ref;
+	}
+
+	fnd_clear(fnd);
+
+	if (!count)
+		goto out;
+
+	/* allocate PATH_MAX bytes */
+	name = __getname();
+	if (!name) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/*mark rw ntfs as dirty. it will be cleared at umount*/
+	ntfs_set_state(sbi, NTFS_DIRTY_DIRTY);
+
+	/* Continue on errors */
+	for (i = 0; i < count; i++) {
+		inode = ntfs_iget5(sb, &refs[i], NULL);
+		if (IS_ERR(inode)) {
+			st->failed += 1;
+			continue;
+		}
+
+		err2 = ntfs_strip_dos_name(dir, parent, inode, name);
+		if (err2)
+			st->failed += 1;
+		else
+			st->names += 1;
+
+		iput(inode);
+	}
+
+	if (st->names) {
+		dir->i_mtime = dir->i_ctime = current_time(dir);
+		mark_inode_dirty(dir);
+
+		/*
+		 * Index is half empty now. Pack it again
+		 * indx_compact does not touch index on failure, so
+		 * stripped names are valid whatever it returns
+		 */
+		err = indx_compact(indx, dir_ni, sbi);
+	}
+
+out:
+	if (name)
+		__putname(name);
+	ntfs_vfree(refs);
+	fnd_put(fnd);
+	return err;
+}
+
+/* Max size of user buffer for NTFS3_IOC_BULK_CREATE */
+#define NTFS_BULK_CREATE_MAX (4u << 20)
+
+/*
+ * ntfs_bulk_create
+ *
+ * creates empty files and directories listed in 'req' in empty directory
+ * 'dir'. Names are not inserted one by one but collected and passed to
+ * indx_bulk_build once. On error all new inodes are deleted and 'dir'
+ * stays empty
+ * inode_lock of 'dir' should be held. ni_lock is taken here for each step
+ * because lookup of new names locks 'dir' too
+ */
+int ntfs_bulk_create(struct inode *dir, struct dentry *parent,
+		     struct ntfs_bulk_create_req *req)
+{
+	int err;
+	struct super_block *sb = dir->i_sb;
+	struct ntfs_sb_info *sbi = sb->s_fs_info;
+	struct ntfs_inode *dir_ni = ntfs_i(dir);
+	struct ntfs_bulk_name *bn;
+	struct dentry **dentries = NULL;
+	struct dentry *dentry;
+	struct inode *inode;
+	struct NTFS_DE *e;
+	u8 *buf = NULL, *de = NULL;
+	size_t de_bytes = 0, de_max = 0;
+	u32 i, n = 0, created = 0, off, reclen, name_len;
+	umode_t mode;
+
+	req->count = 0;
+
+	if (!req->buf_len)
+		return 0;
+
+	if (req->buf_len > NTFS_BULK_CREATE_MAX)
+		return -E2BIG;
+
+	buf = ntfs_vmalloc(req->buf_len);
+	if (!buf)
+		return -ENOMEM;
+
+	if (copy_from_user(buf, u64_to_user_ptr(req->buf), req->buf_len)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* Check entries and estimate the size of index entries */
+	for (off = 0; off < req->buf_len; off += reclen) {
+		if (off + sizeof(struct ntfs_bulk_name) > req->buf_len) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		bn = Add2Ptr(buf, off);
+		reclen = bn->reclen;
+		name_len = bn->name_len;
+
+		if (reclen < sizeof(struct ntfs_bulk_name) + name_len ||
+		    (reclen & 7) || off + reclen > req->buf_len || !name_len ||
+		    name_len > NAME_MAX ||
+		    (!S_ISREG(bn->mode) && !S_ISDIR(bn->mode)) ||
+		    memchr(bn->name, '/', name_len) ||
+		    memchr(bn->name, 0, name_len) ||
+		    (bn->name[0] == '.' &&
+		     (name_len == 1 || (name_len == 2 && bn->name[1] == '.')))) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		/* utf16 name is not longer than name in mount's charset */
+		de_max += sizeof(struct NTFS_DE) +
+			  QuadAlign(SIZEOF_ATTRIBUTE_FILENAME +
+				    name_len * sizeof(short));
+		n += 1;
+	}
+
+	de = ntfs_vmalloc(de_max);
+	dentries = ntfs_vmalloc(n * sizeof(*dentries));
+	if (!de || !dentries) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	ni_lock_dir(dir_ni);
+	err = dir_is_empty(dir) ? 0 : -ENOTEMPTY;
+	ni_unlock(dir_ni);
+	if (err)
+		goto out;
+
+	/* Step 1: create records, new names are only copied to 'de' */
+	for (off = 0; off < req->buf_len; off += bn->reclen) {
+		bn = Add2Ptr(buf, off);
+
+		/* Drops cached negative dentry or finds name created above */
+		dentry = lookup_one_len(bn->name, parent, bn->name_len);
+		if (IS_ERR(dentry)) {
+			err = PTR_ERR(dentry);
+			goto undo;
+		}
+
+		if (d_really_is_positive(dentry)) {
+			dput(dentry);
+			err = -EEXIST;
+			goto undo;
+		}
+
+		mode = bn->mode & (S_IFMT | S_IALLUGO);
+		if (!IS_POSIXACL(dir))
+			mode &= ~current_umask();
+
+		e = Add2Ptr(de, de_bytes);
+
+		ni_lock_dir(dir_ni);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		inode = ntfs_create_inode(&init_user_ns, dir, dentry, NULL,
+#else
+		inode = ntfs_create_inode(dir, dentry, NULL,
+#endif
+					  mode, 0, NULL, S_ISDIR(mode) ? -1 : 0,
+					  0, NULL, e);
+		ni_unlock(dir_ni);
+
+		if (IS_ERR(inode)) {
+			dput(dentry);
+			err = PTR_ERR(inode);
+			goto undo;
+		}
+
+		dentries[created++] = dentry;
+		de_bytes += le16_to_cpu(e->size);
+	}
+
+	/* Step 2: insert all names at once */
+	ni_lock_dir(dir_ni);
+	err = indx_bulk_build(&dir_ni->dir, dir_ni, de, de_bytes, sbi);
+	ni_unlock(dir_ni);
+
+	if (!err) {
+		mark_inode_dirty(dir);
+		req->count = created;
+	}
+
+undo:
+	for (i = 0; i < created; i++) {
+		if (err) {
+			/* Name is not in index: delete record in evict */
+			clear_nlink(d_inode(dentries[i]));
+			d_delete(dentries[i]);
+		}
+		dput(dentries[i]);
+	}
+
+out:
+	ntfs_vfree(dentries);
+	ntfs_vfree(de);
+	ntfs_vfree(buf);
+	return err;
+}
+
 void ntfs_evict_inode(struct inode *inode)
 {
 	truncate_inode_pages_final(&inode->i_data);
 
-	if (inode->i_nlink)
+	if (inode->i_nlink) {
+		ntfs_usn_close_file(ntfs_i(inode));
 		_ni_write_inode(inode, inode_needs_sync(inode));
+	}
 
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
@@ -1972,6 +2406,8 @@ static noinline int ntfs_readlink_hlp(struct inode *inode, char *buffer,
 		if (err > buflen)
 			err = buflen;
 		memcpy(buffer, "OneDrive", err);
+		if (err < buflen)
+			buffer[err] = 0;
 		goto out;
 
 	default:
@@ -2024,7 +2460,7 @@ static const char *ntfs_get_link(struct dentry *de, struct inode *inode,
 				 struct delayed_call *done)
 {
 	int err;
-	char *ret;
+	char *ret, *link;
 
 	if (!de)
 		return ERR_PTR(-ECHILD);
@@ -2039,6 +2475,15 @@ static const char *ntfs_get_link(struct dentry *de, struct inode *inode,
 		return ERR_PTR(err);
 	}
 
+	/*
+	 * Keep decoded target. Next walks (rcu too) use i_link and
+	 * do not come here. Reparse point of symlink is never changed
+	 * while inode is alive, i_link is freed in ntfs_i_callback
+	 */
+	link = kmemdup(ret, err + 1, GFP_NOFS);
+	if (link && cmpxchg(&inode->i_link, NULL, link))
+		kfree(link);
+
 	set_delayed_call(done, kfree_link, ret);
 
 	return ret;
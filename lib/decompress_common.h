@@ -323,14 +323,18 @@ static forceinline u8 *lz_copy(u8 *dst, u32 length, u32 offset, const u8 *bufend
 			return end;
 		}
 		/*
-		 * We don't bother with special cases for other 'offset <
-		 * WORDBYTES', which are usually rarer than 'offset == 1'.  Extra
-		 * checks will just slow things down.  Actually, it's possible
-		 * to handle all the 'offset < WORDBYTES' cases using the same
-		 * code, but it still becomes more complicated doesn't seem any
-		 * faster overall; it definitely slows down the more common
-		 * 'offset == 1' case.
+		 * Other 'offset < WORDBYTES' matches: copy a whole word but
+		 * advance by 'offset' only.  The first 'offset' bytes of each
+		 * stored word are already final since they come from bytes
+		 * before 'dst'; the rest are rewritten by the next iteration
+		 * or lie in the slack past 'end' checked above.
 		 */
+		do {
+			copy_unaligned_word(src, dst);
+			src += offset;
+			dst += offset;
+		} while (dst < end);
+		return end;
 	}
 #endif /* FAST_UNALIGNED_ACCESS */
 
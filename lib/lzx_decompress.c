@@ -95,8 +95,8 @@
 #define LZX_NUM_RECENT_OFFSETS		3
 
 /* These values are chosen for fast decompression.  */
-#define LZX_MAINCODE_TABLEBITS		11
-#define LZX_LENCODE_TABLEBITS		10
+#define LZX_MAINCODE_TABLEBITS		12
+#define LZX_LENCODE_TABLEBITS		12
 #define LZX_PRECODE_TABLEBITS		6
 #define LZX_ALIGNEDCODE_TABLEBITS	7
 
@@ -176,6 +176,17 @@ static void undo_e8_translation(void *target, s32 input_pos)
 	}
 }
 
+#ifdef FAST_UNALIGNED_ACCESS
+/* Return nonzero if any byte of the word @v is 0xE8.  */
+static forceinline size_t word_has_e8(size_t v)
+{
+	const size_t ones = repeat_byte(0x01);
+
+	v ^= repeat_byte(0xE8);
+	return (v - ones) & ~v & (ones << 7);
+}
+#endif
+
 /*
  * Undo the 'E8' preprocessing used in LZX.  Before compression, the
  * uncompressed data was preprocessed by changing the targets of suspected x86
@@ -197,6 +208,9 @@ static void lzx_postprocess(u8 *data, u32 size)
 	u8 *tail;
 	u8 saved_bytes[6];
 	u8 *p;
+#ifdef FAST_UNALIGNED_ACCESS
+	const u8 *wend;
+#endif
 
 	if (size <= 10)
 		return;
@@ -205,7 +219,18 @@ static void lzx_postprocess(u8 *data, u32 size)
 	memcpy(saved_bytes, tail, 6);
 	memset(tail, 0xE8, 6);
 	p = data;
+#ifdef FAST_UNALIGNED_ACCESS
+	wend = data + size - WORDBYTES;
+#endif
 	for (;;) {
+#ifdef FAST_UNALIGNED_ACCESS
+		/*
+		 * E8 bytes are rare in most data: skip whole words that
+		 * do not contain one before falling back to the byte scan.
+		 */
+		while (p <= wend && !word_has_e8(get_unaligned((size_t *)p)))
+			p += WORDBYTES;
+#endif
 		while (*p != 0xE8)
 			p++;
 		if (p >= tail)
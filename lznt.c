@@ -8,6 +8,7 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/nls.h>
+#include <linux/workqueue.h>
 
 #include "debug.h"
 #include "ntfs.h"
@@ -303,22 +304,19 @@ struct lznt *get_lznt_ctx(int level)
 }
 
 /*
- * compress_lznt
+ * compress_chunks
  *
- * Compresses "unc" into "cmpr"
- * +x - ok, 'cmpr' contains 'final_compressed_size' bytes of compressed data
- * 0 - input buffer is full zero
+ * Compresses chunks of [unc, unc_end) into [cmpr, cmpr_end)
+ * Returns the size of compressed data or -1 if it does not fit
+ * Clears 'is_zero' if any chunk is not zero
  */
-size_t compress_lznt(const void *unc, size_t unc_size, void *cmpr,
-		     size_t cmpr_size, struct lznt *ctx)
+static ssize_t compress_chunks(const u8 *unc, const u8 *unc_end, u8 *cmpr,
+			       u8 *cmpr_end, struct lznt *ctx, bool *is_zero)
 {
 	int err;
 	size_t (*match)(const u8 *src, struct lznt *ctx);
 	u8 *p = cmpr;
-	u8 *end = p + cmpr_size;
-	const u8 *unc_chunk = unc;
-	const u8 *unc_end = unc_chunk + unc_size;
-	bool is_zero = true;
+	size_t cmpr_size;
 
 	if (ctx->std) {
 		match = &longest_match_std;
@@ -328,23 +326,148 @@ size_t compress_lznt(const void *unc, size_t unc_size, void *cmpr,
 	}
 
 	/* compression cycle */
-	for (; unc_chunk < unc_end; unc_chunk += LZNT_CHUNK_SIZE) {
+	for (; unc < unc_end; unc += LZNT_CHUNK_SIZE) {
 		cmpr_size = 0;
-		err = compress_chunk(match, unc_chunk, unc_end, p, end,
+		err = compress_chunk(match, unc, unc_end, p, cmpr_end,
 				     &cmpr_size, ctx);
 		if (err < 0)
-			return unc_size;
+			return -1;
 
-		if (is_zero && err != LZNT_ERROR_ALL_ZEROS)
-			is_zero = false;
+		if (err != LZNT_ERROR_ALL_ZEROS)
+			*is_zero = false;
 
 		p += cmpr_size;
 	}
 
+	return PtrOffset(cmpr, p);
+}
+
+/*
+ * compress_lznt
+ *
+ * Compresses "unc" into "cmpr"
+ * +x - ok, 'cmpr' contains 'final_compressed_size' bytes of compressed data
+ * 0 - input buffer is full zero
+ */
+size_t compress_lznt(const void *unc, size_t unc_size, void *cmpr,
+		     size_t cmpr_size, struct lznt *ctx)
+{
+	u8 *p;
+	u8 *end = Add2Ptr(cmpr, cmpr_size);
+	bool is_zero = true;
+	ssize_t size = compress_chunks(unc, Add2Ptr(unc, unc_size), cmpr, end,
+				       ctx, &is_zero);
+
+	if (size < 0)
+		return unc_size;
+
+	p = Add2Ptr(cmpr, size);
 	if (p <= end - 2)
 		p[0] = p[1] = 0;
 
-	return is_zero ? 0 : PtrOffset(cmpr, p);
+	return is_zero ? 0 : size;
+}
+
+/* Part of frame compressed by compress_lznt_mt */
+struct lznt_part {
+	struct work_struct work;
+	const u8 *unc;
+	const u8 *unc_end;
+	u8 *cmpr; // slot for compressed data
+	u8 *cmpr_end;
+	struct lznt *ctx;
+	ssize_t size; // size of compressed data or -1
+	bool is_zero;
+};
+
+static void lznt_part_work(struct work_struct *work)
+{
+	struct lznt_part *part = container_of(work, struct lznt_part, work);
+
+	part->size = compress_chunks(part->unc, part->unc_end, part->cmpr,
+				     part->cmpr_end, part->ctx, &part->is_zero);
+}
+
+/*
+ * compress_lznt_mt
+ *
+ * Same as compress_lznt but chunks are compressed by up to 'nctx' threads
+ * Each thread compresses its part of chunks into its own slot of 'cmpr'
+ * Then slots are moved together. Slots require 'cmpr_size' to be at least
+ * 'unc_size' plus two bytes per chunk, else compress_lznt is used
+ */
+size_t compress_lznt_mt(const void *unc, size_t unc_size, void *cmpr,
+			size_t cmpr_size, struct lznt **ctx, u32 nctx)
+{
+	struct lznt_part parts[NTFS_LZNT_PARTS];
+	struct lznt_part *part;
+	size_t chunks = DIV_ROUND_UP(unc_size, LZNT_CHUNK_SIZE);
+	size_t part_size, size;
+	u32 i, nparts;
+	u8 *p;
+	bool is_zero;
+
+	nparts = min_t(u32, nctx, num_online_cpus());
+	/* Don't split frame into parts less than 4 chunks */
+	nparts = min_t(size_t, nparts, chunks / 4);
+	if (nparts > NTFS_LZNT_PARTS)
+		nparts = NTFS_LZNT_PARTS;
+
+	if (nparts <= 1 || cmpr_size < unc_size + chunks * sizeof(short))
+		return compress_lznt(unc, unc_size, cmpr, cmpr_size, ctx[0]);
+
+	part_size = DIV_ROUND_UP(chunks, nparts) * LZNT_CHUNK_SIZE;
+	nparts = DIV_ROUND_UP(unc_size, part_size);
+	p = cmpr;
+
+	for (i = 0; i < nparts; i++) {
+		part = parts + i;
+		part->unc = Add2Ptr(unc, i * part_size);
+		part->unc_end = Add2Ptr(unc, min(unc_size, (i + 1) * part_size));
+		/* slot is big enough to store all chunks uncompressed */
+		part->cmpr = p;
+		p += part->unc_end - part->unc +
+		     DIV_ROUND_UP(part->unc_end - part->unc, LZNT_CHUNK_SIZE) *
+			     sizeof(short);
+		part->cmpr_end = p;
+		part->ctx = ctx[i];
+		part->is_zero = true;
+
+		if (i) {
+			INIT_WORK_ONSTACK(&part->work, lznt_part_work);
+			queue_work(system_unbound_wq, &part->work);
+		}
+	}
+
+	/* the first part is compressed by current thread */
+	lznt_part_work(&parts[0].work);
+
+	for (i = 1; i < nparts; i++) {
+		flush_work(&parts[i].work);
+		destroy_work_on_stack(&parts[i].work);
+	}
+
+	/* move compressed parts together */
+	is_zero = true;
+	for (i = 0, size = 0; i < nparts; i++) {
+		part = parts + i;
+		if (part->size < 0)
+			return unc_size;
+
+		if (i)
+			memmove(Add2Ptr(cmpr, size), part->cmpr, part->size);
+		size += part->size;
+		if (!part->is_zero)
+			is_zero = false;
+	}
+
+	if (size >= unc_size)
+		return unc_size;
+
+	p = Add2Ptr(cmpr, size);
+	p[0] = p[1] = 0;
+
+	return is_zero ? 0 : size;
 }
 
 /*
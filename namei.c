@@ -123,7 +123,7 @@ static int ntfs_create(struct inode *dir,
 #else
 	inode = ntfs_create_inode(dir, dentry, NULL, S_IFREG | mode,
 #endif
-				  0, NULL, 0, excl, NULL);
+				  0, NULL, 0, excl, NULL, NULL);
 
 	ni_unlock(ni);
 
@@ -214,7 +214,7 @@ static int ntfs_symlink(struct inode *dir,
 #else
 	inode = ntfs_create_inode(dir, dentry, NULL, S_IFLNK | 0777,
 #endif
-				  0, symname, size, 0, NULL);
+				  0, symname, size, 0, NULL, NULL);
 
 	ni_unlock(ni);
 
@@ -243,7 +243,7 @@ static int ntfs_mkdir(struct inode *dir,
 #else
 	inode = ntfs_create_inode(dir, dentry, NULL, S_IFDIR | mode,
 #endif
-				  0, NULL, -1, 0, NULL);
+				  0, NULL, -1, 0, NULL, NULL);
 
 	ni_unlock(ni);
 
@@ -459,6 +459,10 @@ static int ntfs_rename(struct inode *old_dir,
 		mark_inode_dirty(old_inode);
 	}
 
+	ntfs_usn_log(old_ni, old_name, USN_REASON_RENAME_OLD_NAME);
+	ntfs_usn_log(old_ni, new_name,
+		     USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE);
+
 	err = 0;
 	/* normal way */
 	goto out2;
@@ -565,7 +569,7 @@ static int ntfs_atomic_open(struct inode *dir, struct dentry *dentry,
 #else
 	inode = ntfs_create_inode(dir, dentry, uni, mode, 0,
 #endif
-				  NULL, 0, excl, fnd);
+				  NULL, 0, excl, fnd, NULL);
 	err = IS_ERR(inode) ? PTR_ERR(inode)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
 			    : finish_open(file, dentry, ntfs_file_open);
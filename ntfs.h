@@ -40,7 +40,10 @@
  */
 //#define CONFIG_NTFS3_64BIT_CLUSTER
 
+/* Windows compresses only volumes with clusters up to 4K */
 #define NTFS_LZNT_MAX_CLUSTER	4096
+/* ntfs3 reads (and with 'compress_big' writes) clusters up to 64K */
+#define NTFS_LZNT_MAX_CLUSTER_EX	0x10000
 #define NTFS_LZNT_CUNIT		4
 #define NTFS_LZNT_CLUSTERS	(1u<<NTFS_LZNT_CUNIT)
 
@@ -173,6 +176,8 @@ extern const __le16 SDH_NAME[4];
 extern const __le16 SO_NAME[2];
 extern const __le16 SQ_NAME[2];
 extern const __le16 SR_NAME[2];
+extern const __le16 J_NAME[2];
+extern const __le16 MAX_NAME[4];
 
 extern const __le16 BAD_NAME[4];
 extern const __le16 SDS_NAME[4];
@@ -954,6 +959,53 @@ struct NTFS_DE_R {
 
 static_assert(sizeof(struct NTFS_DE_R) == 0x20);
 
+/* $Extend\$UsnJrnl:$Max */
+struct USN_JOURNAL_DATA {
+	__le64 MaximumSize;	// 0x00: Target maximum size of $J
+	__le64 AllocationDelta;	// 0x08: Size of allocation/deallocation step
+	__le64 UsnJournalID;	// 0x10: Unique id of current journal instance
+	__le64 LowestValidUsn;	// 0x18: Usn of the first record in $J
+};
+
+static_assert(sizeof(struct USN_JOURNAL_DATA) == 0x20);
+
+/* USN_RECORD_V2::Reason */
+#define USN_REASON_DATA_OVERWRITE	0x00000001
+#define USN_REASON_DATA_EXTEND		0x00000002
+#define USN_REASON_DATA_TRUNCATION	0x00000004
+#define USN_REASON_FILE_CREATE		0x00000100
+#define USN_REASON_FILE_DELETE		0x00000200
+#define USN_REASON_EA_CHANGE		0x00000400
+#define USN_REASON_SECURITY_CHANGE	0x00000800
+#define USN_REASON_RENAME_OLD_NAME	0x00001000
+#define USN_REASON_RENAME_NEW_NAME	0x00002000
+#define USN_REASON_BASIC_INFO_CHANGE	0x00008000
+#define USN_REASON_HARD_LINK_CHANGE	0x00010000
+#define USN_REASON_CLOSE		0x80000000
+
+/* $Extend\$UsnJrnl:$J consists of these records */
+struct USN_RECORD_V2 {
+	__le32 RecordLength;	// 0x00: 8 bytes aligned size of record
+	__le16 MajorVersion;	// 0x04: 2
+	__le16 MinorVersion;	// 0x06: 0
+	struct MFT_REF FileReferenceNumber;	// 0x08:
+	struct MFT_REF ParentFileReferenceNumber;// 0x10:
+	__le64 Usn;		// 0x18: Offset of this record in $J
+	__le64 TimeStamp;	// 0x20: Standard NTFS time
+	__le32 Reason;		// 0x28: USN_REASON_XXX
+	__le32 SourceInfo;	// 0x2C:
+	__le32 SecurityId;	// 0x30:
+	enum FILE_ATTRIBUTE FileAttributes; // 0x34:
+	__le16 FileNameLength;	// 0x38: In bytes
+	__le16 FileNameOffset;	// 0x3A: 0x3C
+	__le16 FileName[];	// 0x3C:
+};
+
+static_assert(offsetof(struct USN_RECORD_V2, FileName) == 0x3C);
+
+/* Records in $J never cross this boundary */
+#define USN_PAGE_SIZE 0x1000
+
 /* CompressReparseBuffer.WofVersion */
 #define WOF_CURRENT_VERSION		cpu_to_le32(1)
 /* CompressReparseBuffer.WofProvider */
@@ -14,6 +14,9 @@
 #define MAXIMUM_BYTES_PER_INDEX		4096
 #define NTFS_BLOCKS_PER_INODE		(MAXIMUM_BYTES_PER_INDEX / 512)
 
+/* Max threads which compress one lznt frame */
+#define NTFS_LZNT_PARTS			4
+
 /* ntfs specific error code when fixup failed*/
 #define E_NTFS_FIXUP			555
 /* ntfs specific error code about resident->nonresident*/
@@ -43,8 +46,120 @@
 #define NI_FLAG_DIR			0x00000040
 #define NI_FLAG_RESIDENT		0x00000080
 #define NI_FLAG_UPDATE_PARENT		0x00000100
+/* New resident file: data is copied into record at writeback only */
+#define NI_FLAG_PACK			0x00000200
+
+/* ntfs3 specific ioctls */
+#define NTFS3_IOC_MAGIC			'N'
+#define NTFS3_IOC_BULKSTAT		_IOWR(NTFS3_IOC_MAGIC, 1, struct ntfs_bulkstat_req)
+#define NTFS3_IOC_READ_USN		_IOWR(NTFS3_IOC_MAGIC, 2, struct ntfs_read_usn_req)
+#define NTFS3_IOC_MFT_STAT		_IOR(NTFS3_IOC_MAGIC, 3, struct ntfs_mft_stat)
+#define NTFS3_IOC_INDEX_STAT		_IOR(NTFS3_IOC_MAGIC, 4, struct ntfs_index_stat)
+#define NTFS3_IOC_COMPACT_INDEX		_IOR(NTFS3_IOC_MAGIC, 5, struct ntfs_index_stat)
+#define NTFS3_IOC_STRIP_SHORT_NAMES	_IOR(NTFS3_IOC_MAGIC, 6, struct ntfs_strip_names)
+#define NTFS3_IOC_BULK_CREATE		_IOWR(NTFS3_IOC_MAGIC, 7, struct ntfs_bulk_create_req)
 // clang-format on
 
+/*
+ * One entry returned by NTFS3_IOC_BULKSTAT
+ * All times are raw nt times (100ns units since 1601)
+ */
+struct ntfs_bulkstat {
+	__u64 ino; // MFT record number
+	__u64 parent; // MFT reference of parent directory (rno | seq << 48)
+	__u64 size; // Size of unnamed data stream
+	__u64 alloc_size; // Size allocated on disk for unnamed data stream
+	__u64 cr_time;
+	__u64 m_time;
+	__u64 c_time;
+	__u64 a_time;
+	__u32 fa; // FILE_ATTRIBUTE_XXX
+	__u16 seq; // Sequence number of MFT record
+	__u16 links; // Number of hard links
+	__u16 reclen; // Size of this entry (8 bytes aligned)
+	__u16 name_len; // Length of 'name' in bytes without trailing zero
+	char name[]; // One of the names converted to mount's charset
+};
+
+/* Argument of NTFS3_IOC_BULKSTAT */
+struct ntfs_bulkstat_req {
+	__u64 start; // in: first record to scan. out: first record to scan next time
+	__u64 buf; // user buffer for 'struct ntfs_bulkstat' entries
+	__u32 buf_len; // size of user buffer
+	__u32 count; // out: number of entries returned
+};
+
+/*
+ * Argument of NTFS3_IOC_READ_USN
+ * Returns whole USN_RECORD_V2 records from $Extend\$UsnJrnl:$J
+ */
+struct ntfs_read_usn_req {
+	__u64 start_usn; // in: first usn to read. out: usn to read next time
+	__u64 journal_id; // out: UsnJournalID from $UsnJrnl:$Max, changed
+			  // when records are lost
+	__u64 buf; // user buffer for records
+	__u32 buf_len; // size of user buffer
+	__u32 bytes; // out: number of bytes returned
+};
+
+/* Returned by NTFS3_IOC_MFT_STAT */
+struct ntfs_mft_stat {
+	__u64 records; // Total records in $MFT
+	__u64 used; // Records in use
+	__u64 runs; // Fragments of $MFT::DATA
+	__u64 zone_lcn; // MFT zone: clusters reserved for $MFT growth
+	__u64 zone_len;
+	__u64 extends; // Number of $MFT extensions since mount
+	__u32 extend_chunk; // Records added by the last extension
+	__u32 reserved;
+};
+
+/*
+ * Returned by NTFS3_IOC_INDEX_STAT and NTFS3_IOC_COMPACT_INDEX for directory
+ * Fill factor of index is bytes_used / bytes_total
+ */
+struct ntfs_index_stat {
+	__u64 entries; // Entries in root and buffers (without END entries)
+	__u64 buffers; // Index buffers in use
+	__u64 bytes_used; // Sum of used bytes of buffers
+	__u64 bytes_total; // Sum of available bytes of buffers
+	__u32 buffer_size; // Size of one index buffer
+	__u32 reserved;
+};
+
+/* Returned by NTFS3_IOC_STRIP_SHORT_NAMES for directory */
+struct ntfs_strip_names {
+	__u64 names; // Short (8.3) names removed
+	__u64 failed; // Short names that could not be removed
+	__u64 reserved[2];
+};
+
+/* One entry of NTFS3_IOC_BULK_CREATE */
+struct ntfs_bulk_name {
+	__u32 mode; // S_IFREG or S_IFDIR and permissions
+	__u16 reclen; // Size of this entry (8 bytes aligned)
+	__u16 name_len; // Length of 'name' in bytes without trailing zero
+	char name[]; // Name in mount's charset
+};
+
+/*
+ * Argument of NTFS3_IOC_BULK_CREATE
+ * Creates empty files and directories in empty directory and builds
+ * its index once instead of inserting names one by one
+ */
+struct ntfs_bulk_create_req {
+	__u64 buf; // user buffer with 'struct ntfs_bulk_name' entries
+	__u32 buf_len; // size of user buffer
+	__u32 count; // out: number of created entries
+};
+
+/* Values of mount option 'alloc=' */
+enum NTFS_ALLOC_POLICY {
+	NTFS_ALLOC_AUTO = 0, // by rotational flag of device
+	NTFS_ALLOC_FIRST_FIT = 1, // ssd: first free extent after hint
+	NTFS_ALLOC_BEST_FIT = 2, // hdd: smallest free extent that fits
+};
+
 struct ntfs_mount_options {
 	struct nls_table *nls;
 
@@ -64,7 +179,9 @@ struct ntfs_mount_options {
 		nohidden : 1, /*do not show hidden files*/
 		force : 1, /*rw mount dirty volume*/
 		no_acs_rules : 1, /*exclude acs rules*/
-		prealloc : 1 /*preallocate space when file is growing*/
+		prealloc : 1, /*preallocate space when file is growing*/
+		compress_big : 1, /*compress files on clusters up to 64K*/
+		alloc : 2 /*enum NTFS_ALLOC_POLICY*/
 		;
 };
 
@@ -157,10 +274,41 @@ struct ntfs_index {
 	u8 idx2vbn_bits; // log2(root->index_block_clst)
 	u8 vbn2vbo_bits; // index_block_size < cluster? 9 : cluster_bits
 	u8 type; // index_mutex_classed
+
+	/* Modified index buffer kept in memory until writeback */
+	struct indx_node *wb;
+	spinlock_t wb_lock; // protects 'wb', 'names' and 'names_gen'
+	struct ntfs_sb_info *sbi;
+
+	/* Converted names of directory (see ntfs_readdir) */
+	struct ntfs_dir_names *names;
+	u32 names_gen; // incremented on each change of index
+};
+
+/* Table of converted names of directory */
+struct ntfs_dir_names {
+	atomic_t refs;
+	u32 bytes; // used bytes of 'data'
+	u32 allocated; // size of 'data'
+	u32 gen; // generation of index the table is built for
+	u64 end; // table being built has all names before this position
+	u8 data[]; // struct ntfs_dir_name
+};
+
+struct ntfs_dir_name {
+	u64 pos; // position of entry for readdir
+	u64 ino;
+	u16 len; // bytes in name
+	u8 type; // DT_XXX
+	char name[];
 };
 
 /* Minimum mft zone */
 #define NTFS_MIN_MFT_ZONE 100
+/* Max records added by one extension of MFT */
+#define NTFS_MFT_CHUNK_MAX (64 * 1024)
+/* MFT extended faster than this grows by bigger chunks */
+#define NTFS_MFT_FAST_EXTEND (10 * HZ)
 
 /* ntfs file system in-core superblock data */
 struct ntfs_sb_info {
@@ -222,11 +370,22 @@ struct ntfs_sb_info {
 		u32 recs_mirr; // Number of records in MFTMirr
 		u8 next_reserved;
 		u8 reserved_bitmap_inited;
+		u32 extend_chunk; // records added by the last extension
+		unsigned long extend_time; // jiffies of the last extension
+		u64 extends; // number of extensions since mount
+		/*
+		 * Flat translation array of $MFT::DATA (see run_build_map)
+		 * Protected by mft.ni->file.run_lock as run itself
+		 */
+		u32 *run_map;
+		size_t run_map_len;
+		u8 run_map_shift;
 	} mft;
 
 	struct {
 		struct wnd_bitmap bitmap; // $Bitmap::Data
 		CLST next_free_lcn;
+		size_t find_flags; // BITMAP_FIND_XXX_FIT of allocation policy
 	} used;
 
 	struct {
@@ -262,9 +421,29 @@ struct ntfs_sb_info {
 		struct ntfs_inode *ni;
 	} objid;
 
+	struct {
+		struct ntfs_inode *ni; // $UsnJrnl, $J is in ni->file.run
+		struct mutex mtx; // protects buffers of records and loss state
+		struct mutex wmtx; // serializes writers of $J, protects pending
+		struct delayed_work work; // writes buffered records
+		u64 journal_id;
+		u64 max_size; // $Max: MaximumSize
+		u64 delta; // $Max: AllocationDelta (aligned)
+		u64 lowest; // $Max: LowestValidUsn, $J is purged up to it
+		u64 next_usn; // usn of the next record
+		u64 disk_usn; // $J is written up to this usn
+		struct ntfs_usn_chunk *cur; // chunk being filled
+		struct list_head full; // filled chunks, not taken by writer yet
+		struct list_head pending; // chunks being written or failed
+		u32 chunks; // allocated chunks
+		u64 lost; // records not logged 'cause all chunks were in use
+		u64 reset_usn; // usn of the first record after the last loss
+		bool reset; // records were lost, journal id should be changed
+	} usn;
+
 	struct {
 		struct mutex mtx_lznt;
-		struct lznt *lznt;
+		struct lznt *lznt[NTFS_LZNT_PARTS]; // one per thread
 #ifdef CONFIG_NTFS3_LZX_XPRESS
 		struct mutex mtx_xpress;
 		struct xpress_decompressor *xpress;
@@ -285,10 +464,20 @@ struct mft_inode {
 	struct ntfs_sb_info *sbi;
 
 	struct MFT_REC *mrec;
-	struct ntfs_buffers nb;
+	/* Buffers of record. Pinned only while record is written */
+	struct ntfs_buffers *nb;
 
 	CLST rno;
 	bool dirty;
+	bool is_mft;
+};
+
+/* attribute list of inode. Allocated on demand */
+struct ntfs_attr_list {
+	struct runs_tree run;
+	struct ATTR_LIST_ENTRY *le; // 1K aligned memory
+	size_t size;
+	bool dirty;
 };
 
 /* nested class for ntfs_inode::ni_lock */
@@ -297,6 +486,7 @@ enum ntfs_inode_mutex_lock_class {
 	NTFS_INODE_MUTEX_SECURITY,
 	NTFS_INODE_MUTEX_OBJID,
 	NTFS_INODE_MUTEX_REPARSE,
+	NTFS_INODE_MUTEX_USNJRNL,
 	NTFS_INODE_MUTEX_NORMAL,
 	NTFS_INODE_MUTEX_PARENT,
 };
@@ -340,18 +530,17 @@ struct ntfs_inode {
 			struct runs_tree run;
 #ifdef CONFIG_NTFS3_LZX_XPRESS
 			struct page *offs_page;
+			/* all runs of WofCompressedData. Loaded on demand */
+			struct runs_tree *wof_run;
 #endif
 		} file;
 	};
 
-	struct {
-		struct runs_tree run;
-		struct ATTR_LIST_ENTRY *le; // 1K aligned memory
-		size_t size;
-		bool dirty;
-	} attr_list;
+	/* NULL if inode has no attribute list */
+	struct ntfs_attr_list *attr_list;
 
 	size_t ni_flags; // NI_FLAG_XXX
+	u32 usn_reasons; // USN_REASON_XXX logged since last close
 
 	struct inode vfs_inode;
 };
@@ -359,6 +548,9 @@ struct ntfs_inode {
 struct indx_node {
 	struct ntfs_buffers nb;
 	struct INDEX_BUFFER *index;
+	struct ntfs_index *indx;
+	CLST vbn;
+	bool dirty; // modified but not written into buffers yet
 };
 
 struct ntfs_fnd {
@@ -386,10 +578,14 @@ int attr_make_nonresident(struct ntfs_inode *ni, struct ATTRIB *attr,
 			  struct ATTR_LIST_ENTRY *le, struct mft_inode *mi,
 			  u64 new_size, struct runs_tree *run,
 			  struct ATTRIB **ins_attr, struct page *page);
+int attr_force_nonresident(struct ntfs_inode *ni);
 int attr_set_size(struct ntfs_inode *ni, enum ATTR_TYPE type,
 		  const __le16 *name, u8 name_len, struct runs_tree *run,
 		  u64 new_size, const u64 *new_valid, bool keep_prealloc,
 		  struct ATTRIB **ret);
+int attr_data_get_block_locked(struct ntfs_inode *ni, const __le16 *name,
+			       u8 name_len, struct runs_tree *run, CLST vcn,
+			       CLST clen, CLST *lcn, CLST *len, bool *new);
 int attr_data_get_block(struct ntfs_inode *ni, CLST vcn, CLST clen, CLST *lcn,
 			CLST *len, bool *new);
 int attr_data_read_resident(struct ntfs_inode *ni, struct page *page);
@@ -401,14 +597,15 @@ int attr_load_runs_range(struct ntfs_inode *ni, enum ATTR_TYPE type,
 			 const __le16 *name, u8 name_len, struct runs_tree *run,
 			 u64 from, u64 to);
 int attr_wof_frame_info(struct ntfs_inode *ni, struct ATTRIB *attr,
-			struct runs_tree *run, u64 frame, u64 frames,
-			u8 frame_bits, u32 *ondisk_size, u64 *vbo_data);
+			u64 frame, u64 frames, u8 frame_bits, u32 *ondisk_size,
+			u64 *vbo_data);
 int attr_is_frame_compressed(struct ntfs_inode *ni, struct ATTRIB *attr,
 			     CLST frame, CLST *clst_data);
 int attr_allocate_frame(struct ntfs_inode *ni, CLST frame, size_t compr_size,
 			u64 new_valid);
 int attr_collapse_range(struct ntfs_inode *ni, u64 vbo, u64 bytes);
-int attr_punch_hole(struct ntfs_inode *ni, u64 vbo, u64 bytes);
+int attr_punch_hole(struct ntfs_inode *ni, const __le16 *name, u8 name_len,
+		    u64 vbo, u64 bytes);
 
 /* functions from attrlist.c*/
 void al_destroy(struct ntfs_inode *ni);
@@ -472,6 +669,10 @@ int ntfs3_setattr(struct dentry *dentry,
 #endif
 		  struct iattr *attr);
 int ntfs_file_open(struct inode *inode, struct file *file);
+long ntfs_ioctl(struct file *filp, u32 cmd, unsigned long arg);
+#ifdef CONFIG_COMPAT
+long ntfs_compat_ioctl(struct file *filp, u32 cmd, unsigned long arg);
+#endif
 int ntfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		__u64 start, __u64 len);
 extern const struct inode_operations ntfs_special_inode_operations;
@@ -479,6 +680,8 @@ extern const struct inode_operations ntfs_file_inode_operations;
 extern const struct file_operations ntfs_file_operations;
 
 /* globals from frecord.c */
+int __init ntfs3_init_frame_bufs(void);
+void ntfs3_exit_frame_bufs(void);
 void ni_remove_mi(struct ntfs_inode *ni, struct mft_inode *mi);
 struct ATTR_STD_INFO *ni_std(struct ntfs_inode *ni);
 struct ATTR_STD_INFO5 *ni_std5(struct ntfs_inode *ni);
@@ -530,6 +733,8 @@ int ni_fiemap(struct ntfs_inode *ni, struct fiemap_extent_info *fieinfo,
 	      __u64 vbo, __u64 len);
 int ni_readpage_cmpr(struct ntfs_inode *ni, struct page *page);
 int ni_decompress_file(struct ntfs_inode *ni);
+int ni_read_frames(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
+		   u32 pages_per_frame, u32 nframes);
 int ni_read_frame(struct ntfs_inode *ni, u64 frame_vbo, struct page **pages,
 		  u32 pages_per_frame);
 int ni_write_frame(struct ntfs_inode *ni, struct page **pages,
@@ -549,11 +754,16 @@ const struct ATTR_DEF_ENTRY *ntfs_query_def(struct ntfs_sb_info *sbi,
 int ntfs_look_for_free_space(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
 			     CLST *new_lcn, CLST *new_len,
 			     enum ALLOCATE_OPT opt);
+int ntfs_look_for_free_extents(struct ntfs_sb_info *sbi, CLST lcn, CLST len,
+			       CLST pre, struct ntfs_run *ext, size_t *count,
+			       enum ALLOCATE_OPT opt);
 int ntfs_look_free_mft(struct ntfs_sb_info *sbi, CLST *rno, bool mft,
 		       struct ntfs_inode *ni, struct mft_inode **mi);
 void ntfs_mark_rec_free(struct ntfs_sb_info *sbi, CLST rno);
 int ntfs_clear_mft_tail(struct ntfs_sb_info *sbi, size_t from, size_t to);
 int ntfs_refresh_zone(struct ntfs_sb_info *sbi);
+void ntfs_refresh_mft_map(struct ntfs_sb_info *sbi);
+int ntfs_mft_stat(struct ntfs_sb_info *sbi, struct ntfs_mft_stat *st);
 int ntfs_update_mftmirr(struct ntfs_sb_info *sbi, int wait);
 enum NTFS_DIRTY_FLAGS {
 	NTFS_DIRTY_CLEAR = 0,
@@ -577,6 +787,9 @@ int ntfs_get_bh(struct ntfs_sb_info *sbi, const struct runs_tree *run, u64 vbo,
 		u32 bytes, struct ntfs_buffers *nb);
 int ntfs_write_bh(struct ntfs_sb_info *sbi, struct NTFS_RECORD_HEADER *rhdr,
 		  struct ntfs_buffers *nb, int sync);
+int ntfs_bio_pages_start(struct ntfs_sb_info *sbi, const struct runs_tree *run,
+			 struct page **pages, u32 nr_pages, u64 vbo, u32 bytes,
+			 u32 op, struct bio **last);
 int ntfs_bio_pages(struct ntfs_sb_info *sbi, const struct runs_tree *run,
 		   struct page **pages, u32 nr_pages, u64 vbo, u32 bytes,
 		   u32 op);
@@ -601,30 +814,44 @@ int ntfs_insert_reparse(struct ntfs_sb_info *sbi, __le32 rtag,
 			const struct MFT_REF *ref);
 int ntfs_remove_reparse(struct ntfs_sb_info *sbi, __le32 rtag,
 			const struct MFT_REF *ref);
+int ntfs_mft_bulkstat(struct ntfs_sb_info *sbi, struct ntfs_bulkstat_req *req);
+int ntfs_usn_init(struct ntfs_sb_info *sbi, struct inode *inode);
+int ntfs_usn_flush(struct ntfs_sb_info *sbi);
+void ntfs_usn_close(struct ntfs_sb_info *sbi);
+void ntfs_usn_log(struct ntfs_inode *ni, const struct ATTR_FILE_NAME *fname,
+		  u32 reason);
+void ntfs_usn_change(struct ntfs_inode *ni, u32 reason);
+void ntfs_usn_close_file(struct ntfs_inode *ni);
+int ntfs_usn_read(struct ntfs_sb_info *sbi, struct ntfs_read_usn_req *req);
 void mark_as_free_ex(struct ntfs_sb_info *sbi, CLST lcn, CLST len, bool trim);
 int run_deallocate(struct ntfs_sb_info *sbi, struct runs_tree *run, bool trim);
 
 /* globals from index.c */
+int __init ntfs3_init_index(void);
+void ntfs3_exit_index(void);
 int indx_used_bit(struct ntfs_index *indx, struct ntfs_inode *ni, size_t *bit);
 void fnd_clear(struct ntfs_fnd *fnd);
-static inline struct ntfs_fnd *fnd_get(void)
-{
-	return ntfs_zalloc(sizeof(struct ntfs_fnd));
-}
-static inline void fnd_put(struct ntfs_fnd *fnd)
-{
-	if (fnd) {
-		fnd_clear(fnd);
-		ntfs_free(fnd);
-	}
-}
+struct ntfs_fnd *fnd_get(void);
+void fnd_put(struct ntfs_fnd *fnd);
+void put_indx_node(struct indx_node *in);
 void indx_clear(struct ntfs_index *idx);
+int indx_flush(struct ntfs_index *indx, int sync);
+void indx_drop(struct ntfs_index *indx);
+struct ntfs_dir_names *indx_alloc_names(u32 bytes);
+struct ntfs_dir_names *indx_get_names(struct ntfs_index *indx, u32 *gen);
+void indx_put_names(struct ntfs_dir_names *names);
+bool indx_set_names(struct ntfs_index *indx, struct ntfs_dir_names *names,
+		    u32 gen);
+void indx_drop_names(struct ntfs_index *indx);
+void indx_put_dirty(struct indx_node *in);
 int indx_init(struct ntfs_index *indx, struct ntfs_sb_info *sbi,
 	      const struct ATTRIB *attr, enum index_mutex_classed type);
 struct INDEX_ROOT *indx_get_root(struct ntfs_index *indx, struct ntfs_inode *ni,
 				 struct ATTRIB **attr, struct mft_inode **mi);
 int indx_read(struct ntfs_index *idx, struct ntfs_inode *ni, CLST vbn,
 	      struct indx_node **node);
+int indx_read_shared(struct ntfs_index *indx, struct ntfs_inode *ni, CLST vbn,
+		     struct indx_node **node);
 int indx_find(struct ntfs_index *indx, struct ntfs_inode *dir,
 	      const struct INDEX_ROOT *root, const void *Key, size_t KeyLen,
 	      const void *param, int *diff, struct NTFS_DE **entry,
@@ -643,6 +870,12 @@ int indx_delete_entry(struct ntfs_index *indx, struct ntfs_inode *ni,
 int indx_update_dup(struct ntfs_inode *ni, struct ntfs_sb_info *sbi,
 		    const struct ATTR_FILE_NAME *fname,
 		    const struct NTFS_DUP_INFO *dup, int sync);
+int indx_stat(struct ntfs_index *indx, struct ntfs_inode *ni,
+	      struct ntfs_index_stat *st);
+int indx_bulk_build(struct ntfs_index *indx, struct ntfs_inode *ni, u8 *de,
+		    size_t bytes, const void *ctx);
+int indx_compact(struct ntfs_index *indx, struct ntfs_inode *ni,
+		 const void *ctx);
 
 /* globals from inode.c */
 struct inode *ntfs_iget5(struct super_block *sb, const struct MFT_REF *ref,
@@ -664,9 +897,14 @@ struct inode *ntfs_create_inode(
 				struct inode *dir, struct dentry *dentry,
 				const struct cpu_str *uni, umode_t mode,
 				dev_t dev, const char *symname, u32 size,
-				int excl, struct ntfs_fnd *fnd);
+				int excl, struct ntfs_fnd *fnd,
+				struct NTFS_DE *bulk_de);
 int ntfs_link_inode(struct inode *inode, struct dentry *dentry);
 int ntfs_unlink_inode(struct inode *dir, const struct dentry *dentry);
+int ntfs_strip_dos_names(struct inode *dir, struct dentry *parent,
+			 struct ntfs_strip_names *st);
+int ntfs_bulk_create(struct inode *dir, struct dentry *parent,
+		     struct ntfs_bulk_create_req *req);
 void ntfs_evict_inode(struct inode *inode);
 extern const struct inode_operations ntfs_link_inode_operations;
 extern const struct address_space_operations ntfs_aops;
@@ -736,10 +974,16 @@ static inline void mi_get_ref(const struct mft_inode *mi, struct MFT_REF *ref)
 /* globals from run.c */
 bool run_lookup_entry(const struct runs_tree *run, CLST vcn, CLST *lcn,
 		      CLST *len, size_t *index);
+u32 *run_build_map(const struct runs_tree *run, u8 shift, size_t *entries);
+bool run_lookup_map(const struct runs_tree *run, const u32 *map,
+		    size_t entries, u8 shift, CLST vcn, CLST *lcn, CLST *len,
+		    size_t *index);
 void run_truncate(struct runs_tree *run, CLST vcn);
 void run_truncate_head(struct runs_tree *run, CLST vcn);
 void run_truncate_around(struct runs_tree *run, CLST vcn);
 bool run_lookup(const struct runs_tree *run, CLST vcn, size_t *Index);
+bool run_add_entries(struct runs_tree *run, CLST vcn,
+		     const struct ntfs_run *ext, size_t count, bool is_mft);
 bool run_add_entry(struct runs_tree *run, CLST vcn, CLST lcn, CLST len,
 		   bool is_mft);
 bool run_collapse_range(struct runs_tree *run, CLST vcn, CLST len);
@@ -785,6 +1029,10 @@ bool wnd_is_used(struct wnd_bitmap *wnd, size_t bit, size_t bits);
 /* Possible values for 'flags' 'wnd_find' */
 #define BITMAP_FIND_MARK_AS_USED 0x01
 #define BITMAP_FIND_FULL 0x02
+/* first free extent after hint which fits request (ssd) */
+#define BITMAP_FIND_FIRST_FIT 0x04
+/* smallest free extent which fits request (hdd) */
+#define BITMAP_FIND_BEST_FIT 0x08
 size_t wnd_find(struct wnd_bitmap *wnd, size_t to_alloc, size_t hint,
 		size_t flags, size_t *allocated);
 int wnd_extend(struct wnd_bitmap *wnd, size_t new_bits);
@@ -833,6 +1081,9 @@ struct lznt *get_lznt_ctx(int level);
 size_t compress_lznt(const void *uncompressed, size_t uncompressed_size,
 		     void *compressed, size_t compressed_size,
 		     struct lznt *ctx);
+size_t compress_lznt_mt(const void *uncompressed, size_t uncompressed_size,
+			void *compressed, size_t compressed_size,
+			struct lznt **ctx, u32 nctx);
 ssize_t decompress_lznt(const void *compressed, size_t compressed_size,
 			void *uncompressed, size_t uncompressed_size);
 
@@ -847,6 +1098,16 @@ static inline bool is_mounted(struct ntfs_sb_info *sbi)
 	return !!sbi->sb->s_root;
 }
 
+/*
+ * Windows compresses only volumes with clusters up to 4K
+ * Bigger clusters (up to 64K) are compressed if asked by mount option
+ */
+static inline u32 ntfs_lznt_max_cluster(const struct ntfs_sb_info *sbi)
+{
+	return sbi->options.compress_big ? NTFS_LZNT_MAX_CLUSTER_EX
+					 : NTFS_LZNT_MAX_CLUSTER;
+}
+
 static inline bool ntfs_is_meta_file(struct ntfs_sb_info *sbi, CLST rno)
 {
 	return rno < MFT_REC_FREE || rno == sbi->objid_no ||
@@ -1063,19 +1324,19 @@ static inline void nb_put(struct ntfs_buffers *nb)
 	nb->nbufs = 0;
 }
 
-static inline void put_indx_node(struct indx_node *in)
+static inline void mi_put_bh(struct mft_inode *mi)
 {
-	if (!in)
+	if (!mi->nb)
 		return;
 
-	ntfs_free(in->index);
-	nb_put(&in->nb);
-	ntfs_free(in);
+	nb_put(mi->nb);
+	ntfs_free(mi->nb);
+	mi->nb = NULL;
 }
 
 static inline void mi_clear(struct mft_inode *mi)
 {
-	nb_put(&mi->nb);
+	mi_put_bh(mi);
 	ntfs_free(mi->mrec);
 	mi->mrec = NULL;
 }
@@ -114,6 +114,43 @@ int mi_init(struct mft_inode *mi, struct ntfs_sb_info *sbi, CLST rno)
 	return 0;
 }
 
+/*
+ * mi_get_bh
+ *
+ * pins buffers of record to write it
+ */
+static int mi_get_bh(struct mft_inode *mi)
+{
+	int err;
+	struct ntfs_sb_info *sbi = mi->sbi;
+	struct ntfs_inode *ni = sbi->mft.ni;
+	bool lock = false;
+
+	if (!mi->nb) {
+		mi->nb = ntfs_zalloc(sizeof(struct ntfs_buffers));
+		if (!mi->nb)
+			return -ENOMEM;
+	}
+
+	if (mi->nb->nbufs)
+		return 0;
+
+	if (!ni)
+		return -EINVAL;
+
+	if (is_mounted(sbi) && !mi->is_mft) {
+		down_read(&ni->file.run_lock);
+		lock = true;
+	}
+
+	err = ntfs_get_bh(sbi, &ni->file.run, (u64)mi->rno << sbi->record_bits,
+			  sbi->record_size, mi->nb);
+	if (lock)
+		up_read(&ni->file.run_lock);
+
+	return err;
+}
+
 /*
  * mi_read
  *
@@ -129,15 +166,29 @@ int mi_read(struct mft_inode *mi, bool is_mft)
 	struct ntfs_inode *mft_ni = sbi->mft.ni;
 	struct runs_tree *run = mft_ni ? &mft_ni->file.run : NULL;
 	struct rw_semaphore *rw_lock = NULL;
+	struct ntfs_buffers *nb = NULL;
+
+	mi->is_mft = is_mft;
 
 	if (is_mounted(sbi)) {
 		if (!is_mft) {
 			rw_lock = &mft_ni->file.run_lock;
 			down_read(rw_lock);
 		}
+	} else {
+		/*
+		 * Records read while mounting keep buffers pinned.
+		 * Other records get them in mi_write
+		 */
+		if (!mi->nb) {
+			mi->nb = ntfs_zalloc(sizeof(struct ntfs_buffers));
+			if (!mi->nb)
+				return -ENOMEM;
+		}
+		nb = mi->nb;
 	}
 
-	err = ntfs_read_bh(sbi, run, vbo, &rec->rhdr, bpr, &mi->nb);
+	err = ntfs_read_bh(sbi, run, vbo, &rec->rhdr, bpr, nb);
 	if (rw_lock)
 		up_read(rw_lock);
 	if (!err)
@@ -157,6 +208,8 @@ int mi_read(struct mft_inode *mi, bool is_mft)
 	}
 	err = attr_load_runs_vcn(mft_ni, ATTR_DATA, NULL, 0, &mft_ni->file.run,
 				 vbo >> sbi->cluster_bits);
+	if (!err)
+		ntfs_refresh_mft_map(sbi);
 	if (rw_lock) {
 		up_write(rw_lock);
 		ni_unlock(mft_ni);
@@ -166,7 +219,7 @@ int mi_read(struct mft_inode *mi, bool is_mft)
 
 	if (rw_lock)
 		down_read(rw_lock);
-	err = ntfs_read_bh(sbi, run, vbo, &rec->rhdr, bpr, &mi->nb);
+	err = ntfs_read_bh(sbi, run, vbo, &rec->rhdr, bpr, nb);
 	if (rw_lock)
 		up_read(rw_lock);
 
@@ -337,7 +390,16 @@ int mi_write(struct mft_inode *mi, int wait)
 	sbi = mi->sbi;
 	rec = mi->mrec;
 
-	err = ntfs_write_bh(sbi, &rec->rhdr, &mi->nb, wait);
+	err = mi_get_bh(mi);
+	if (err)
+		return err;
+
+	err = ntfs_write_bh(sbi, &rec->rhdr, mi->nb, wait);
+
+	/* Buffers are dirty in cache. Don't pin them by clean record */
+	if (is_mounted(sbi))
+		mi_put_bh(mi);
+
 	if (err)
 		return err;
 
@@ -355,7 +417,6 @@ int mi_format_new(struct mft_inode *mi, struct ntfs_sb_info *sbi, CLST rno,
 	int err;
 	u16 seq = 1;
 	struct MFT_REC *rec;
-	u64 vbo = (u64)rno << sbi->record_bits;
 
 	err = mi_init(mi, sbi, rno);
 	if (err)
@@ -384,23 +445,10 @@ int mi_format_new(struct mft_inode *mi, struct ntfs_sb_info *sbi, CLST rno,
 	rec->flags = RECORD_FLAG_IN_USE | flags;
 
 	mi->dirty = true;
+	mi->is_mft = is_mft;
 
-	if (!mi->nb.nbufs) {
-		struct ntfs_inode *ni = sbi->mft.ni;
-		bool lock = false;
-
-		if (is_mounted(sbi) && !is_mft) {
-			down_read(&ni->file.run_lock);
-			lock = true;
-		}
-
-		err = ntfs_get_bh(sbi, &ni->file.run, vbo, sbi->record_size,
-				  &mi->nb);
-		if (lock)
-			up_read(&ni->file.run_lock);
-	}
-
-	return err;
+	/* Buffers of new record are got in mi_write */
+	return 0;
 }
 
 /*
@@ -224,6 +224,84 @@ bool run_lookup_entry(const struct runs_tree *run, CLST vcn, CLST *lcn,
 	return true;
 }
 
+/*
+ * run_build_map
+ *
+ * builds flat translation array of 'run': entry 'i' is the index of
+ * run which contains vcn (i << shift) or the first run after it.
+ * returns array of 'entries' items or NULL
+ */
+u32 *run_build_map(const struct runs_tree *run, u8 shift, size_t *entries)
+{
+	const struct ntfs_run *r, *end;
+	size_t i, n;
+	u32 *map;
+
+	if (!run->count || run->count > U32_MAX)
+		return NULL;
+
+	end = run->runs + run->count;
+	r = end - 1;
+	n = (((size_t)r->vcn + r->len - 1) >> shift) + 1;
+
+	map = ntfs_vmalloc(n * sizeof(u32));
+	if (!map)
+		return NULL;
+
+	for (i = 0, r = run->runs; i < n; i++) {
+		CLST vcn = (CLST)(i << shift);
+
+		while (r + 1 < end && vcn >= r->vcn + r->len)
+			r++;
+		map[i] = r - run->runs;
+	}
+
+	*entries = n;
+	return map;
+}
+
+/*
+ * run_lookup_map
+ *
+ * the same as run_lookup_entry but uses translation array
+ * built by run_build_map. Falls back to binary search if array
+ * does not cover 'vcn' or is stale
+ */
+bool run_lookup_map(const struct runs_tree *run, const u32 *map,
+		    size_t entries, u8 shift, CLST vcn, CLST *lcn, CLST *len,
+		    size_t *index)
+{
+	size_t i = vcn >> shift;
+	const struct ntfs_run *r, *end;
+	CLST gap;
+
+	if (!map || i >= entries || map[i] >= run->count)
+		return run_lookup_entry(run, vcn, lcn, len, index);
+
+	end = run->runs + run->count;
+	r = run->runs + map[i];
+
+	while (vcn >= r->vcn + r->len) {
+		if (++r >= end)
+			return false;
+	}
+
+	if (vcn < r->vcn) {
+		/* Runs were changed after map was built */
+		return run_lookup_entry(run, vcn, lcn, len, index);
+	}
+
+	gap = vcn - r->vcn;
+	*lcn = r->lcn == SPARSE_LCN ? SPARSE_LCN : (r->lcn + gap);
+
+	if (len)
+		*len = r->len - gap;
+	if (index)
+		*index = r - run->runs;
+
+	return true;
+}
+
 /*
  * run_truncate_head
  *
@@ -490,6 +568,71 @@ requires_new_range:
 	return true;
 }
 
+/*
+ * run_add_entries
+ *
+ * adds 'count' extents one after another starting from 'vcn'
+ * 'vcn' of extents is ignored. Extents after the last run are appended
+ * with one (re)allocation of storage, else run_add_entry is used
+ * returns false if of memory
+ */
+bool run_add_entries(struct runs_tree *run, CLST vcn,
+		     const struct ntfs_run *ext, size_t count, bool is_mft)
+{
+	struct ntfs_run *r, *new_ptr;
+	size_t i, bytes;
+
+	r = run->count ? run->runs + run->count - 1 : NULL;
+	if (r && r->vcn + r->len > vcn) {
+		/* overlaps existing runs */
+		for (i = 0; i < count; vcn += ext[i++].len) {
+			if (!run_add_entry(run, vcn, ext[i].lcn, ext[i].len,
+					   is_mft))
+				return false;
+		}
+		return true;
+	}
+
+	bytes = (run->count + count) * sizeof(struct ntfs_run);
+	if (run->allocated < bytes) {
+		/* Use power of 2 for 'bytes'*/
+		bytes = max_t(size_t, 64, roundup_pow_of_two(bytes));
+		WARN_ON(!is_mft && bytes > NTFS3_RUN_MAX_BYTES);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+		new_ptr = ntfs_vmalloc(bytes);
+#else
+		new_ptr = kmalloc(bytes, GFP_KERNEL | __GFP_NOWARN);
+		if (!new_ptr)
+			new_ptr = vmalloc(bytes);
+#endif
+		if (!new_ptr)
+			return false;
+
+		memcpy(new_ptr, run->runs, run->count * sizeof(struct ntfs_run));
+		ntfs_vfree(run->runs);
+		run->runs = new_ptr;
+		run->allocated = bytes;
+		r = run->count ? run->runs + run->count - 1 : NULL;
+	}
+
+	for (i = 0; i < count; vcn += ext[i++].len) {
+		if (r && r->vcn + r->len == vcn && r->lcn != SPARSE_LCN &&
+		    r->lcn + r->len == ext[i].lcn) {
+			/* continues previous run */
+			r->len += ext[i].len;
+			continue;
+		}
+
+		r = run->runs + run->count++;
+		r->vcn = vcn;
+		r->lcn = ext[i].lcn;
+		r->len = ext[i].len;
+	}
+
+	return true;
+}
+
 /*helper for attr_collapse_range, which is helper for fallocate(collapse_range)*/
 bool run_collapse_range(struct runs_tree *run, CLST vcn, CLST len)
 {
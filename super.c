@@ -221,7 +221,9 @@ enum Opt {
 	Opt_noatime,
 	Opt_nls,
 	Opt_prealloc,
+	Opt_compress_big,
 	Opt_no_acs_rules,
+	Opt_alloc,
 	Opt_err,
 };
 
@@ -241,7 +243,9 @@ static const match_table_t ntfs_tokens = {
 	{ Opt_showmeta, "showmeta" },
 	{ Opt_nls, "nls=%s" },
 	{ Opt_prealloc, "prealloc" },
+	{ Opt_compress_big, "compress_big" },
 	{ Opt_no_acs_rules, "no_acs_rules" },
+	{ Opt_alloc, "alloc=%s" },
 	{ Opt_err, NULL },
 };
 
@@ -253,6 +257,7 @@ static noinline int ntfs_parse_options(struct super_block *sb, char *options,
 	substring_t args[MAX_OPT_ARGS];
 	int option;
 	char nls_name[30];
+	char policy[8];
 	struct nls_table *nls;
 
 	opts->fs_uid = current_uid();
@@ -348,9 +353,23 @@ static noinline int ntfs_parse_options(struct super_block *sb, char *options,
 		case Opt_prealloc:
 			opts->prealloc = 1;
 			break;
+		case Opt_compress_big:
+			opts->compress_big = 1;
+			break;
 		case Opt_no_acs_rules:
 			opts->no_acs_rules = 1;
 			break;
+		case Opt_alloc:
+			match_strlcpy(policy, &args[0], sizeof(policy));
+			if (!strcmp(policy, "first"))
+				opts->alloc = NTFS_ALLOC_FIRST_FIT;
+			else if (!strcmp(policy, "best"))
+				opts->alloc = NTFS_ALLOC_BEST_FIT;
+			else if (!strcmp(policy, "auto"))
+				opts->alloc = NTFS_ALLOC_AUTO;
+			else
+				return -EINVAL;
+			break;
 		default:
 			if (!silent)
 				ntfs_err(
@@ -383,6 +402,27 @@ out:
 	return 0;
 }
 
+/*
+ * ntfs_set_alloc_policy
+ *
+ * ssd keeps free space dense (first-fit near hint)
+ * hdd minimizes seeks (best-fit of contiguous extents)
+ */
+static void ntfs_set_alloc_policy(struct ntfs_sb_info *sbi)
+{
+	struct request_queue *rq = bdev_get_queue(sbi->sb->s_bdev);
+	u32 alloc = sbi->options.alloc;
+
+	if (alloc == NTFS_ALLOC_AUTO) {
+		alloc = rq && blk_queue_nonrot(rq) ? NTFS_ALLOC_FIRST_FIT
+						   : NTFS_ALLOC_BEST_FIT;
+	}
+
+	sbi->used.find_flags = alloc == NTFS_ALLOC_FIRST_FIT
+				       ? BITMAP_FIND_FIRST_FIT
+				       : BITMAP_FIND_BEST_FIT;
+}
+
 static int ntfs_remount(struct super_block *sb, int *flags, char *data)
 {
 	int err, ro_rw;
@@ -425,6 +465,7 @@ static int ntfs_remount(struct super_block *sb, int *flags, char *data)
 	}
 
 	clear_mount_options(&old_opts);
+	ntfs_set_alloc_policy(sbi);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
 	*flags = (*flags & ~SB_LAZYTIME) | (sb->s_flags & SB_LAZYTIME) |
@@ -467,6 +508,10 @@ static void ntfs_i_callback(struct rcu_head *head)
 	struct inode *inode = container_of(head, struct inode, i_rcu);
 	struct ntfs_inode *ni = ntfs_i(inode);
 
+	/* Cached symlink target (see ntfs_get_link) */
+	if (S_ISLNK(inode->i_mode))
+		kfree(inode->i_link);
+
 	mutex_destroy(&ni->ni_lock);
 
 	kmem_cache_free(ntfs_inode_cachep, ni);
@@ -487,6 +532,10 @@ static void init_once(void *foo)
 /* noinline to reduce binary size*/
 static noinline void put_ntfs(struct ntfs_sb_info *sbi)
 {
+	u32 i;
+
+	ntfs_usn_close(sbi);
+
 	ntfs_free(sbi->new_rec);
 	ntfs_vfree(ntfs_put_shared(sbi->upcase));
 	ntfs_free(sbi->def_table);
@@ -496,6 +545,7 @@ static noinline void put_ntfs(struct ntfs_sb_info *sbi)
 
 	if (sbi->mft.ni)
 		iput(&sbi->mft.ni->vfs_inode);
+	ntfs_vfree(sbi->mft.run_map);
 
 	if (sbi->security.ni)
 		iput(&sbi->security.ni->vfs_inode);
@@ -515,7 +565,8 @@ static noinline void put_ntfs(struct ntfs_sb_info *sbi)
 	indx_clear(&sbi->security.index_sdh);
 	indx_clear(&sbi->reparse.index_r);
 	indx_clear(&sbi->objid.index_o);
-	ntfs_free(sbi->compress.lznt);
+	for (i = 0; i < ARRAY_SIZE(sbi->compress.lznt); i++)
+		ntfs_free(sbi->compress.lznt[i]);
 #ifdef CONFIG_NTFS3_LZX_XPRESS
 	xpress_free_decompressor(sbi->compress.xpress);
 	lzx_free_decompressor(sbi->compress.lzx);
@@ -529,6 +580,9 @@ static void ntfs_put_super(struct super_block *sb)
 {
 	struct ntfs_sb_info *sbi = sb->s_fs_info;
 
+	/* write records logged while evicting inodes */
+	ntfs_usn_flush(sbi);
+
 	/*mark rw ntfs as clear, if possible*/
 	ntfs_set_state(sbi, NTFS_DIRTY_CLEAR);
 
@@ -600,6 +654,12 @@ static int ntfs_show_options(struct seq_file *m, struct dentry *root)
 		seq_puts(m, ",no_acs_rules");
 	if (opts->prealloc)
 		seq_puts(m, ",prealloc");
+	if (opts->compress_big)
+		seq_puts(m, ",compress_big");
+	if (opts->alloc == NTFS_ALLOC_FIRST_FIT)
+		seq_puts(m, ",alloc=first");
+	else if (opts->alloc == NTFS_ALLOC_BEST_FIT)
+		seq_puts(m, ",alloc=best");
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
 	if (sb->s_flags & SB_POSIXACL)
 #else
@@ -624,6 +684,16 @@ static int ntfs_sync_fs(struct super_block *sb, int wait)
 	struct ntfs_inode *ni;
 	struct inode *inode;
 
+	err = ntfs_usn_flush(sbi);
+
+	ni = sbi->usn.ni;
+	if (ni) {
+		inode = &ni->vfs_inode;
+		err2 = _ni_write_inode(inode, wait);
+		if (err2 && !err)
+			err = err2;
+	}
+
 	ni = sbi->security.ni;
 	if (ni) {
 		inode = &ni->vfs_inode;
@@ -978,6 +1048,8 @@ static int ntfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (err)
 		goto out;
 
+	ntfs_set_alloc_policy(sbi);
+
 	if (!rq || !blk_queue_discard(rq) || !rq->limits.discard_granularity) {
 		;
 	} else {
@@ -1146,6 +1218,7 @@ static int ntfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 
 	sbi->mft.ni = ni;
+	ntfs_refresh_mft_map(sbi);
 
 	/* Load $BadClus */
 	ref.low = cpu_to_le32(MFT_REC_BADCLUST);
@@ -1509,6 +1582,14 @@ static int __init init_ntfs_fs(void)
 	if (err)
 		return err;
 
+	err = ntfs3_init_frame_bufs();
+	if (err)
+		goto out3;
+
+	err = ntfs3_init_index();
+	if (err)
+		goto out2;
+
 	ntfs_inode_cachep = kmem_cache_create(
 		"ntfs_inode_cache", sizeof(struct ntfs_inode), 0,
 		(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT),
@@ -1526,6 +1607,10 @@ static int __init init_ntfs_fs(void)
 out:
 	kmem_cache_destroy(ntfs_inode_cachep);
 out1:
+	ntfs3_exit_index();
+out2:
+	ntfs3_exit_frame_bufs();
+out3:
 	ntfs3_exit_bitmap();
 	return err;
 }
@@ -1538,6 +1623,8 @@ static void __exit exit_ntfs_fs(void)
 	}
 
 	unregister_filesystem(&ntfs_fs_type);
+	ntfs3_exit_index();
+	ntfs3_exit_frame_bufs();
 	ntfs3_exit_bitmap();
 }
 
@@ -1018,6 +1018,7 @@ static noinline int ntfs_setxattr(const struct xattr_handler *handler,
 	struct ntfs_inode *ni = ntfs_i(inode);
 	size_t name_len = strlen(name);
 	enum FILE_ATTRIBUTE new_fa;
+	u32 usn_reason = USN_REASON_EA_CHANGE;
 
 	/* Dispatch request */
 	if (name_len == sizeof(SYSTEM_DOS_ATTRIB) - 1 &&
@@ -1043,6 +1044,7 @@ static noinline int ntfs_setxattr(const struct xattr_handler *handler,
 				goto out;
 		}
 set_new_fa:
+		usn_reason = USN_REASON_BASIC_INFO_CHANGE;
 		/*
 		 * Thanks Mark Harmstone:
 		 * keep directory bit consistency
@@ -1074,6 +1076,8 @@ set_new_fa:
 		bool inserted;
 		struct ATTR_STD_INFO5 *std;
 
+		usn_reason = USN_REASON_SECURITY_CHANGE;
+
 		if (!is_ntfs3(ni->mi.sbi)) {
 			/*
 			 * we should replace ATTR_SECURE
@@ -1135,6 +1139,9 @@ set_new_fa:
 	err = ntfs_set_ea(inode, name, name_len, value, size, flags, 0);
 
 out:
+	if (!err)
+		ntfs_usn_change(ni, usn_reason);
+
 	return err;
 }
 